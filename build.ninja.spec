@@ -151,9 +151,23 @@ bundle libnghttp2.a
 
 bundle libparfetch.a
 	CFLAGS += -I$srcdir/vendor/curl/include $CFLAGS_libcrypto $CFLAGS_libevent
+	checksum.c
+	daemon.c
+	extract.c
+	filebuf.c
+	hosthealth.c
+	hostlimits.c
 	loop.c
+	manifest.c
+	mirrordb.c
 	parfetch.c
 	progress.c
+	ratelimit.c
+	redirectdb.c
+	serve.c
+	sha256mb.c
+	store.c
+	verifydb.c
 
 bin parfetch
 	LDADD += $LDADD_libcrypto $LDADD_libevent $LDADD_libssl $LDADD_zlib
@@ -0,0 +1,496 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libias/array.h>
+#include <libias/flow.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include <openssl/evp.h>
+
+#include "checksum.h"
+#include "sha256mb.h"
+
+// Existing distfiles are hashed with large blocking reads straight
+// from the workqueue threads. Regular files never block in the
+// sense of poll(2), so going through an event loop only costs an
+// extra round trip per chunk. The file is announced as being read
+// sequentially so the kernel reads ahead aggressively and the
+// hashing is bound by the disk and not by syscalls.
+//
+// mmap(2) was considered but a file that is truncated while it is
+// mapped kills the process with SIGBUS and large reads are just as
+// fast for a single sequential pass over the file.
+//
+// Ports like the Cargo based ones have hundreds of small distfiles
+// where the hashing itself is quick and the cost per file matters.
+// The buffer is kept for all files a thread hashes instead of being
+// allocated and mapped again for each one, and files that fit into
+// it in one read are not announced at all.
+//
+// Such files can also be hashed as a batch with multi-buffer SHA-256
+// on CPUs with AVX2 or AVX-512. Each file of the batch gets a lane
+// and its share of the buffer and SHA256 is computed for all of them
+// at once. Any other algorithm of CHECKSUM_ALGORITHMS still goes
+// through OpenSSL. On CPUs with the SHA extensions OpenSSL is as
+// fast or faster on its own and is used by default. `parfetch -B`
+// compares the backends on the local machine.
+
+struct Checksum {
+	char *buf;
+	const char *backend;
+	size_t lanes;
+	enum SHA256MBBackend mb;
+};
+
+// All digests of CHECKSUM_ALGORITHMS are computed in the same pass
+// over the data. Their implementations are looked up once here and
+// not by every context that is (re)initialized with them.
+struct ChecksumAlgorithms {
+	size_t len;
+	char *name[CHECKSUM_MAX_ALGORITHMS];
+	const EVP_MD *md[CHECKSUM_MAX_ALGORITHMS];
+};
+
+struct ChecksumCtx {
+	struct ChecksumAlgorithms *algorithms;
+	EVP_MD_CTX *ctx[CHECKSUM_MAX_ALGORITHMS];
+	// Digests that were computed outside of OpenSSL
+	bool done[CHECKSUM_MAX_ALGORITHMS];
+	struct ChecksumDigest digest[CHECKSUM_MAX_ALGORITHMS];
+};
+
+static const struct {
+	const char *name;
+	enum SHA256MBBackend mb;
+} checksum_backends[] = {
+	{ "avx2", SHA256MB_AVX2 },
+	{ "avx512", SHA256MB_AVX512 },
+};
+
+// Prototypes
+static ssize_t checksum_algorithms_sha256(struct ChecksumAlgorithms *);
+static const EVP_MD *checksum_md_fetch(const char *);
+static void checksum_md_free(const EVP_MD *);
+
+// Use the named backend or pick the fastest one for this CPU if
+// backend is NULL. Returns NULL if the backend is unknown or not
+// supported by the CPU.
+struct Checksum *
+checksum_new(const char *backend)
+{
+	const char *name = "evp";
+	size_t lanes = 1;
+	enum SHA256MBBackend mb = SHA256MB_AVX2;
+	if (backend) {
+		if (strcmp(backend, "evp") != 0) {
+			size_t i;
+			for (i = 0; i < sizeof(checksum_backends) / sizeof(checksum_backends[0]); i++) {
+				if (strcmp(checksum_backends[i].name, backend) == 0) {
+					break;
+				}
+			}
+			if (i == sizeof(checksum_backends) / sizeof(checksum_backends[0]) || !sha256mb_supported(checksum_backends[i].mb)) {
+				return NULL;
+			}
+			name = checksum_backends[i].name;
+			mb = checksum_backends[i].mb;
+			lanes = sha256mb_lanes(mb);
+		}
+	} else unless (sha256mb_sha_ni()) {
+		// The widest one is the fastest
+		for (size_t i = 0; i < sizeof(checksum_backends) / sizeof(checksum_backends[0]); i++) {
+			if (sha256mb_supported(checksum_backends[i].mb)) {
+				name = checksum_backends[i].name;
+				mb = checksum_backends[i].mb;
+				lanes = sha256mb_lanes(mb);
+			}
+		}
+	}
+
+	struct Checksum *this = xmalloc(sizeof(struct Checksum));
+	this->buf = xmalloc(CHECKSUM_BUFFER_SIZE);
+	this->backend = name;
+	this->lanes = lanes;
+	this->mb = mb;
+	return this;
+}
+
+void
+checksum_free(struct Checksum *this)
+{
+	if (this) {
+		free(this->buf);
+		free(this);
+	}
+}
+
+// Name of the i-th backend that checksum_new() knows about or NULL
+// past the last one
+const char *
+checksum_backend_name(size_t i)
+{
+	if (i == 0) {
+		return "evp";
+	} else if (i - 1 < sizeof(checksum_backends) / sizeof(checksum_backends[0])) {
+		return checksum_backends[i - 1].name;
+	} else {
+		return NULL;
+	}
+}
+
+const char *
+checksum_backend(struct Checksum *this)
+{
+	return this->backend;
+}
+
+// How many files checksum_files() hashes at once
+size_t
+checksum_lanes(struct Checksum *this)
+{
+	return this->lanes;
+}
+
+// Feed everything from the current offset of the file to the end
+// to ctx. Returns false with errno set on failure.
+bool
+checksum_fd(struct Checksum *this, int fd, struct ChecksumCtx *ctx)
+{
+	bool advised = false;
+	for (;;) {
+		ssize_t nread = read(fd, this->buf, CHECKSUM_BUFFER_SIZE);
+		if (nread == 0) {
+			return true;
+		} else if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		// A short read is not the end of the file. Only a read
+		// of 0 bytes is.
+		unless (checksum_ctx_update(ctx, this->buf, nread)) {
+			errno = EINVAL;
+			return false;
+		}
+		if (!advised && nread == CHECKSUM_BUFFER_SIZE) {
+			// There is more to come. Only a hint so errors
+			// are ignored.
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			advised = true;
+		}
+	}
+}
+
+// Hash up to checksum_lanes() files from their current offsets to
+// the end into the freshly reset contexts ctxs. The files are read
+// in lockstep so they should be of similar size. errors[i] is set
+// to 0 or to the errno of a failure with fds[i]. Returns false if
+// any of the files failed.
+bool
+checksum_files(struct Checksum *this, size_t n, const int *fds, struct ChecksumCtx **ctxs, int *errors)
+{
+	panic_unless(n <= this->lanes, "too many files for the checksum backend");
+
+	bool ok = true;
+	ssize_t sha256 = n > 0 ? checksum_algorithms_sha256(ctxs[0]->algorithms) : -1;
+	if (this->lanes == 1 || n == 1 || sha256 < 0) {
+		for (size_t i = 0; i < n; i++) {
+			errors[i] = 0;
+			unless (checksum_fd(this, fds[i], ctxs[i])) {
+				errors[i] = errno;
+				ok = false;
+			}
+		}
+		return ok;
+	}
+
+	// Every lane reads into its own part of the buffer. The parts
+	// are a multiple of the block size so only the last read of a
+	// file can leave a partial block.
+	size_t chunk_size = CHECKSUM_BUFFER_SIZE / this->lanes;
+	const unsigned char *data[SHA256MB_MAX_LANES];
+	size_t len[SHA256MB_MAX_LANES];
+	bool last[SHA256MB_MAX_LANES];
+	bool active[SHA256MB_MAX_LANES];
+	size_t n_active = n;
+	for (size_t i = 0; i < this->lanes; i++) {
+		data[i] = (unsigned char *)this->buf + i * chunk_size;
+		active[i] = i < n;
+		if (i < n) {
+			errors[i] = 0;
+			panic_unless(ctxs[i]->algorithms == ctxs[0]->algorithms, "hashing a batch with different checksum algorithms");
+		}
+	}
+
+	struct SHA256MB mb;
+	sha256mb_init(&mb, this->mb);
+	while (n_active > 0) {
+		for (size_t i = 0; i < this->lanes; i++) {
+			len[i] = 0;
+			last[i] = false;
+			unless (active[i]) {
+				continue;
+			}
+			while (len[i] < chunk_size) {
+				ssize_t nread = read(fds[i], this->buf + i * chunk_size + len[i], chunk_size - len[i]);
+				if (nread == 0) {
+					last[i] = true;
+					break;
+				} else if (nread < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					errors[i] = errno;
+					break;
+				}
+				len[i] += nread;
+			}
+			if (errors[i] != 0) {
+				// Its lane is not used again before the
+				// next sha256mb_init()
+				len[i] = 0;
+				active[i] = false;
+				n_active--;
+				ok = false;
+				continue;
+			}
+			// Any other algorithm is left to OpenSSL
+			for (size_t j = 0; j < ctxs[i]->algorithms->len; j++) {
+				if ((ssize_t)j != sha256 && !EVP_DigestUpdate(ctxs[i]->ctx[j], data[i], len[i])) {
+					errors[i] = EINVAL;
+				}
+			}
+		}
+
+		sha256mb_update(&mb, data, len, last);
+
+		for (size_t i = 0; i < n; i++) {
+			if (active[i] && last[i]) {
+				struct ChecksumCtx *ctx = ctxs[i];
+				sha256mb_digest(&mb, i, ctx->digest[sha256].value);
+				ctx->digest[sha256].len = SHA256MB_DIGEST_LENGTH;
+				ctx->done[sha256] = true;
+				active[i] = false;
+				n_active--;
+				if (errors[i] != 0) {
+					ok = false;
+				}
+			}
+		}
+	}
+
+	return ok;
+}
+
+const EVP_MD *
+checksum_md_fetch(const char *name)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	// Explicitly fetched digests skip the provider lookup that
+	// EVP_DigestInit_ex() otherwise does on every call
+	return EVP_MD_fetch(NULL, name, NULL);
+#else
+	return EVP_get_digestbyname(name);
+#endif
+}
+
+void
+checksum_md_free(const EVP_MD *md)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MD_free((EVP_MD *)md);
+#endif
+}
+
+// Parse a space separated list of algorithm names as used in
+// distinfo, e.g. "SHA256 SHA512". Duplicates are ignored.
+struct ChecksumAlgorithms *
+checksum_algorithms_new(struct Mempool *pool, const char *names, const char **error)
+{
+	struct ChecksumAlgorithms *this = xmalloc(sizeof(struct ChecksumAlgorithms));
+	ARRAY_FOREACH(str_split(pool, names, " "), const char *, name) {
+		if (strcmp(name, "") == 0) {
+			continue;
+		}
+		bool seen = false;
+		for (size_t i = 0; i < this->len; i++) {
+			seen = seen || strcmp(this->name[i], name) == 0;
+		}
+		if (seen) {
+			continue;
+		}
+		const EVP_MD *md = NULL;
+		if (this->len < CHECKSUM_MAX_ALGORITHMS) {
+			md = checksum_md_fetch(name);
+		}
+		unless (md) {
+			*error = str_printf(pool, "unsupported checksum algorithm: %s", name);
+			checksum_algorithms_free(this);
+			return NULL;
+		}
+		this->name[this->len] = xstrdup(name);
+		this->md[this->len] = md;
+		this->len++;
+	}
+	return this;
+}
+
+void
+checksum_algorithms_free(struct ChecksumAlgorithms *this)
+{
+	if (this) {
+		for (size_t i = 0; i < this->len; i++) {
+			free(this->name[i]);
+			checksum_md_free(this->md[i]);
+		}
+		free(this);
+	}
+}
+
+// Index of SHA256 or -1 if it is not one of the algorithms
+ssize_t
+checksum_algorithms_sha256(struct ChecksumAlgorithms *this)
+{
+	for (size_t i = 0; i < this->len; i++) {
+		if (strcmp(this->name[i], "SHA256") == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+size_t
+checksum_algorithms_len(struct ChecksumAlgorithms *this)
+{
+	return this->len;
+}
+
+const char *
+checksum_algorithms_name(struct ChecksumAlgorithms *this, size_t i)
+{
+	panic_unless(i < this->len, "invalid checksum algorithm index");
+	return this->name[i];
+}
+
+size_t
+checksum_algorithms_digest_len(struct ChecksumAlgorithms *this, size_t i)
+{
+	panic_unless(i < this->len, "invalid checksum algorithm index");
+	return EVP_MD_size(this->md[i]);
+}
+
+struct ChecksumCtx *
+checksum_ctx_new(struct ChecksumAlgorithms *algorithms)
+{
+	struct ChecksumCtx *this = xmalloc(sizeof(struct ChecksumCtx));
+	this->algorithms = algorithms;
+	for (size_t i = 0; i < algorithms->len; i++) {
+		this->ctx[i] = EVP_MD_CTX_new();
+		panic_unless(this->ctx[i], "EVP_MD_CTX_new");
+	}
+	panic_unless(checksum_ctx_reset(this), "EVP_DigestInit_ex");
+	return this;
+}
+
+void
+checksum_ctx_free(struct ChecksumCtx *this)
+{
+	if (this) {
+		for (size_t i = 0; i < this->algorithms->len; i++) {
+			EVP_MD_CTX_free(this->ctx[i]);
+		}
+		free(this);
+	}
+}
+
+bool
+checksum_ctx_reset(struct ChecksumCtx *this)
+{
+	for (size_t i = 0; i < this->algorithms->len; i++) {
+		this->done[i] = false;
+		unless (EVP_DigestInit_ex(this->ctx[i], this->algorithms->md[i], NULL)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+checksum_ctx_update(struct ChecksumCtx *this, const void *data, size_t len)
+{
+	for (size_t i = 0; i < this->algorithms->len; i++) {
+		panic_unless(!this->done[i], "updating a finished checksum");
+		unless (EVP_DigestUpdate(this->ctx[i], data, len)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+checksum_ctx_copy(struct ChecksumCtx *this, struct ChecksumCtx *other)
+{
+	panic_unless(this->algorithms == other->algorithms, "copying between different checksum algorithms");
+	for (size_t i = 0; i < this->algorithms->len; i++) {
+		this->done[i] = other->done[i];
+		this->digest[i] = other->digest[i];
+		unless (EVP_MD_CTX_copy_ex(this->ctx[i], other->ctx[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Finish all digests. digests must have room for one per
+// algorithm.
+bool
+checksum_ctx_final(struct ChecksumCtx *this, struct ChecksumDigest *digests)
+{
+	for (size_t i = 0; i < this->algorithms->len; i++) {
+		if (this->done[i]) {
+			digests[i] = this->digest[i];
+			continue;
+		}
+		unless (EVP_DigestFinal_ex(this->ctx[i], digests[i].value, &digests[i].len)) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#pragma once
+
+enum {
+	CHECKSUM_BUFFER_SIZE = 1024 * 1024,
+	CHECKSUM_MAX_ALGORITHMS = 8,
+	CHECKSUM_MAX_LANES = 16,
+};
+
+struct Checksum;
+struct ChecksumAlgorithms;
+struct ChecksumCtx;
+struct Mempool;
+
+struct ChecksumDigest {
+	uint8_t value[EVP_MAX_MD_SIZE];
+	unsigned int len;
+};
+
+struct Checksum *checksum_new(const char *);
+void checksum_free(struct Checksum *);
+const char *checksum_backend_name(size_t);
+const char *checksum_backend(struct Checksum *);
+size_t checksum_lanes(struct Checksum *);
+bool checksum_fd(struct Checksum *, int, struct ChecksumCtx *);
+bool checksum_files(struct Checksum *, size_t, const int *, struct ChecksumCtx **, int *);
+
+struct ChecksumAlgorithms *checksum_algorithms_new(struct Mempool *, const char *, const char **);
+void checksum_algorithms_free(struct ChecksumAlgorithms *);
+size_t checksum_algorithms_len(struct ChecksumAlgorithms *);
+const char *checksum_algorithms_name(struct ChecksumAlgorithms *, size_t);
+size_t checksum_algorithms_digest_len(struct ChecksumAlgorithms *, size_t);
+
+struct ChecksumCtx *checksum_ctx_new(struct ChecksumAlgorithms *);
+void checksum_ctx_free(struct ChecksumCtx *);
+bool checksum_ctx_reset(struct ChecksumCtx *);
+bool checksum_ctx_update(struct ChecksumCtx *, const void *, size_t);
+bool checksum_ctx_copy(struct ChecksumCtx *, struct ChecksumCtx *);
+bool checksum_ctx_final(struct ChecksumCtx *, struct ChecksumDigest *);
@@ -0,0 +1,615 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include <libias/array.h>
+#include <libias/flow.h>
+#include <libias/map.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "daemon.h"
+
+// Requests look like this with every string terminated by a NUL
+// byte:
+//
+//	PARFETCH 1
+//	dp_TARGET=do-fetch
+//	... more variables
+//	<empty string>
+//	-d
+//	foo-1.0.tar.gz:DEFAULT
+//	... more flags
+//	<empty string>
+//
+// The DISTDIR directory and the distinfo file (if it exists) are
+// passed along as file descriptors. We reply with the output of
+// the job followed by a NUL byte and the exit status.
+//
+// All clients share the event loop so their sockets are never
+// written to blockingly. The output of a job is queued and sent
+// whenever the client is ready for it. A client that stops reading
+// (e.g. a suspended make) is dropped once too much of it piled up.
+
+struct ParfetchDaemonConnection {
+	// Must be first so that we can get back to the connection
+	// in parfetch_daemon_request_finish()
+	struct ParfetchDaemonRequest request;
+	struct Mempool *pool;
+	struct ParfetchDaemon *daemon;
+	int fd;
+	// Reads the request and then writes the reply
+	struct event *event;
+	char *buf;
+	size_t buf_len;
+	int fds[2];
+	size_t fds_len;
+	// Reply that the client did not read yet
+	struct evbuffer *output;
+	// A job is running for the request
+	bool running;
+	// The reply is complete and we are gone once it is sent
+	bool finished;
+	// The client went away or did not keep up. Everything else
+	// for it is discarded.
+	bool dropped;
+};
+
+struct ParfetchDaemon {
+	struct Mempool *pool;
+	struct event_base *base;
+	const char *path;
+	int fd;
+	struct event *event;
+	struct Array *connections;
+	void (*request_cb)(struct ParfetchDaemonRequest *, void *);
+	void *request_cb_data;
+};
+
+// Prototypes
+static void parfetch_daemon_accept_cb(evutil_socket_t, short, void *);
+static void parfetch_daemon_connection_drop(struct ParfetchDaemonConnection *);
+static void parfetch_daemon_connection_fail(struct ParfetchDaemonConnection *, const char *);
+static void parfetch_daemon_connection_finish(struct ParfetchDaemonConnection *, bool);
+static void parfetch_daemon_connection_free(struct ParfetchDaemonConnection *);
+static bool parfetch_daemon_connection_parse(struct ParfetchDaemonConnection *);
+static void parfetch_daemon_connection_reply(struct ParfetchDaemonConnection *, const char *, size_t);
+static ssize_t parfetch_daemon_connection_write(void *, const char *, size_t);
+static void parfetch_daemon_read_cb(evutil_socket_t, short, void *);
+static bool parfetch_daemon_sockaddr(const char *, struct sockaddr_un *);
+static void parfetch_daemon_write_cb(evutil_socket_t, short, void *);
+static bool write_all(int, const char *, size_t);
+
+static const char *PARFETCH_DAEMON_VERSION = "PARFETCH 1";
+// requests are a few KB at most
+static const size_t PARFETCH_DAEMON_MAX_REQUEST_SIZE = 1024 * 1024;
+// The output of a job is a few lines per distfile and a progress
+// line every now and then. A client with this much of it unread is
+// not reading at all.
+static const size_t PARFETCH_DAEMON_MAX_OUTPUT = 1024 * 1024;
+
+struct ParfetchDaemon *
+parfetch_daemon_new(struct event_base *base, const char *path, void (*request_cb)(struct ParfetchDaemonRequest *, void *), void *request_cb_data)
+{
+	struct sockaddr_un addr;
+	unless (parfetch_daemon_sockaddr(path, &addr)) {
+		errx(1, "socket path too long: %s", path);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		err(1, "socket");
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		errx(1, "another daemon is already listening on %s", path);
+	}
+	// Remove the socket of a daemon that did not clean up after itself
+	unlink(path);
+	// Clients run jobs with our privileges so only our own user
+	// gets to connect. The umask applies to the socket from the
+	// start which a chmod(2) after bind(2) would not.
+	mode_t mask = umask(0177);
+	int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (rc == -1) {
+		err(1, "bind: %s", path);
+	}
+	if (listen(fd, SOMAXCONN) == -1) {
+		err(1, "listen: %s", path);
+	}
+	evutil_make_socket_nonblocking(fd);
+
+	struct ParfetchDaemon *this = xmalloc(sizeof(struct ParfetchDaemon));
+	this->pool = mempool_new();
+	this->base = base;
+	this->path = str_dup(this->pool, path);
+	this->fd = fd;
+	this->connections = mempool_array(this->pool);
+	this->request_cb = request_cb;
+	this->request_cb_data = request_cb_data;
+	this->event = event_new(base, fd, EV_READ | EV_PERSIST, parfetch_daemon_accept_cb, this);
+	event_add(this->event, NULL);
+
+	return this;
+}
+
+void
+parfetch_daemon_free(struct ParfetchDaemon *this)
+{
+	if (this) {
+		// Connections with running jobs are left to the
+		// caller, we only stop listening for new ones
+		event_free(this->event);
+		close(this->fd);
+		unlink(this->path);
+		while (array_len(this->connections) > 0) {
+			struct ParfetchDaemonConnection *conn = array_get(this->connections, 0);
+			if (conn->running) {
+				// Owned by a job
+				array_remove(this->connections, 0);
+				conn->daemon = NULL;
+				continue;
+			}
+			// The loop is not running anymore. Send what we
+			// can of replies that are still queued and give
+			// up on the rest.
+			if (conn->finished && !conn->dropped) {
+				evbuffer_write(conn->output, conn->fd);
+			}
+			parfetch_daemon_connection_free(conn);
+		}
+		mempool_free(this->pool);
+		free(this);
+	}
+}
+
+bool
+parfetch_daemon_sockaddr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		return false;
+	}
+	strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+	return true;
+}
+
+void
+parfetch_daemon_accept_cb(evutil_socket_t listen_fd, short what, void *userdata)
+{
+	struct ParfetchDaemon *this = userdata;
+
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) {
+		unless (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+			warn("accept");
+		}
+		return;
+	}
+	evutil_make_socket_nonblocking(fd);
+	evutil_make_socket_closeonexec(fd);
+
+	struct ParfetchDaemonConnection *conn = xmalloc(sizeof(struct ParfetchDaemonConnection));
+	conn->pool = mempool_new();
+	conn->daemon = this;
+	conn->fd = fd;
+	conn->fds[0] = conn->fds[1] = -1;
+	conn->output = evbuffer_new();
+	conn->request.distdir_fd = -1;
+	conn->request.distinfo_fd = -1;
+	conn->event = event_new(this->base, fd, EV_READ | EV_PERSIST, parfetch_daemon_read_cb, conn);
+	event_add(conn->event, NULL);
+	array_append(this->connections, conn);
+}
+
+void
+parfetch_daemon_read_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	struct ParfetchDaemonConnection *conn = userdata;
+
+	char buf[4096];
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	ssize_t len = recvmsg(fd, &msg, 0);
+	if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	} else if (len <= 0) {
+		// The client went away before sending a complete request
+		parfetch_daemon_connection_free(conn);
+		return;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *fds = (int *)CMSG_DATA(cmsg);
+		for (size_t i = 0; i < n; i++) {
+			if (conn->fds_len < sizeof(conn->fds) / sizeof(conn->fds[0])) {
+				conn->fds[conn->fds_len++] = fds[i];
+			} else {
+				close(fds[i]);
+			}
+		}
+	}
+
+	bool too_large = conn->buf_len + len > PARFETCH_DAEMON_MAX_REQUEST_SIZE;
+	unless (too_large) {
+		conn->buf = xrecallocarray(conn->buf, conn->buf_len, conn->buf_len + len, 1);
+		memcpy(conn->buf + conn->buf_len, buf, len);
+		conn->buf_len += len;
+		unless (parfetch_daemon_connection_parse(conn)) {
+			// Wait for more
+			return;
+		}
+	}
+
+	// We only write from now on
+	event_free(conn->event);
+	conn->event = event_new(conn->daemon->base, fd, EV_WRITE, parfetch_daemon_write_cb, conn);
+
+	if (too_large) {
+		parfetch_daemon_connection_fail(conn, "request too large");
+		return;
+	}
+
+	unless (conn->request.env) {
+		parfetch_daemon_connection_fail(conn, "unsupported protocol version");
+		return;
+	} else if (conn->fds_len < 1) {
+		parfetch_daemon_connection_fail(conn, "no DISTDIR descriptor received");
+		return;
+	}
+	conn->request.distdir_fd = conn->fds[0];
+	if (conn->fds_len > 1) {
+		conn->request.distinfo_fd = conn->fds[1];
+	}
+	conn->fds_len = 0;
+
+	conn->request.out = fopencookie(conn, "w", (cookie_io_functions_t){
+		.write = parfetch_daemon_connection_write,
+	});
+	unless (conn->request.out) {
+		warn("fopencookie");
+		parfetch_daemon_connection_free(conn);
+		return;
+	}
+	setvbuf(conn->request.out, NULL, _IOLBF, 0);
+
+	conn->running = true;
+	conn->daemon->request_cb(&conn->request, conn->daemon->request_cb_data);
+}
+
+void
+parfetch_daemon_write_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	struct ParfetchDaemonConnection *conn = userdata;
+	if (evbuffer_write(conn->output, fd) == -1) {
+		unless (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			// The client went away
+			parfetch_daemon_connection_drop(conn);
+		}
+	}
+	if (evbuffer_get_length(conn->output) > 0) {
+		event_add(conn->event, NULL);
+	} else if (conn->finished) {
+		parfetch_daemon_connection_free(conn);
+	}
+}
+
+ssize_t
+parfetch_daemon_connection_write(void *cookie, const char *buf, size_t len)
+{
+	// Pretend that it went out so that the job does not see
+	// errors on its output stream
+	parfetch_daemon_connection_reply(cookie, buf, len);
+	return len;
+}
+
+void
+parfetch_daemon_connection_reply(struct ParfetchDaemonConnection *conn, const char *buf, size_t len)
+{
+	if (conn->dropped) {
+		return;
+	}
+	evbuffer_add(conn->output, buf, len);
+	if (evbuffer_get_length(conn->output) > PARFETCH_DAEMON_MAX_OUTPUT) {
+		warnx("dropping a client that does not read its output");
+		parfetch_daemon_connection_drop(conn);
+	} else {
+		event_add(conn->event, NULL);
+	}
+}
+
+void
+parfetch_daemon_connection_drop(struct ParfetchDaemonConnection *conn)
+{
+	conn->dropped = true;
+	evbuffer_drain(conn->output, evbuffer_get_length(conn->output));
+	// The client sees the end of the connection right away and
+	// not only when the job is done
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+bool
+parfetch_daemon_connection_parse(struct ParfetchDaemonConnection *conn)
+{
+	enum {
+		PARSE_VERSION,
+		PARSE_ENV,
+		PARSE_ARGS,
+	} state = PARSE_VERSION;
+	struct Map *env = mempool_map(conn->pool, str_compare);
+	struct Array *args = mempool_array(conn->pool);
+
+	for (size_t start = 0, i = 0; i < conn->buf_len; i++) {
+		if (conn->buf[i] != 0) {
+			continue;
+		}
+		const char *s = conn->buf + start;
+		start = i + 1;
+		switch (state) {
+		case PARSE_VERSION:
+			state = PARSE_ENV;
+			break;
+		case PARSE_ENV:
+			if (*s == 0) {
+				state = PARSE_ARGS;
+			} else {
+				// Only the dp_* variables and sites of the
+				// port. The rest of the client's environment
+				// is none of our business.
+				const char *eq = strchr(s, '=');
+				if (eq && (str_startswith(s, "dp_") || str_startswith(s, "_MASTER_SITES_") || str_startswith(s, "_PATCH_SITES_"))) {
+					char *key = str_ndup(conn->pool, s, eq - s);
+					unless (map_contains(env, key)) {
+						map_add(env, key, str_dup(conn->pool, eq + 1));
+					}
+				}
+			}
+			break;
+		case PARSE_ARGS:
+			if (*s == 0) {
+				if (strcmp(conn->buf, PARFETCH_DAEMON_VERSION) != 0) {
+					// Let the read callback fail it
+					env = NULL;
+				}
+				conn->request.env = env;
+				conn->request.args = args;
+				return true;
+			}
+			array_append(args, str_dup(conn->pool, s));
+			break;
+		}
+	}
+
+	return false;
+}
+
+void
+parfetch_daemon_connection_fail(struct ParfetchDaemonConnection *conn, const char *msg)
+{
+	SCOPE_MEMPOOL(pool);
+	const char *reply = str_printf(pool, "parfetch daemon: %s\n", msg);
+	parfetch_daemon_connection_reply(conn, reply, strlen(reply));
+	parfetch_daemon_connection_finish(conn, false);
+}
+
+void
+parfetch_daemon_connection_finish(struct ParfetchDaemonConnection *conn, bool ok)
+{
+	if (conn->request.out) {
+		fflush(conn->request.out);
+	}
+	parfetch_daemon_connection_reply(conn, ok ? "\0\0" : "\0\1", 2);
+	conn->running = false;
+	conn->finished = true;
+	if (evbuffer_get_length(conn->output) == 0) {
+		parfetch_daemon_connection_free(conn);
+	} else unless (conn->daemon) {
+		// The daemon is shutting down and its loop with it.
+		// Send what we can.
+		evbuffer_write(conn->output, conn->fd);
+		parfetch_daemon_connection_free(conn);
+	}
+}
+
+void
+parfetch_daemon_connection_free(struct ParfetchDaemonConnection *conn)
+{
+	if (conn->daemon) {
+		for (size_t i = 0; i < array_len(conn->daemon->connections); i++) {
+			if (array_get(conn->daemon->connections, i) == conn) {
+				array_remove(conn->daemon->connections, i);
+				break;
+			}
+		}
+	}
+	if (conn->event) {
+		event_free(conn->event);
+	}
+	if (conn->request.out) {
+		// Nothing is sent from here on
+		conn->dropped = true;
+		fclose(conn->request.out);
+	}
+	evbuffer_free(conn->output);
+	for (size_t i = 0; i < conn->fds_len; i++) {
+		close(conn->fds[i]);
+	}
+	if (conn->request.distdir_fd != -1) {
+		close(conn->request.distdir_fd);
+	}
+	if (conn->request.distinfo_fd != -1) {
+		close(conn->request.distinfo_fd);
+	}
+	close(conn->fd);
+	free(conn->buf);
+	mempool_free(conn->pool);
+	free(conn);
+}
+
+void
+parfetch_daemon_request_finish(struct ParfetchDaemonRequest *request, bool ok)
+{
+	struct ParfetchDaemonConnection *conn = (struct ParfetchDaemonConnection *)request;
+	parfetch_daemon_connection_finish(conn, ok);
+}
+
+int
+parfetch_daemon_submit(const char *path, struct Array *env, struct Array *args, int distdir_fd, int distinfo_fd)
+{
+	struct sockaddr_un addr;
+	unless (parfetch_daemon_sockaddr(path, &addr)) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	char *buf = NULL;
+	size_t buf_len = 0;
+	FILE *f = open_memstream(&buf, &buf_len);
+	unless (f) {
+		err(1, "open_memstream");
+	}
+	fputs(PARFETCH_DAEMON_VERSION, f);
+	fputc(0, f);
+	ARRAY_FOREACH(env, const char *, var) {
+		fputs(var, f);
+		fputc(0, f);
+	}
+	fputc(0, f);
+	ARRAY_FOREACH(args, const char *, arg) {
+		fputs(arg, f);
+		fputc(0, f);
+	}
+	fputc(0, f);
+	fclose(f);
+
+	// The descriptors go along with the first chunk
+	int fds[2] = { distdir_fd, distinfo_fd };
+	size_t fds_len = distinfo_fd == -1 ? 1 : 2;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = buf, .iov_len = buf_len };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = CMSG_SPACE(fds_len * sizeof(int)),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(fds_len * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, fds_len * sizeof(int));
+	ssize_t sent;
+	while ((sent = sendmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+	if (sent == -1 || !write_all(fd, buf + sent, buf_len - sent)) {
+		err(1, "could not send request to daemon on %s", path);
+	}
+	free(buf);
+	shutdown(fd, SHUT_WR);
+
+	// Relay the output until the status byte
+	bool status_next = false;
+	for (;;) {
+		char reply[4096];
+		ssize_t len = read(fd, reply, sizeof(reply));
+		if (len == -1 && errno == EINTR) {
+			continue;
+		} else if (len <= 0) {
+			errx(1, "lost connection to daemon on %s", path);
+		}
+		for (ssize_t i = 0; i < len; i++) {
+			if (status_next) {
+				fflush(stdout);
+				close(fd);
+				return (unsigned char)reply[i];
+			} else if (reply[i] == 0) {
+				status_next = true;
+			} else {
+				putchar(reply[i]);
+			}
+		}
+		fflush(stdout);
+	}
+}
+
+bool
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		} else if (written <= 0) {
+			return false;
+		}
+		buf += written;
+		len -= written;
+	}
+	return true;
+}
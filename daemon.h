@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#pragma once
+
+struct Array;
+struct Map;
+struct ParfetchDaemon;
+struct event_base;
+
+struct ParfetchDaemonRequest {
+	// dp_* variables and sites of the client
+	struct Map *env;
+	// -d and -p flags and their arguments
+	struct Array *args;
+	int distdir_fd;
+	// -1 if the client has no distinfo file
+	int distinfo_fd;
+	FILE *out;
+};
+
+struct ParfetchDaemon *parfetch_daemon_new(struct event_base *, const char *, void (*)(struct ParfetchDaemonRequest *, void *), void *);
+void parfetch_daemon_free(struct ParfetchDaemon *);
+void parfetch_daemon_request_finish(struct ParfetchDaemonRequest *, bool);
+int parfetch_daemon_submit(const char *, struct Array *, struct Array *, int, int);
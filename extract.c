@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+
+#include <libias/flow.h>
+#include <libias/mem.h>
+
+#include "extract.h"
+
+// Distfiles are piped into an extractor like tar(1) while they
+// are downloaded. The pipe is non-blocking so that a slow
+// extractor never stalls the transfers. Data it cannot take yet
+// is kept in a backlog that is drained once the pipe is writable
+// again. If the backlog grows too large we give up on streaming
+// instead of holding the whole distfile in memory.
+//
+// The extractor inherits the write end of a second pipe. It only
+// sees EOF once the extractor and everything it started are gone
+// which tells us when to reap it without having to handle
+// SIGCHLD.
+
+struct Extractor {
+	struct event_base *base;
+	pid_t pid;
+	int stdin_fd;
+	int exit_fd;
+	struct event *write_event;
+	struct event *exit_event;
+	off_t offset;
+	char *backlog;
+	size_t backlog_len;
+	size_t backlog_start;
+	size_t backlog_cap;
+	bool failed;
+	bool finishing;
+	void (*finished_cb)(struct Extractor *, bool, void *);
+	void *finished_cb_data;
+};
+
+enum {
+	EXTRACT_MAX_BACKLOG = 64 * 1024 * 1024,
+};
+
+// Prototypes
+static void extract_close_stdin(struct Extractor *);
+static void extract_exit_cb(evutil_socket_t, short, void *);
+static int extract_remove_cb(const char *, const struct stat *, int, struct FTW *);
+static void extract_write_cb(evutil_socket_t, short, void *);
+
+// Run cmd with sh(1) in dir with its standard input connected to
+// us. Returns NULL with errno set on failure.
+struct Extractor *
+extract_new(struct event_base *base, const char *cmd, const char *dir)
+{
+	int stdin_fds[2];
+	int exit_fds[2];
+	if (pipe2(stdin_fds, O_CLOEXEC) == -1) {
+		return NULL;
+	}
+	if (pipe2(exit_fds, O_CLOEXEC) == -1) {
+		int saved_errno = errno;
+		close(stdin_fds[0]);
+		close(stdin_fds[1]);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		int saved_errno = errno;
+		close(stdin_fds[0]);
+		close(stdin_fds[1]);
+		close(exit_fds[0]);
+		close(exit_fds[1]);
+		errno = saved_errno;
+		return NULL;
+	} else if (pid == 0) {
+		// Only async-signal-safe calls from here on since the
+		// checksum threads might be running
+		if (chdir(dir) == -1 ||
+		    dup2(stdin_fds[0], STDIN_FILENO) == -1 ||
+		    fcntl(exit_fds[1], F_SETFD, 0) == -1) {
+			_exit(127);
+		}
+		signal(SIGPIPE, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", cmd, NULL);
+		_exit(127);
+	}
+	close(stdin_fds[0]);
+	close(exit_fds[1]);
+
+	struct Extractor *this = xmalloc(sizeof(struct Extractor));
+	this->base = base;
+	this->pid = pid;
+	this->stdin_fd = stdin_fds[1];
+	this->exit_fd = exit_fds[0];
+	if (fcntl(this->stdin_fd, F_SETFL, O_NONBLOCK) == -1) {
+		err(1, "fcntl");
+	}
+	this->write_event = event_new(base, this->stdin_fd, EV_WRITE, extract_write_cb, this);
+	this->exit_event = event_new(base, this->exit_fd, EV_READ | EV_PERSIST, extract_exit_cb, this);
+	return this;
+}
+
+void
+extract_free(struct Extractor *this)
+{
+	if (this) {
+		if (this->pid != -1) {
+			kill(this->pid, SIGTERM);
+			while (waitpid(this->pid, NULL, 0) == -1 && errno == EINTR);
+		}
+		extract_close_stdin(this);
+		event_free(this->write_event);
+		event_free(this->exit_event);
+		close(this->exit_fd);
+		free(this->backlog);
+		free(this);
+	}
+}
+
+// Number of bytes passed to extract_write() so far
+off_t
+extract_offset(struct Extractor *this)
+{
+	return this->offset;
+}
+
+// Returns false once the extractor is no longer usable, i.e. it
+// went away or could not keep up.
+bool
+extract_write(struct Extractor *this, const char *data, size_t len)
+{
+	if (this->failed) {
+		return false;
+	}
+	panic_if(this->finishing, "extract_write() after extract_finish()");
+	this->offset += len;
+
+	if (this->backlog_len == this->backlog_start) {
+		ssize_t nwritten = write(this->stdin_fd, data, len);
+		if (nwritten == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				this->failed = true;
+				return false;
+			}
+			nwritten = 0;
+		}
+		data += nwritten;
+		len -= nwritten;
+		if (len == 0) {
+			return true;
+		}
+	}
+
+	if (this->backlog_start > 0) {
+		memmove(this->backlog, this->backlog + this->backlog_start, this->backlog_len - this->backlog_start);
+		this->backlog_len -= this->backlog_start;
+		this->backlog_start = 0;
+	}
+	if (this->backlog_len + len > EXTRACT_MAX_BACKLOG) {
+		this->failed = true;
+		return false;
+	}
+	if (this->backlog_len + len > this->backlog_cap) {
+		size_t cap = MAX(this->backlog_len + len, 2 * this->backlog_cap);
+		this->backlog = xrecallocarray(this->backlog, this->backlog_cap, cap, 1);
+		this->backlog_cap = cap;
+	}
+	memcpy(this->backlog + this->backlog_len, data, len);
+	this->backlog_len += len;
+	event_add(this->write_event, NULL);
+	return true;
+}
+
+// Close the input of the extractor once it has everything and
+// call finished_cb when it exits. ok is only true if it exited
+// with 0.
+void
+extract_finish(struct Extractor *this, void (*finished_cb)(struct Extractor *, bool, void *), void *userdata)
+{
+	this->finishing = true;
+	this->finished_cb = finished_cb;
+	this->finished_cb_data = userdata;
+	if (this->failed || this->backlog_len == this->backlog_start) {
+		extract_close_stdin(this);
+	}
+	event_add(this->exit_event, NULL);
+}
+
+void
+extract_close_stdin(struct Extractor *this)
+{
+	if (this->stdin_fd != -1) {
+		event_del(this->write_event);
+		close(this->stdin_fd);
+		this->stdin_fd = -1;
+	}
+}
+
+void
+extract_write_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	struct Extractor *this = userdata;
+	ssize_t nwritten = write(this->stdin_fd, this->backlog + this->backlog_start, this->backlog_len - this->backlog_start);
+	if (nwritten == -1) {
+		if (errno != EAGAIN && errno != EINTR) {
+			// The exit callback reports it if we are finishing
+			this->failed = true;
+			extract_close_stdin(this);
+			return;
+		}
+		nwritten = 0;
+	}
+	this->backlog_start += nwritten;
+	if (this->backlog_start < this->backlog_len) {
+		event_add(this->write_event, NULL);
+	} else {
+		this->backlog_start = 0;
+		this->backlog_len = 0;
+		if (this->finishing) {
+			extract_close_stdin(this);
+		}
+	}
+}
+
+void
+extract_exit_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	struct Extractor *this = userdata;
+	char buf[64];
+	ssize_t nread = read(this->exit_fd, buf, sizeof(buf));
+	if (nread > 0 || (nread == -1 && (errno == EAGAIN || errno == EINTR))) {
+		return;
+	}
+	event_del(this->exit_event);
+
+	// Closed early because of a failed write or the extractor
+	// is gone
+	extract_close_stdin(this);
+	int status = 0;
+	while (waitpid(this->pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			status = -1;
+			break;
+		}
+	}
+	this->pid = -1;
+	bool ok = !this->failed && status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	this->finished_cb(this, ok, this->finished_cb_data);
+}
+
+int
+extract_remove_cb(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+	if (remove(path) == -1 && errno != ENOENT) {
+		return -1;
+	}
+	return 0;
+}
+
+// Remove path and everything below it like rm -rf
+bool
+extract_remove(const char *path)
+{
+	if (nftw(path, extract_remove_cb, 16, FTW_DEPTH | FTW_PHYS) == -1 && errno != ENOENT) {
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libias/flow.h>
+#include <libias/mem.h>
+
+#include "filebuf.h"
+
+// Collects consecutive writes to a file in a few large chunks and
+// writes them out with a single pwritev(2) once they are full.
+// curl hands us the data in small pieces and writing each of them
+// on its own costs a syscall every 16 KiB.
+//
+// The chunks are aligned and the first buffered byte is placed at
+// the same offset inside its block as it has in the file. With
+// direct_fd set, which is expected to be opened with O_DIRECT, the
+// aligned middle part of a flush then goes to it and only the
+// unaligned head and tail go through fd and the buffer cache.
+
+enum {
+	FILEBUF_CHUNKS = 4,
+};
+
+struct FileBuffer {
+	int fd;
+	int direct_fd;
+	// File offset of position 0 in the chunks, always aligned
+	off_t base;
+	// Buffered bytes are at [start, end)
+	size_t start;
+	size_t end;
+	char *chunks[FILEBUF_CHUNKS];
+};
+
+// Prototypes
+static bool filebuf_pwritev(struct FileBuffer *, int, size_t, size_t);
+
+static const size_t FILEBUF_ALIGN = 4096;
+static const size_t FILEBUF_CHUNK_SIZE = 256 * 1024;
+
+struct FileBuffer *
+filebuf_new(int fd, int direct_fd)
+{
+	struct FileBuffer *this = xmalloc(sizeof(struct FileBuffer));
+	this->fd = fd;
+	this->direct_fd = direct_fd;
+	return this;
+}
+
+void
+filebuf_free(struct FileBuffer *this)
+{
+	if (this) {
+		for (size_t i = 0; i < FILEBUF_CHUNKS; i++) {
+			free(this->chunks[i]);
+		}
+		free(this);
+	}
+}
+
+bool
+filebuf_write(struct FileBuffer *this, off_t offset, const char *data, size_t len)
+{
+	if (this->start < this->end && offset != this->base + (off_t)this->end) {
+		// Not a continuation of what we have
+		unless (filebuf_flush(this)) {
+			return false;
+		}
+	}
+	if (this->start == this->end) {
+		this->base = offset - offset % FILEBUF_ALIGN;
+		this->start = this->end = offset % FILEBUF_ALIGN;
+	}
+
+	while (len > 0) {
+		if (this->end == FILEBUF_CHUNKS * FILEBUF_CHUNK_SIZE) {
+			unless (filebuf_flush(this)) {
+				return false;
+			}
+		}
+		size_t i = this->end / FILEBUF_CHUNK_SIZE;
+		size_t pos = this->end % FILEBUF_CHUNK_SIZE;
+		unless (this->chunks[i]) {
+			if ((errno = posix_memalign((void **)&this->chunks[i], FILEBUF_ALIGN, FILEBUF_CHUNK_SIZE)) != 0) {
+				return false;
+			}
+		}
+		size_t n = MIN(len, FILEBUF_CHUNK_SIZE - pos);
+		memcpy(this->chunks[i] + pos, data, n);
+		this->end += n;
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+bool
+filebuf_flush(struct FileBuffer *this)
+{
+	if (this->start == this->end) {
+		return true;
+	}
+
+	bool ok;
+	size_t head = this->start + (FILEBUF_ALIGN - this->start % FILEBUF_ALIGN) % FILEBUF_ALIGN;
+	size_t tail = this->end - this->end % FILEBUF_ALIGN;
+	if (this->direct_fd != -1 && head < tail) {
+		ok = filebuf_pwritev(this, this->fd, this->start, head) &&
+			filebuf_pwritev(this, this->direct_fd, head, tail) &&
+			filebuf_pwritev(this, this->fd, tail, this->end);
+	} else {
+		ok = filebuf_pwritev(this, this->fd, this->start, this->end);
+	}
+
+	// Continue right after the flushed bytes. A write error
+	// throws the buffered bytes away.
+	off_t offset = this->base + this->end;
+	this->base = offset - offset % FILEBUF_ALIGN;
+	this->start = this->end = offset % FILEBUF_ALIGN;
+
+	return ok;
+}
+
+bool
+filebuf_pwritev(struct FileBuffer *this, int fd, size_t from, size_t to)
+{
+	while (from < to) {
+		struct iovec iov[FILEBUF_CHUNKS];
+		int iovcnt = 0;
+		for (size_t pos = from; pos < to; iovcnt++) {
+			size_t n = MIN(to - pos, FILEBUF_CHUNK_SIZE - pos % FILEBUF_CHUNK_SIZE);
+			iov[iovcnt].iov_base = this->chunks[pos / FILEBUF_CHUNK_SIZE] + pos % FILEBUF_CHUNK_SIZE;
+			iov[iovcnt].iov_len = n;
+			pos += n;
+		}
+		ssize_t nwritten = pwritev(fd, iov, iovcnt, this->base + from);
+		if (nwritten < 0 && errno == EINTR) {
+			continue;
+		} else if (nwritten <= 0) {
+			return false;
+		}
+		from += nwritten;
+	}
+	return true;
+}
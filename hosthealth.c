@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <curl/curl.h>
+
+#include <libias/flow.h>
+#include <libias/map.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "hosthealth.h"
+#include "mirrordb.h"
+
+// A circuit breaker per host shared by all distfiles. After enough
+// connection failures in a row the host is considered down and
+// nothing is sent its way until the retry delay has passed. Then a
+// single transfer may probe it again. If that one connects the host
+// is back, otherwise it stays down for another delay.
+
+enum HostStateStatus {
+	HOST_UP,
+	HOST_DOWN,
+	HOST_PROBING,
+};
+
+struct HostState {
+	const char *host;
+	enum HostStateStatus status;
+	long failures;
+	time_t down_since;
+};
+
+struct HostHealth {
+	struct Mempool *pool;
+	// 0 to never mark a host down
+	long failure_limit;
+	time_t retry_delay;
+	struct Map *hosts;
+};
+
+struct HostHealth *
+hosthealth_new(long failure_limit, time_t retry_delay)
+{
+	struct HostHealth *this = xmalloc(sizeof(struct HostHealth));
+	this->pool = mempool_new();
+	this->failure_limit = failure_limit;
+	this->retry_delay = retry_delay;
+	this->hosts = mempool_map(this->pool, str_compare);
+	return this;
+}
+
+void
+hosthealth_free(struct HostHealth *this)
+{
+	if (this) {
+		mempool_free(this->pool);
+		free(this);
+	}
+}
+
+struct HostState *
+hosthealth_get(struct HostHealth *this, const char *url)
+{
+	SCOPE_MEMPOOL(pool);
+	const char *host = mirrordb_host(pool, url);
+	unless (host) {
+		return NULL;
+	}
+
+	struct HostState *h = map_get(this->hosts, host);
+	unless (h) {
+		h = mempool_alloc(this->pool, sizeof(struct HostState));
+		h->host = str_dup(this->pool, host);
+		h->status = HOST_UP;
+		map_add(this->hosts, h->host, h);
+	}
+	return h;
+}
+
+bool
+hosthealth_allow(struct HostHealth *this, struct HostState *h)
+{
+	unless (h) {
+		return true;
+	}
+	switch (h->status) {
+	case HOST_UP:
+		return true;
+	case HOST_DOWN:
+		if (time(NULL) - h->down_since >= this->retry_delay) {
+			h->status = HOST_PROBING;
+			return true;
+		} else {
+			return false;
+		}
+	case HOST_PROBING:
+		return false;
+	}
+	return true;
+}
+
+bool
+hosthealth_down(struct HostState *h)
+{
+	return h && h->status == HOST_DOWN;
+}
+
+bool
+hosthealth_record(struct HostHealth *this, struct HostState *h, CURL *eh, CURLcode result)
+{
+	unless (h && this->failure_limit > 0) {
+		return false;
+	}
+
+	curl_off_t connect_time = 0;
+	curl_easy_getinfo(eh, CURLINFO_CONNECT_TIME_T, &connect_time);
+	bool connect_failed = false;
+	switch (result) {
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_SSL_CONNECT_ERROR:
+		connect_failed = true;
+		break;
+	case CURLE_OPERATION_TIMEDOUT:
+		connect_failed = connect_time == 0;
+		break;
+	default:
+		break;
+	}
+
+	unless (connect_failed) {
+		if (result == CURLE_ABORTED_BY_CALLBACK && connect_time == 0) {
+			// We gave up on it ourselves before it got
+			// anywhere so it tells us nothing. Let the
+			// next transfer probe the host instead.
+			if (h->status == HOST_PROBING) {
+				h->status = HOST_DOWN;
+				h->down_since = 0;
+			}
+		} else {
+			h->status = HOST_UP;
+			h->failures = 0;
+		}
+		return false;
+	}
+
+	h->failures++;
+	if (h->status == HOST_PROBING || (h->status == HOST_UP && h->failures >= this->failure_limit)) {
+		h->status = HOST_DOWN;
+		h->down_since = time(NULL);
+		return true;
+	}
+	return false;
+}
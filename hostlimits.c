@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <curl/curl.h>
+
+#include <libias/array.h>
+#include <libias/flow.h>
+#include <libias/map.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "hostlimits.h"
+#include "mirrordb.h"
+
+// CURLMOPT_MAX_HOST_CONNECTIONS applies the same limit to every
+// host. In adaptive mode we instead hold back transfers ourselves
+// and find a limit per host: hosts that multiplex are not limited
+// at all since all their transfers share one connection. Other
+// hosts get one more connection whenever transfers are waiting and
+// the last one made them faster in total, and half as many when
+// they start refusing connections.
+
+struct HostLimit {
+	const char *host;
+	long limit;
+	long active;
+	// Transfers held back until a slot is free
+	struct Array *waiting;
+	bool multiplexed;
+	// No point in adding connections anymore
+	bool saturated;
+	// moving average of the speed of a single transfer
+	double speed;
+	double best_total;
+	long best_limit;
+};
+
+struct HostLimits {
+	struct Mempool *pool;
+	CURLM *cm;
+	long budget;
+	bool adaptive;
+	struct Map *hosts;
+};
+
+// Prototypes
+static void hostlimits_admit(struct HostLimits *, struct HostLimit *);
+static struct HostLimit *hostlimits_get(struct HostLimits *, const char *);
+static void hostlimits_sample(struct HostLimits *, struct HostLimit *, CURL *, CURLcode, long);
+
+// connections we start with on hosts we know nothing about
+static const long HOSTLIMITS_INITIAL_LIMIT = 2;
+// weight of a new sample in the moving average
+static const double HOSTLIMITS_ALPHA = 0.3;
+// another connection must make the host this much faster
+static const double HOSTLIMITS_MIN_GAIN = 1.1;
+// transfers smaller than this say more about latency than throughput
+static const curl_off_t HOSTLIMITS_MIN_SPEED_SAMPLE_SIZE = 64 * 1024;
+
+struct HostLimits *
+hostlimits_new(CURLM *cm, long budget, bool adaptive)
+{
+	struct HostLimits *this = xmalloc(sizeof(struct HostLimits));
+	this->pool = mempool_new();
+	this->cm = cm;
+	this->budget = budget;
+	this->adaptive = adaptive;
+	this->hosts = mempool_map(this->pool, str_compare);
+	return this;
+}
+
+void
+hostlimits_free(struct HostLimits *this)
+{
+	if (this) {
+		mempool_free(this->pool);
+		free(this);
+	}
+}
+
+struct HostLimit *
+hostlimits_get(struct HostLimits *this, const char *url)
+{
+	SCOPE_MEMPOOL(pool);
+	const char *host = mirrordb_host(pool, url);
+	unless (host) {
+		// Let curl sort it out
+		return NULL;
+	}
+
+	struct HostLimit *h = map_get(this->hosts, host);
+	unless (h) {
+		h = mempool_alloc(this->pool, sizeof(struct HostLimit));
+		h->host = str_dup(this->pool, host);
+		h->limit = MIN(HOSTLIMITS_INITIAL_LIMIT, this->budget);
+		h->best_limit = h->limit;
+		h->waiting = mempool_array(this->pool);
+		map_add(this->hosts, h->host, h);
+	}
+	return h;
+}
+
+void
+hostlimits_setup(struct HostLimits *this, CURL *eh)
+{
+	if (this->adaptive) {
+		// Wait for the first connection to a host instead of
+		// opening more when it might multiplex
+		curl_easy_setopt(eh, CURLOPT_PIPEWAIT, 1L);
+	}
+}
+
+void
+hostlimits_add(struct HostLimits *this, const char *url, CURL *eh)
+{
+	struct HostLimit *h = NULL;
+	if (this->adaptive) {
+		h = hostlimits_get(this, url);
+	}
+	if (h) {
+		array_append(h->waiting, eh);
+		hostlimits_admit(this, h);
+	} else {
+		curl_multi_add_handle(this->cm, eh);
+	}
+}
+
+void
+hostlimits_admit(struct HostLimits *this, struct HostLimit *h)
+{
+	while (array_len(h->waiting) > 0 && (h->multiplexed || h->active < h->limit)) {
+		CURL *eh = array_remove(h->waiting, 0);
+		h->active++;
+		curl_multi_add_handle(this->cm, eh);
+	}
+}
+
+bool
+hostlimits_waiting(struct HostLimits *this, const char *url, CURL *eh)
+{
+	unless (this->adaptive) {
+		return false;
+	}
+	struct HostLimit *h = hostlimits_get(this, url);
+	if (h) {
+		ARRAY_FOREACH(h->waiting, CURL *, waiting) {
+			if (waiting == eh) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void
+hostlimits_remove(struct HostLimits *this, const char *url, CURL *eh, CURLcode result, long response_code)
+{
+	unless (this->adaptive) {
+		return;
+	}
+	struct HostLimit *h = hostlimits_get(this, url);
+	unless (h) {
+		return;
+	}
+	for (size_t i = 0; i < array_len(h->waiting); i++) {
+		if (array_get(h->waiting, i) == eh) {
+			array_remove(h->waiting, i);
+			return;
+		}
+	}
+
+	if (h->active > 0) {
+		h->active--;
+	}
+	hostlimits_sample(this, h, eh, result, response_code);
+	hostlimits_admit(this, h);
+}
+
+void
+hostlimits_sample(struct HostLimits *this, struct HostLimit *h, CURL *eh, CURLcode result, long response_code)
+{
+	switch (result) {
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+		// Probably too many connections for the host
+		h->limit = MAX(1, h->limit / 2);
+		h->saturated = true;
+		return;
+	case CURLE_OK:
+		break;
+	default:
+		return;
+	}
+	if (response_code == 429 || response_code == 503) {
+		h->limit = MAX(1, h->limit / 2);
+		h->saturated = true;
+		return;
+	} else if (response_code != 200 && response_code != 206) {
+		return;
+	}
+
+	long http_version = CURL_HTTP_VERSION_NONE;
+	curl_easy_getinfo(eh, CURLINFO_HTTP_VERSION, &http_version);
+	if (http_version >= CURL_HTTP_VERSION_2_0) {
+		h->multiplexed = true;
+		return;
+	}
+	h->multiplexed = false;
+
+	curl_off_t size = 0;
+	curl_off_t speed = 0;
+	curl_easy_getinfo(eh, CURLINFO_SIZE_DOWNLOAD_T, &size);
+	curl_easy_getinfo(eh, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+	if (size < HOSTLIMITS_MIN_SPEED_SAMPLE_SIZE || speed <= 0) {
+		return;
+	} else if (h->speed > 0) {
+		h->speed = (1 - HOSTLIMITS_ALPHA) * h->speed + HOSTLIMITS_ALPHA * speed;
+	} else {
+		h->speed = speed;
+	}
+
+	if (h->saturated || array_len(h->waiting) == 0) {
+		return;
+	}
+	// The total speed of the host at the current limit
+	double total = h->speed * h->limit;
+	if (h->best_total == 0 || total >= h->best_total * HOSTLIMITS_MIN_GAIN) {
+		h->best_total = total;
+		h->best_limit = h->limit;
+		h->limit = MIN(h->limit + 1, this->budget);
+	} else {
+		h->limit = h->best_limit;
+		h->saturated = true;
+	}
+}
@@ -144,7 +144,7 @@ on_timeout(evutil_socket_t fd, short events, void *userdata)
 	int running_handles;
 	curl_multi_socket_action(this->cm, CURL_SOCKET_TIMEOUT, 0, &running_handles);
 	if (this->check_multi_info) {
-		this->check_multi_info(this);
+		this->check_multi_info(this->cm);
 	}
 	if (running_handles == 0 && this->finished_cb) {
 		this->finished_cb(this->finished_cb_data);
@@ -161,12 +161,15 @@ start_timeout(CURLM *multi, long timeout_ms, void *userdata)
 	} else {
 		if (timeout_ms == 0) {
 			timeout_ms = 1; // 0 means directly call socket_action, but we will do it in a bit
-			struct timeval tv;
-			tv.tv_sec = timeout_ms / 1000;
-			tv.tv_usec = (timeout_ms % 1000) * 1000;
-			evtimer_del(this->timeout);
-			evtimer_add(this->timeout, &tv);
 		}
+		// curl relies on its longer timers too, e.g. for
+		// CURLOPT_LOW_SPEED_TIME when a transfer stalls and
+		// its socket never becomes readable again
+		struct timeval tv;
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		evtimer_del(this->timeout);
+		evtimer_add(this->timeout, &tv);
 	}
 
 	return 0;
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libias/array.h>
+#include <libias/flow.h>
+#include <libias/map.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "manifest.h"
+
+// A manifest describes the distfiles of many ports, one line at a
+// time:
+//
+//	# Shared by all ports below
+//	dp_DISTDIR=/usr/ports/distfiles
+//
+//	port devel/tokei
+//	dp_DISTINFO_FILE=/usr/ports/devel/tokei/distinfo
+//	_MASTER_SITES_DEFAULT=https://codeload.github.com/XAMPPRocky/tokei/tar.gz/v12.1.2?dummy=/
+//	-d XAMPPRocky-tokei-v12.1.2_GH0.tar.gz:DEFAULT
+//
+// Variables before the first port line are the defaults of all
+// ports. Values are taken literally without any quoting.
+
+// Prototypes
+static struct Map *manifest_env(struct Mempool *, struct Map *);
+static void manifest_set(struct Mempool *, struct Map *, const char *, const char *);
+
+struct Map *
+manifest_env(struct Mempool *pool, struct Map *defaults)
+{
+	struct Map *env = mempool_map(pool, str_compare);
+	MAP_FOREACH(defaults, const char *, key, const char *, value) {
+		map_add(env, key, value);
+	}
+	return env;
+}
+
+void
+manifest_set(struct Mempool *pool, struct Map *env, const char *line, const char *eq)
+{
+	char *key = str_ndup(pool, line, eq - line);
+	if (map_contains(env, key)) {
+		map_remove(env, key);
+	}
+	map_add(env, key, str_dup(pool, eq + 1));
+}
+
+struct Array *
+manifest_load(struct Mempool *pool, FILE *f, struct Map *defaults, struct Array **errors)
+{
+	struct Array *ports = mempool_array(pool);
+	*errors = mempool_array(pool);
+	struct Map *global_env = manifest_env(pool, defaults);
+	struct ManifestPort *port = NULL;
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	size_t lineno = 0;
+	while ((linelen = getline(&line, &linecap, f)) > 0) {
+		lineno++;
+		if (line[linelen - 1] == '\n') {
+			line[--linelen] = 0;
+		}
+		if (linelen == 0 || *line == '#') {
+			continue;
+		}
+
+		const char *eq = strchr(line, '=');
+		if (str_startswith(line, "port ") && linelen > 5) {
+			port = mempool_alloc(pool, sizeof(struct ManifestPort));
+			port->name = str_dup(pool, line + 5);
+			port->env = manifest_env(pool, global_env);
+			port->args = mempool_array(pool);
+			array_append(ports, port);
+		} else if (str_startswith(line, "-d ") || str_startswith(line, "-p ")) {
+			if (port) {
+				array_append(port->args, str_ndup(pool, line, 2));
+				array_append(port->args, str_dup(pool, line + 3));
+			} else {
+				array_append(*errors, str_printf(pool, "line %zu: %s before the first port", lineno, str_ndup(pool, line, 2)));
+			}
+		} else if (eq && eq != line) {
+			if (port) {
+				manifest_set(pool, port->env, line, eq);
+			} else {
+				manifest_set(pool, global_env, line, eq);
+			}
+		} else {
+			array_append(*errors, str_printf(pool, "line %zu: cannot parse: %s", lineno, line));
+		}
+	}
+	free(line);
+
+	if (array_len(*errors) > 0) {
+		return NULL;
+	} else {
+		return ports;
+	}
+}
+
+void
+manifest_write_port(FILE *f, const char *name, struct Array *env, struct Array *args)
+{
+	fprintf(f, "port %s\n", name);
+	ARRAY_FOREACH(env, const char *, var) {
+		fprintf(f, "%s\n", var);
+	}
+	for (size_t i = 0; i + 1 < array_len(args); i += 2) {
+		fprintf(f, "%s %s\n", (const char *)array_get(args, i), (const char *)array_get(args, i + 1));
+	}
+}
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+
+#include "config.h"
+
+#include <sys/file.h>
+#include <sys/types.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include <libias/flow.h>
+#include <libias/map.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "mirrordb.h"
+
+struct MirrorDBEntry {
+	const char *host;
+	// exponentially weighted moving averages
+	double connect_time;
+	double ttfb;
+	double speed;
+	double failure_rate;
+	uintmax_t samples;
+	time_t last_seen;
+	bool dirty;
+};
+
+struct MirrorDB {
+	struct Mempool *pool;
+	const char *path;
+	struct Map *entries;
+};
+
+// Prototypes
+static struct MirrorDBEntry *mirrordb_entry(struct MirrorDB *, const char *);
+static void mirrordb_load(struct MirrorDB *, struct Map *, FILE *);
+
+// weight of a new sample in the moving averages
+static const double MIRRORDB_ALPHA = 0.3;
+// transfers smaller than this say more about latency than throughput
+static const curl_off_t MIRRORDB_MIN_SPEED_SAMPLE_SIZE = 64 * 1024;
+// seconds we assume are lost on a failed attempt
+static const double MIRRORDB_FAILURE_COST = 10;
+// forget about hosts we have not seen in a while
+static const time_t MIRRORDB_EXPIRE = 30 * 24 * 60 * 60;
+
+struct MirrorDB *
+mirrordb_new(const char *path)
+{
+	struct MirrorDB *this = xmalloc(sizeof(struct MirrorDB));
+	this->pool = mempool_new();
+	this->path = str_dup(this->pool, path);
+	this->entries = mempool_map(this->pool, str_compare);
+
+	int fd = open(this->path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		if (flock(fd, LOCK_SH) == -1) {
+			warn("flock: %s", this->path);
+		}
+		FILE *f = fdopen(fd, "r");
+		unless (f) {
+			err(1, "fdopen: %s", this->path);
+		}
+		mirrordb_load(this, this->entries, f);
+		fclose(f);
+	}
+
+	return this;
+}
+
+void
+mirrordb_free(struct MirrorDB *this)
+{
+	if (this) {
+		mempool_free(this->pool);
+		free(this);
+	}
+}
+
+void
+mirrordb_load(struct MirrorDB *this, struct Map *entries, FILE *f)
+{
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	while ((linelen = getline(&line, &linecap, f)) > 0) {
+		char *host = xmalloc(linelen);
+		struct MirrorDBEntry entry = { 0 };
+		intmax_t last_seen;
+		if (sscanf(line, "%s %lf %lf %lf %lf %ju %jd", host,
+			   &entry.connect_time, &entry.ttfb, &entry.speed,
+			   &entry.failure_rate, &entry.samples, &last_seen) == 7 &&
+		    !map_contains(entries, host)) {
+			struct MirrorDBEntry *e = mempool_alloc(this->pool, sizeof(struct MirrorDBEntry));
+			*e = entry;
+			e->host = str_dup(this->pool, host);
+			e->last_seen = last_seen;
+			map_add(entries, e->host, e);
+		}
+		free(host);
+	}
+	free(line);
+}
+
+const char *
+mirrordb_host(struct Mempool *pool, const char *url)
+{
+	const char *host = NULL;
+	CURLU *u = curl_url();
+	char *scheme = NULL;
+	char *hostname = NULL;
+	char *port = NULL;
+	if (curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK &&
+	    curl_url_get(u, CURLUPART_SCHEME, &scheme, 0) == CURLUE_OK &&
+	    curl_url_get(u, CURLUPART_HOST, &hostname, 0) == CURLUE_OK &&
+	    curl_url_get(u, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK) {
+		host = str_printf(pool, "%s://%s:%s", scheme, hostname, port);
+	}
+	curl_free(scheme);
+	curl_free(hostname);
+	curl_free(port);
+	curl_url_cleanup(u);
+	return host;
+}
+
+struct MirrorDBEntry *
+mirrordb_entry(struct MirrorDB *this, const char *url)
+{
+	SCOPE_MEMPOOL(pool);
+	const char *host = mirrordb_host(pool, url);
+	if (host) {
+		return map_get(this->entries, host);
+	} else {
+		return NULL;
+	}
+}
+
+double
+mirrordb_expected_speed(struct MirrorDB *this, const char *url)
+{
+	struct MirrorDBEntry *entry = mirrordb_entry(this, url);
+	if (entry) {
+		return entry->speed;
+	} else {
+		return 0;
+	}
+}
+
+double
+mirrordb_expected_time(struct MirrorDB *this, const char *url, off_t size)
+{
+	struct MirrorDBEntry *entry = mirrordb_entry(this, url);
+	unless (entry) {
+		return -1;
+	}
+
+	double t = entry->connect_time + entry->ttfb;
+	if (entry->speed > 0 && size > 0) {
+		t += size / entry->speed;
+	}
+	// Every failure costs us the time until we notice it and
+	// another attempt elsewhere
+	t += entry->failure_rate * MIRRORDB_FAILURE_COST;
+	double success_rate = 1.0 - entry->failure_rate;
+	if (success_rate < 0.05) {
+		success_rate = 0.05;
+	}
+	return t / success_rate;
+}
+
+void
+mirrordb_record(struct MirrorDB *this, const char *url, bool ok, curl_off_t connect_time, curl_off_t ttfb, curl_off_t total_time, curl_off_t size)
+{
+	struct MirrorDBEntry *entry = mirrordb_entry(this, url);
+	unless (entry) {
+		SCOPE_MEMPOOL(pool);
+		const char *host = mirrordb_host(pool, url);
+		unless (host) {
+			return;
+		}
+		entry = mempool_alloc(this->pool, sizeof(struct MirrorDBEntry));
+		entry->host = str_dup(this->pool, host);
+		map_add(this->entries, entry->host, entry);
+	}
+
+	double alpha = MIRRORDB_ALPHA;
+	if (entry->samples == 0) {
+		alpha = 1;
+	}
+	if (ok) {
+		entry->connect_time = (1 - alpha) * entry->connect_time + alpha * (connect_time / 1e6);
+		entry->ttfb = (1 - alpha) * entry->ttfb + alpha * (ttfb / 1e6);
+		if (size >= MIRRORDB_MIN_SPEED_SAMPLE_SIZE && total_time > ttfb) {
+			double speed = size / ((total_time - ttfb) / 1e6);
+			if (entry->speed > 0) {
+				entry->speed = (1 - MIRRORDB_ALPHA) * entry->speed + MIRRORDB_ALPHA * speed;
+			} else {
+				entry->speed = speed;
+			}
+		}
+		entry->failure_rate = (1 - alpha) * entry->failure_rate;
+	} else {
+		entry->failure_rate = (1 - alpha) * entry->failure_rate + alpha;
+	}
+	entry->samples++;
+	entry->last_seen = time(NULL);
+	entry->dirty = true;
+}
+
+void
+mirrordb_save(struct MirrorDB *this)
+{
+	SCOPE_MEMPOOL(pool);
+
+	// Other parfetch processes might have updated the database
+	// in the meantime. Merge our entries into theirs while
+	// holding the lock.
+	int fd = open(this->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		warn("open: %s", this->path);
+		return;
+	}
+	if (flock(fd, LOCK_EX) == -1) {
+		warn("flock: %s", this->path);
+		close(fd);
+		return;
+	}
+	FILE *f = fdopen(fd, "r+");
+	unless (f) {
+		err(1, "fdopen: %s", this->path);
+	}
+
+	struct Map *entries = mempool_map(pool, str_compare);
+	MAP_FOREACH(this->entries, const char *, host, struct MirrorDBEntry *, entry) {
+		if (entry->dirty) {
+			map_add(entries, host, entry);
+		}
+	}
+	mirrordb_load(this, entries, f);
+
+	if (fseeko(f, 0, SEEK_SET) == -1 || ftruncate(fd, 0) == -1) {
+		warn("could not truncate %s", this->path);
+		fclose(f);
+		return;
+	}
+	time_t now = time(NULL);
+	MAP_FOREACH(entries, const char *, host, struct MirrorDBEntry *, entry) {
+		if (now - entry->last_seen < MIRRORDB_EXPIRE) {
+			fprintf(f, "%s %.6f %.6f %.0f %.6f %ju %jd\n", host,
+				entry->connect_time, entry->ttfb, entry->speed,
+				entry->failure_rate, entry->samples, (intmax_t)entry->last_seen);
+		}
+	}
+	if (fclose(f) != 0) {
+		warn("could not write %s", this->path);
+	}
+}
@@ -1,5 +1,39 @@
 # The following options are supported:
 #
+# PARFETCH_CACHE_DIR
+# Directory where parfetch remembers how well mirrors performed in
+# previous runs. Sites are tried fastest first when it is set and
+# RANDOMIZE_SITES is not. The alt-svc and HSTS caches of curl,
+# the redirects of sites, and the digests of verified distfiles are
+# kept there too.
+#
+# PARFETCH_CHECKSUM_BACKEND
+# How existing distfiles are hashed: evp, avx2, or avx512. The
+# latter two hash batches of small files with multi-buffer SHA-256.
+# By default the fastest one for the CPU is picked. `parfetch -B
+# <file>...` compares them.
+#
+# PARFETCH_DAEMON_SOCKET
+# Socket of a running `parfetch -l <socket>` daemon. Distfiles are
+# fetched by the daemon when it is set so that all ports share its
+# connections.
+#
+# PARFETCH_DIRECT_IO
+# When defined, write distfiles with O_DIRECT to bypass the buffer
+# cache where the file system supports it.
+#
+# PARFETCH_EXTRACT
+# When defined, pipe distfiles in EXTRACT_ONLY into EXTRACT_CMD
+# while they are downloaded. The tree is used by do-extract if the
+# distfile passed its checksum. Only for ports extracting with tar.
+#
+# PARFETCH_HOST_FAILURE_LIMIT
+# Consider a host down after this many failed connection attempts
+# in a row and skip its mirrors for all distfiles. 0 disables this.
+#
+# PARFETCH_HOST_RETRY_DELAY
+# Seconds until a host that is down is tried again.
+#
 # PARFETCH_MAKESUM_EPHEMERAL
 # When defined during makesum, distinfo is created/updated but
 # no distfiles are saved to disk. Note that the files are still
@@ -13,12 +47,62 @@
 #
 # PARFETCH_MAX_HOST_CONNECTIONS
 # Sets the per host connection limit. Also see
-# CURLMOPT_MAX_HOST_CONNECTIONS(3).
+# CURLMOPT_MAX_HOST_CONNECTIONS(3). With `auto` the limit of each
+# host is adjusted at runtime based on its protocol and throughput.
+#
+# PARFETCH_MAX_HOST_SPEED
+# Limits the bandwidth used per host in bytes per second.
+#
+# PARFETCH_MAX_SPEED
+# Limits the total bandwidth in bytes per second.
 #
 # PARFETCH_MAX_TOTAL_CONNECTIONS
 # Sets the global connection limit. Also see
 # CURLMOPT_MAX_TOTAL_CONNECTIONS(3).
 #
+# PARFETCH_MIN_SPEED
+# Switch to the next mirror when a transfer is slower than this many
+# bytes per second for PARFETCH_STALL_TIME seconds.
+#
+# PARFETCH_PRIORITY
+# Either distfiles or patchfiles. Files of that kind get bandwidth
+# first when PARFETCH_MAX_SPEED or PARFETCH_MAX_HOST_SPEED is set.
+#
+# PARFETCH_RACE_MIRRORS
+# Start fetching each distfile from this many mirrors at the same
+# time and keep only the fastest one after PARFETCH_RACE_WINDOW
+# milliseconds.
+#
+# PARFETCH_RACE_WINDOW
+# Length of the probe window in milliseconds when racing mirrors.
+#
+# PARFETCH_SCHEDULE
+# Order in which distfiles are started based on their size in
+# distinfo: largest-first (default), smallest-first or none to keep
+# the order of DISTFILES and PATCHFILES.
+#
+# PARFETCH_SEGMENTS
+# Split distfiles larger than PARFETCH_SEGMENT_THRESHOLD into
+# this many byte ranges and fetch them in parallel. Needs
+# PARFETCH_MAX_HOST_CONNECTIONS > 1 to have an effect on
+# HTTP/1.1 hosts.
+#
+# PARFETCH_SEGMENT_THRESHOLD
+# Minimum distfile size in bytes for segmented fetching.
+#
+# PARFETCH_STALL_TIME
+# Seconds a transfer may be too slow before switching mirrors.
+# 0 disables stall detection.
+#
+# PARFETCH_STORE_DIR
+# Absolute path of a content-addressed store of distfiles that is
+# shared by all ports. Missing distfiles are linked from it when
+# their SHA256 is known and fetched distfiles are added to it.
+#
+# PARFETCH_STRICT_CHECKSUM
+# When defined, always hash existing distfiles instead of trusting
+# the digests of unchanged files remembered in PARFETCH_CACHE_DIR.
+#
 .if !defined(BEFOREPORTMK) && !defined(INOPTIONSMK) && \
 	!defined(_INCLUDE_PARFETCH_OVERLAY) && !defined(NO_PARFETCH) && \
 	!make(fetch-list) && !make(fetch-url-list-int) && \
@@ -45,19 +129,51 @@ PARFETCH?=	parfetch
 PARFETCH_MAX_HOST_CONNECTIONS?=		1
 PARFETCH_MAX_TOTAL_CONNECTIONS?=	4
 
+.if defined(PARFETCH_EXTRACT) && defined(EXTRACT_CMD) && ${EXTRACT_CMD} == ${TAR}
+# Inside WRKDIR so that every flavor has its own and make clean
+# removes it. clean-wrkdir below leaves it alone.
+_PARFETCH_EXTRACT_DIR=	${WRKDIR}/.parfetch-extract
+.endif
+
 _PARFETCH_ENV=	${_DO_FETCH_ENV} \
 		${_MASTER_SITES_ENV} \
 		${_PATCH_SITES_ENV} \
 		dp__PARFETCH_MAKESUM='${_PARFETCH_MAKESUM}' \
+		dp_PARFETCH_CACHE_DIR='${PARFETCH_CACHE_DIR}' \
+		dp_PARFETCH_DAEMON_SOCKET='${PARFETCH_DAEMON_SOCKET}' \
 		dp_CHECKSUM_ALGORITHMS='${CHECKSUM_ALGORITHMS:tu}' \
+		dp_PARFETCH_CHECKSUM_BACKEND='${PARFETCH_CHECKSUM_BACKEND}' \
+		dp_PARFETCH_DIRECT_IO='${PARFETCH_DIRECT_IO:Dyes}' \
+		dp_EXTRACT_ONLY='${EXTRACT_ONLY}' \
+		dp_PARFETCH_EXTRACT_CMD='${EXTRACT_CMD} ${EXTRACT_BEFORE_ARGS} - ${EXTRACT_AFTER_ARGS}' \
+		dp_PARFETCH_EXTRACT_DIR='${_PARFETCH_EXTRACT_DIR}' \
+		dp_PARFETCH_HOST_FAILURE_LIMIT='${PARFETCH_HOST_FAILURE_LIMIT}' \
+		dp_PARFETCH_HOST_RETRY_DELAY='${PARFETCH_HOST_RETRY_DELAY}' \
 		dp_PARFETCH_MAKESUM_EPHEMERAL='${PARFETCH_MAKESUM_EPHEMERAL:Dyes}' \
 		dp_PARFETCH_MAKESUM_KEEP_TIMESTAMP='${PARFETCH_MAKESUM_KEEP_TIMESTAMP:Dyes}' \
 		dp_PARFETCH_MAX_HOST_CONNECTIONS=${PARFETCH_MAX_HOST_CONNECTIONS} \
-		dp_PARFETCH_MAX_TOTAL_CONNECTIONS=${PARFETCH_MAX_TOTAL_CONNECTIONS}
+		dp_PARFETCH_MAX_HOST_SPEED='${PARFETCH_MAX_HOST_SPEED}' \
+		dp_PARFETCH_MAX_SPEED='${PARFETCH_MAX_SPEED}' \
+		dp_PARFETCH_MAX_TOTAL_CONNECTIONS=${PARFETCH_MAX_TOTAL_CONNECTIONS} \
+		dp_PARFETCH_MIN_SPEED='${PARFETCH_MIN_SPEED}' \
+		dp_PARFETCH_PRIORITY='${PARFETCH_PRIORITY}' \
+		dp_PARFETCH_RACE_MIRRORS='${PARFETCH_RACE_MIRRORS}' \
+		dp_PARFETCH_RACE_WINDOW='${PARFETCH_RACE_WINDOW}' \
+		dp_PARFETCH_SCHEDULE='${PARFETCH_SCHEDULE}' \
+		dp_PARFETCH_SEGMENTS='${PARFETCH_SEGMENTS}' \
+		dp_PARFETCH_SEGMENT_THRESHOLD='${PARFETCH_SEGMENT_THRESHOLD}' \
+		dp_PARFETCH_STALL_TIME='${PARFETCH_STALL_TIME}' \
+		dp_PARFETCH_STORE_DIR='${PARFETCH_STORE_DIR}' \
+		dp_PARFETCH_STRICT_CHECKSUM='${PARFETCH_STRICT_CHECKSUM:Dyes}'
 _DO_PARFETCH=	${SETENV} ${_PARFETCH_ENV} ${PARFETCH} \
 		${empty(DISTFILES):?:${DISTFILES:C/.*/-d '&'/}} \
 		${empty(PATCHFILES):?:${PATCHFILES:C/:-p[0-9]//:C/.*/-p '&'/}}
 
+.if !target(parfetch-manifest)
+parfetch-manifest:
+	@${_DO_PARFETCH} -M ${PKGORIGIN}
+.endif
+
 .if !target(do-fetch)
 do-fetch:
 	@${_DO_PARFETCH}
@@ -75,4 +191,43 @@ makesum:
 
 .endif
 
+.if defined(_PARFETCH_EXTRACT_DIR) && !target(clean-wrkdir)
+# The extract phase starts with an empty WRKDIR. Keep what was
+# extracted while fetching for do-extract.
+clean-wrkdir:
+	@if [ -d ${WRKDIR} ]; then \
+		${FIND} ${WRKDIR} -mindepth 1 -maxdepth 1 \
+			! -name ${_PARFETCH_EXTRACT_DIR:T} -exec ${RM} -r {} +; \
+	fi
+.endif
+
+.if defined(_PARFETCH_EXTRACT_DIR) && !target(do-extract)
+# Move trees that were extracted while fetching into place and
+# extract the other distfiles as usual. Top-level entries that more
+# than one distfile has are merged with tar.
+do-extract: ${EXTRACT_WRKDIR}
+	@for file in ${EXTRACT_ONLY}; do \
+		tree="${_PARFETCH_EXTRACT_DIR}/$$file"; \
+		if [ -d "$$tree" ]; then \
+			for f in "$$tree"/* "$$tree"/.[!.]* "$$tree"/..?*; do \
+				if [ ! -e "$$f" ] && [ ! -L "$$f" ]; then \
+					continue; \
+				elif [ -e "${EXTRACT_WRKDIR}/$${f##*/}" ]; then \
+					(cd "$$tree" && ${TAR} -cf - "$${f##*/}") | \
+						(cd ${EXTRACT_WRKDIR} && ${TAR} -xpf -) || exit 1; \
+				else \
+					${MV} "$$f" ${EXTRACT_WRKDIR}/ || exit 1; \
+				fi; \
+			done; \
+		elif ! (cd ${EXTRACT_WRKDIR} && ${EXTRACT_CMD} ${EXTRACT_BEFORE_ARGS} ${_DISTDIR}/$$file ${EXTRACT_AFTER_ARGS}); then \
+			exit 1; \
+		fi; \
+	done
+	@${RM} -r ${_PARFETCH_EXTRACT_DIR}
+	@if [ ${UID} = 0 ]; then \
+		${CHMOD} -R ug-s ${WRKDIR}; \
+		${CHOWN} -R 0:${WHEEL} ${WRKDIR}; \
+	fi
+.endif
+
 .endif
@@ -26,6 +26,8 @@
 
 #include "config.h"
 
+#include <sys/param.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <ctype.h>
@@ -35,10 +37,13 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <curl/curl.h>
@@ -61,8 +66,22 @@
 #include <libias/trait/compare.h>
 #include <libias/workqueue.h>
 
+#include "checksum.h"
+#include "daemon.h"
+#include "extract.h"
+#include "filebuf.h"
+#include "hosthealth.h"
+#include "hostlimits.h"
 #include "loop.h"
+#include "manifest.h"
+#include "mirrordb.h"
 #include "progress.h"
+#include "ratelimit.h"
+#include "redirectdb.h"
+#include "serve.h"
+#include "sha256mb.h"
+#include "store.h"
+#include "verifydb.h"
 
 enum FetchDistfileNextReason {
 	FETCH_DISTFILE_NEXT_MIRROR,
@@ -76,6 +95,18 @@ enum SitesType {
 	PATCH_SITES,
 };
 
+enum FetchPriority {
+	FETCH_PRIORITY_NONE,
+	FETCH_PRIORITY_DISTFILES,
+	FETCH_PRIORITY_PATCHFILES,
+};
+
+enum FetchSchedule {
+	FETCH_SCHEDULE_LARGEST_FIRST,
+	FETCH_SCHEDULE_SMALLEST_FIRST,
+	FETCH_SCHEDULE_NONE,
+};
+
 struct ParfetchOptions {
 	FILE *out;
 
@@ -85,135 +116,489 @@ struct ParfetchOptions {
 	const char *color_reset;
 	const char *color_warning;
 
+	const char *cache_dir;
+	const char *daemon_socket;
 	const char *distdir;
 	const char *dist_subdir;
 	const char *distinfo_file;
+	const char *extract_cmd;
+	const char *extract_dir;
+	struct Array *extract_only;
+	const char *store_dir;
 	const char *target;
 
+	struct ChecksumAlgorithms *checksum_algorithms;
+	// Names in CHECKSUM_ALGORITHMS as given for makesum
+	struct Array *checksum_algorithms_order;
+	// NULL picks the fastest one for the CPU
+	const char *checksum_backend;
 	size_t initial_distfile_check_threads;
+	long host_failure_limit;
+	time_t host_retry_delay;
 	long max_host_connections;
 	long max_total_connections;
+	bool adaptive_host_connections;
+	long segments;
+	curl_off_t segment_threshold;
+	long race_mirrors;
+	long race_window;
+	long min_speed;
+	long stall_time;
+	curl_off_t max_speed;
+	curl_off_t max_host_speed;
+	enum FetchPriority priority;
+	bool direct_io;
 	bool disable_size;
 	bool no_checksum;
 	bool makesum;
 	bool makesum_ephemeral;
 	bool makesum_keep_timestamp;
 	bool randomize_sites;
+	bool ssl_no_verify_hostname;
+	bool ssl_no_verify_peer;
+	bool strict_checksum;
 	bool want_colors;
+	enum FetchSchedule schedule;
+};
+
+// Everything needed to fetch the distfiles of one port. We run a
+// single job unless we are the daemon.
+struct ParfetchJob {
+	struct Mempool *pool;
+	struct ParfetchOptions opts;
+	// The environment sent by a client or NULL to use ours
+	struct Map *env;
+	// All paths are relative to this
+	int distdir_fd;
+	// The distinfo file sent by a client or -1
+	int distinfo_fd;
+	struct Distinfo *distinfo;
+	// "<algorithm> (<filename>)" -> struct ChecksumDigest * for
+	// everything in distinfo but SHA256
+	struct Map *distinfo_digests;
+	struct Array *distfiles;
+	// Batch jobs share the progress bar of the batch
+	struct Progress *progress;
+	bool own_progress;
+	struct MirrorDB *mirrordb;
+	CURLM *cm;
+	struct event_base *base;
+	// The first setup error
+	const char *error;
+	// Existing distfiles that are still being checksummed
+	struct InitialDistfileCheck *initial_check;
+	// Distfiles that are still being checked or fetched
+	size_t pending;
+	struct event *finished_event;
+	void (*finished_cb)(struct ParfetchJob *, void *);
+	void *finished_cb_data;
 };
 
 struct Distfile {
 	struct Mempool *pool;
+	struct ParfetchJob *job;
 	enum SitesType sites_type;
 	const char *name;
 	bool fetched;
+	// The existing file is still being checksummed
+	bool checking;
+	// Position on the command line and in the fetch schedule
+	size_t index;
+	size_t rank;
 	struct Array *groups;
 	struct Queue *queue;
-	FILE *fh;
+	// All queue entries including the ones currently fetching
+	struct Array *entries;
+	// The open partname or -1. direct_fd is a second descriptor
+	// of it opened with O_DIRECT when PARFETCH_DIRECT_IO is set.
+	int fd;
+	int direct_fd;
 	struct DistinfoEntry *distinfo;
+	// Digests of all CHECKSUM_ALGORITHMS in the same order. The
+	// first one, SHA256, is unused as it lives in distinfo. An
+	// empty digest is not recorded in distinfo.
+	struct ChecksumDigest *digests;
+	CURLM *cm;
+	struct event_base *base;
+	// Mirrors racing against each other and the timer that
+	// ends the probe window
+	struct Array *racers;
+	struct event *race_timer;
+	// Distfiles are downloaded to partname and only renamed to
+	// name once verified. The first resume_offset bytes of it are
+	// known to be good and resume_mdctx is their digest.
+	const char *partname;
+	curl_off_t resume_offset;
+	struct ChecksumCtx *resume_mdctx;
+	// partname is preallocated and written out of order by
+	// segmented transfers so after a crash its size says nothing
+	// about how much of it is good. validname holds the last good
+	// prefix we know of, valid, for the next run to resume from.
+	const char *validname;
+	curl_off_t valid;
+	// The entry currently writing to partname
+	struct DistfileQueueEntry *writer;
+	// Descriptor of partname with an exclusive flock(2) on it or
+	// -1. Other parfetch processes that want the same distfile,
+	// e.g. concurrent Poudriere builders, wait for the lock and
+	// check lock_timer again until they get it.
+	int lock_fd;
+	struct event *lock_timer;
+	// Distfiles in EXTRACT_ONLY are piped into PARFETCH_EXTRACT_CMD
+	// while they are downloaded if PARFETCH_EXTRACT_DIR is set.
+	// The extractor only exists while a transfer that started at
+	// offset 0 is going on.
+	bool extract;
+	struct Extractor *extractor;
+	// Called with the data in order as it is hashed
+	void (*data_cb)(struct Distfile *, curl_off_t, const char *, size_t, void *);
+	void *data_cb_data;
 };
 
 struct DistfileQueueEntry {
 	struct Distinfo *distinfo;
 	struct Progress *progress;
+	struct MirrorDB *mirrordb;
 	struct Distfile *distfile;
 	const char *filename;
+	const char *site;
 	const char *url;
-	EVP_MD_CTX *mdctx;
+	// url points to where site redirected us before
+	bool redirected;
+	bool redirect_failed;
+	struct HostState *host_state;
+	// Give up on the mirror when slower than this
+	long min_speed;
+	struct ChecksumCtx *mdctx;
 	curl_off_t size;
 	curl_off_t dltotal;
+	// Segments of the current transfer. Unsegmented transfers
+	// use a single segment without a range.
+	struct Array *segments;
+	size_t active_segments;
+	// Offset up to which the digest has been updated
+	curl_off_t hashed;
+	// Offset the current transfer started at
+	curl_off_t resume_offset;
+	// Not everything that was hashed made it to disk
+	bool write_failed;
+	bool ranges_unsupported;
+	// While racing the data is held back in memory and only
+	// the winner's data is written to disk and hashed
+	bool racing;
+	FILE *race_buf;
+	char *race_buf_data;
+	size_t race_buf_len;
+	curl_off_t race_bytes;
 };
 
-struct InitialDistfileCheckData {
+struct DistfileSegment {
+	struct DistfileQueueEntry *queue_entry;
+	CURL *eh;
+	curl_off_t offset;
+	curl_off_t length;
+	curl_off_t written;
+	// Received data that is not written to partname yet
+	struct FileBuffer *buf;
+	bool range_checked;
+	bool range_unsupported;
+	bool cancelled;
+	// Aborted because other transfers found the host to be down
+	bool host_down;
+};
+
+// Existing distfiles are checksummed by a pool of workers while
+// the main thread is already fetching the missing ones. The workers
+// report each finished file back through a pipe. Files that another
+// process fetched while we waited for its lock are handed to the
+// same workers later on.
+struct InitialDistfileCheck {
 	struct Mempool *pool;
-	struct event_base *base;
-	struct event *event;
-	FILE *out;
-	struct Array *finished_files;
-	struct Queue *files_to_checksum;
-	size_t *verified_files;
-	struct Distinfo *distinfo;
-	pthread_mutex_t *distinfo_mtx;
+	struct ParfetchJob *job;
+	struct Workqueue *wqueue;
+	// Files to hash sorted largest first. Idle workers take the
+	// next one so that a big file started early does not leave
+	// the other threads waiting at the end. Every worker has one
+	// file, or one batch of small files with a multi-buffer
+	// checksum backend, open at a time.
+	pthread_mutex_t files_mtx;
+	struct Array *files;
+	size_t next_file;
+	// Workers that are still taking files
+	size_t workers;
+	int notify_fds[2];
+	struct event *notify_event;
+	size_t pending;
+	// Files of the initial check that are not done yet
+	size_t initial_pending;
+	size_t verified_files;
+};
+
+struct InitialDistfileCheckData {
 	struct Distfile *distfile;
-	int fd;
+	off_t size;
+	int notify_fd;
+	// Only touched by the worker until it reports back
 	int error;
-	EVP_MD_CTX *mdctx;
+	struct ChecksumCtx *mdctx;
+	// The file as it was when we started hashing it
+	struct stat st;
+	// Not part of the initial check but fetched by another
+	// process while we waited for its lock
+	bool after_lock;
+	// The .part file of an earlier run that we want to resume
+	bool part;
 };
 
-struct InitialDistfileCheckWorkerData {
-	size_t queue_size;
-	struct Distinfo *distinfo;
-	pthread_mutex_t *distinfo_mtx;
-	struct Queue *files_to_checksum;
-	size_t verified_files;
+struct RunDaemon {
+	struct MirrorDB *mirrordb;
+	CURLM *cm;
+	struct event_base *base;
+	struct Array *jobs;
+	// Our own PARFETCH_* settings that replace the client's
+	struct Map *settings;
+};
+
+struct RunDaemonJob {
+	struct RunDaemon *daemon;
+	struct ParfetchDaemonRequest *request;
+	struct ParfetchJob *job;
+};
+
+struct RunServe {
+	struct Map *env;
+	struct MirrorDB *mirrordb;
+	CURLM *cm;
+	struct event_base *base;
+	int distdir_fd;
+	// Where misses are fetched to instead of DISTDIR
+	int upstream_fd;
+	// Path of the distfile -> struct RunServeJob *
+	struct Map *jobs;
+};
+
+struct RunServeJob {
+	struct RunServe *serve;
+	const char *path;
+	struct ParfetchJob *job;
+	struct Array *requests;
+};
+
+struct RunBatch {
+	struct ParfetchOptions *opts;
+	struct Progress *progress;
+	size_t pending;
+	size_t failed;
+};
+
+struct RunBatchPort {
+	struct RunBatch *batch;
+	struct ManifestPort *port;
+	struct ParfetchJob *job;
+	int distdir_fd;
+	int distinfo_fd;
+	// Output of the job until it is done
 	FILE *out;
 	char *out_buf;
 	size_t out_len;
 };
 
+struct RunBenchmarkFile {
+	const char *path;
+	off_t size;
+	size_t index;
+	// Digests of the first backend that the others must match
+	struct ChecksumDigest *digests;
+};
+
+struct SiteRank {
+	const char *site;
+	size_t index;
+	double expected_time;
+};
+
 enum Status {
+	STATUS_CANCEL,
 	STATUS_DONE,
 	STATUS_EMPTY,
 	STATUS_ERROR,
 	STATUS_FAILED,
+	STATUS_LINK,
 	STATUS_QUEUED,
 	STATUS_UNLINK,
+	STATUS_WAIT,
 	STATUS_WROTE,
 };
 
 // Prototypes
-static void status_msg(enum Status, const char *, ...) __printflike(2, 3);
-static void status_msgf(FILE *, enum Status, const char *, ...) __printflike(3, 4);
-static void status_msgv(FILE *, enum Status, const char *, va_list);
+static void status_msg(struct ParfetchOptions *, enum Status, const char *, ...) __printflike(3, 4);
+static void status_msgv(struct ParfetchOptions *, FILE *, enum Status, const char *, va_list);
 static DECLARE_COMPARE(random_compare);
-static const char *makevar(const char *);
-static void parfetch_init_options(void);
-static struct Distfile *parse_distfile_arg(struct Mempool *, struct Distinfo *, enum SitesType, const char *);
-static struct Distinfo *load_distinfo(struct Mempool *);
-static bool check_checksum(struct Distinfo *, pthread_mutex_t *, struct Distfile *, EVP_MD_CTX *);
-static void prepare_distfile_queues(struct Mempool *, struct Distinfo *, struct Progress *, struct Array *);
-static void initial_distfile_check(struct Distinfo *, struct Array *);
-static void initial_distfile_check_queue_file(struct Mempool *, struct Distinfo *, pthread_mutex_t *, struct event_base *, FILE *, struct Array *, struct Queue *, size_t *);
-static void initial_distfile_check_cb(evutil_socket_t, short, void *);
-static void initial_distfile_check_final(struct InitialDistfileCheckData *);
+static DECLARE_COMPARE(site_rank_compare);
+static DECLARE_COMPARE(distfile_schedule_compare);
+static DECLARE_COMPARE(initial_distfile_check_compare);
+static DECLARE_COMPARE(run_benchmark_file_compare);
+static const char *env_get(struct Map *, const char *);
+static const char *makevar(struct Map *, const char *);
+static bool mkdirpat(int, const char *);
+static bool parfetch_init_options(struct Mempool *, struct ParfetchOptions *, struct Map *, FILE *, const char **);
+static struct ParfetchJob *parfetch_job_new(struct Map *, FILE *, struct Progress *, int, int, struct Array *, struct MirrorDB *, CURLM *, struct event_base *);
+static void parfetch_job_start(struct ParfetchJob *, void (*)(struct ParfetchJob *, void *), void *);
+static void parfetch_job_distfile_done(struct ParfetchJob *);
+static void parfetch_job_finished_cb(evutil_socket_t, short, void *);
+static bool parfetch_job_finish(struct ParfetchJob *);
+static void parfetch_job_free(struct ParfetchJob *);
+static bool parfetch_job_error(struct ParfetchJob *, const char *, ...) __printflike(2, 3);
+static struct Distfile *parse_distfile_arg(struct ParfetchJob *, enum SitesType, const char *);
+static struct Distinfo *load_distinfo(struct ParfetchJob *);
+static FILE *load_distinfo_digests(struct ParfetchJob *, struct Mempool *, FILE *, struct Array *);
+static void write_distinfo_entry(struct ParfetchOptions *, struct Distfile *, FILE *);
+static bool check_checksum(struct Distinfo *, pthread_mutex_t *, struct Distfile *, struct ChecksumCtx *);
+static bool prepare_distfile_queues(struct ParfetchJob *);
+static struct Array *rank_sites(struct Mempool *, struct MirrorDB *, struct Array *, size_t, off_t);
+static void initial_distfile_check(struct ParfetchJob *);
+static struct InitialDistfileCheckData *initial_distfile_check_add(struct InitialDistfileCheck *, struct Distfile *, off_t);
+static void initial_distfile_check_free(struct InitialDistfileCheck *);
+static void initial_distfile_check_files(struct InitialDistfileCheckData **, size_t, struct Checksum *);
+static bool initial_distfile_check_final(struct InitialDistfileCheckData *);
+static void initial_distfile_check_notify(struct InitialDistfileCheckData *);
+static void initial_distfile_check_notify_cb(evutil_socket_t, short, void *);
+static struct InitialDistfileCheck *initial_distfile_check_new(struct ParfetchJob *);
+static void initial_distfile_check_run(struct InitialDistfileCheck *);
+static void initial_distfile_check_summary(struct ParfetchJob *, size_t);
 static void initial_distfile_check_worker(int, void *);
-static void fetch_distfile(CURLM *, struct Queue *);
+static void fetch_distfile(struct Distfile *);
+static struct DistfileQueueEntry *fetch_distfile_pop(struct Distfile *);
+static void fetch_distfile_entry(CURLM *, struct DistfileQueueEntry *);
+static void fetch_distfile_hash(struct DistfileQueueEntry *, const char *, size_t);
+static void fetch_distfile_cancel_segments(struct DistfileQueueEntry *);
+static void fetch_distfile_close(struct Distfile *);
+static void fetch_distfile_digest_segments(struct DistfileQueueEntry *);
+static void fetch_distfile_done(struct DistfileQueueEntry *);
+static void fetch_distfile_discard_part(struct Distfile *);
+static void fetch_distfile_record_valid(struct Distfile *, curl_off_t);
+static curl_off_t fetch_distfile_valid_length(struct Distfile *);
+static void fetch_distfile_extract_data_cb(struct Distfile *, curl_off_t, const char *, size_t, void *);
+static void fetch_distfile_extract_discard(struct Distfile *);
+static void fetch_distfile_extract_finished_cb(struct Extractor *, bool, void *);
+static const char *fetch_distfile_extract_path(struct Mempool *, struct Distfile *, bool);
+static bool fetch_distfile_load_part(struct Distfile *);
+static void fetch_distfile_load_part_done(struct InitialDistfileCheckData *);
+static bool fetch_distfile_lock(struct Distfile *);
+static void fetch_distfile_lock_cb(evutil_socket_t, short, void *);
+static void fetch_distfile_unlock(struct Distfile *);
+static bool fetch_distfile_verify(struct Distfile *);
+static void fetch_distfile_verify_done(struct InitialDistfileCheckData *);
 static void fetch_distfile_next_mirror(struct DistfileQueueEntry *, CURLM *, enum FetchDistfileNextReason, const char *);
+static bool fetch_distfile_open(struct Distfile *);
+static void fetch_distfile_preallocate(struct Distfile *);
+static void fetch_distfile_race(struct Distfile *);
+static void fetch_distfile_race_cb(evutil_socket_t, short, void *);
+static void fetch_distfile_race_drop(struct DistfileQueueEntry *);
+static void fetch_distfile_race_finish(struct Distfile *, struct DistfileQueueEntry *);
+static void fetch_distfile_remember(struct Distfile *, struct stat *);
+static bool fetch_distfile_remembered(struct Distfile *, struct stat *);
+static void fetch_distfile_reset(struct DistfileQueueEntry *);
+static void fetch_distfile_store_get(struct Distfile *);
+static void fetch_distfile_store_put(struct Distfile *);
+static bool fetch_distfile_segment_close(struct DistfileSegment *);
+static size_t fetch_distfile_segment_count(struct DistfileQueueEntry *);
+static bool fetch_distfile_segment_flush(struct DistfileSegment *);
+static bool fetch_distfile_segment_write(struct DistfileSegment *, curl_off_t, const char *, size_t);
+static void fetch_distfile_start(struct Distfile *);
+static void fetch_distfile_start_transfer(struct Distfile *);
+static void fetch_distfile_sync(struct Distfile *);
+static long fetch_distfile_min_speed(struct DistfileQueueEntry *, size_t);
+static void fetch_distfile_trim_parts(struct Array *);
+static void fetch_distfile_trim_parts_atexit(void);
+static void fetch_distfile_trim_parts_die_cb(evutil_socket_t, short, void *);
+static void fetch_distfile_trim_parts_signal_cb(evutil_socket_t, short, void *);
+static void fetch_distfile_trim_parts_start(struct event_base *, struct Array *);
+static void fetch_distfile_trim_parts_stop(void);
+static void fetch_distfile_trim_parts_end(void);
+static void fetch_distfile_without_ranges(CURLM *, struct DistfileQueueEntry *);
 static size_t fetch_distfile_progress_cb(void *, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
 static size_t fetch_distfile_write_cb(char *, size_t, size_t, void *);
+static size_t fetch_distfile_write_segment_cb(char *, size_t, size_t, void *);
 static void check_multi_info(CURLM *);
-static bool response_code_ok(long, long);
+static bool response_code_ok(long, long, bool);
+static CURLM *parfetch_curl_multi_new(struct ParfetchOptions *, struct event_base *);
+static void parfetch_curl_multi_free(CURLM *);
+static CURL *parfetch_curl_easy_get(void);
+static void parfetch_curl_easy_put(CURL *);
+static void parfetch_curl_easy_setup(CURL *);
+static struct Array *parfetch_env(struct Mempool *);
+static void print_manifest_port(const char *, struct Array *);
+static bool run_batch(struct ParfetchOptions *, const char *, struct MirrorDB *);
+static void run_batch_job_finished_cb(struct ParfetchJob *, void *);
+static void run_batch_port_finish(struct RunBatchPort *, bool);
+static void run_benchmark(struct ParfetchOptions *, int, char **);
+static double run_benchmark_backend(struct ParfetchOptions *, struct Checksum *, struct Array *, bool);
+static void run_daemon(struct ParfetchOptions *, const char *, struct MirrorDB *);
+static void run_daemon_job_finish(struct RunDaemonJob *, bool);
+static void run_daemon_job_finished_cb(struct ParfetchJob *, void *);
+static void run_daemon_request_cb(struct ParfetchDaemonRequest *, void *);
+static bool run_daemon_setting(const char *);
+static void run_daemon_signal_cb(evutil_socket_t, short, void *);
+static void run_job_finished_cb(struct ParfetchJob *, void *);
+static void run_serve(struct ParfetchOptions *, const char *, struct MirrorDB *);
+static void run_serve_job_data_cb(struct Distfile *, curl_off_t, const char *, size_t, void *);
+static void run_serve_job_finish(struct RunServeJob *, bool);
+static void run_serve_job_finished_cb(struct ParfetchJob *, void *);
+static void run_serve_request_cb(struct ParfetchServeRequest *, void *);
+static bool submit_to_daemon(struct ParfetchOptions *, struct Array *, int *);
 
-static struct ParfetchOptions opts;
-// basically how many open files we have at a time
-static const size_t INITIAL_DISTFILE_CHECK_QUEUE_SIZE = 64;
+extern char **environ;
 
-void
-status_msg(enum Status s, const char *format, ...)
-{
-	va_list ap;
-	va_start(ap, format);
-	status_msgv(opts.out, s, format, ap);
-	va_end(ap);
-}
+// Shared by all transfers
+static CURLSH *curl_share;
+static char *curl_altsvc_file;
+static char *curl_hsts_file;
+// Per host connection limits in adaptive mode
+static struct HostHealth *host_health;
+static struct HostLimits *host_limits;
+static struct RateLimit *rate_limit;
+static struct RedirectDB *redirect_db;
+static struct VerifyDB *verify_db;
+// Idle easy handles for reuse
+static struct Array *curl_handles;
+static size_t curl_handles_max;
+// Distfiles whose .part files are trimmed to their good prefix
+// when we exit
+static struct Array *partial_distfiles;
+static struct event *partial_distfiles_sigint;
+static struct event *partial_distfiles_sigterm;
+// A transfer is considered stalled below this fraction of the
+// usual speed of the host
+static const double FETCH_DISTFILE_STALL_FRACTION = 0.1;
+// do not split files into segments smaller than this
+static const curl_off_t FETCH_DISTFILE_MIN_SEGMENT_SIZE = 1024 * 1024;
+// end the race early once a mirror has sent us this much
+static const curl_off_t FETCH_DISTFILE_MAX_RACE_BUFFER = 8 * 1024 * 1024;
+// update the good prefix of the .part file after this much data
+static const curl_off_t FETCH_DISTFILE_VALID_INTERVAL = 16 * 1024 * 1024;
 
 void
-status_msgf(FILE *out, enum Status s, const char *format, ...)
+status_msg(struct ParfetchOptions *opts, enum Status s, const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	status_msgv(out, s, format, ap);
+	status_msgv(opts, opts->out, s, format, ap);
 	va_end(ap);
 }
 
 void
-status_msgv(FILE *out, enum Status s, const char *format, va_list ap)
+status_msgv(struct ParfetchOptions *opts, FILE *out, enum Status s, const char *format, va_list ap)
 {
 	const char *status = NULL;
 	const char *color = NULL;
 	switch (s) {
+	case STATUS_CANCEL:
+		color = opts->color_warning;
+		status = "cancel";
+		break;
 	case STATUS_DONE:
-		color = opts.color_ok;
+		color = opts->color_ok;
 		status = "  done";
 		break;
 	case STATUS_EMPTY:
@@ -221,37 +606,60 @@ status_msgv(FILE *out, enum Status s, const char *format, va_list ap)
 		status = "      ";
 		break;
 	case STATUS_ERROR:
-		color = opts.color_error;
+		color = opts->color_error;
 		status = " error";
 		break;
 	case STATUS_FAILED:
-		color = opts.color_error;
+		color = opts->color_error;
 		status = "failed";
 		break;
+	case STATUS_LINK:
+		color = opts->color_ok;
+		status = "  link";
+		break;
 	case STATUS_QUEUED:
-		color = opts.color_info;
+		color = opts->color_info;
 		status = "queued";
 		break;
 	case STATUS_UNLINK:
-		color = opts.color_warning;
+		color = opts->color_warning;
 		status = "unlink";
 		break;
+	case STATUS_WAIT:
+		color = opts->color_info;
+		status = "  wait";
+		break;
 	case STATUS_WROTE:
-		color = opts.color_ok;
+		color = opts->color_ok;
 		status = " wrote";
 		break;
 	}
 	panic_unless(status, "status unset");
 	panic_unless(color, "color unset");
 
-	if (opts.want_colors) {
-		fprintf(out, "%s%s%s ", color, status, opts.color_reset);
+	if (opts->want_colors) {
+		fprintf(out, "%s%s%s ", color, status, opts->color_reset);
 	} else {
 		fprintf(out, "%s: ", status);
 	}
 	panic_if(vfprintf(out, format, ap) < 0, "vfprintf");
 }
 
+DEFINE_COMPARE(initial_distfile_check_compare, struct InitialDistfileCheckData, void)
+{
+	if (a->size > b->size) {
+		return -1;
+	} else if (a->size < b->size) {
+		return 1;
+	} else if (a->distfile->index < b->distfile->index) {
+		return -1;
+	} else if (a->distfile->index > b->distfile->index) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
 DEFINE_COMPARE(random_compare, const char *, void)
 {
 #if HAVE_ARC4RANDOM
@@ -261,61 +669,192 @@ DEFINE_COMPARE(random_compare, const char *, void)
 #endif
 }
 
+DEFINE_COMPARE(site_rank_compare, struct SiteRank, void)
+{
+	// Sites we know nothing about go last but keep their order
+	if (a->expected_time >= 0 && b->expected_time < 0) {
+		return -1;
+	} else if (a->expected_time < 0 && b->expected_time >= 0) {
+		return 1;
+	} else if (a->expected_time < b->expected_time) {
+		return -1;
+	} else if (a->expected_time > b->expected_time) {
+		return 1;
+	} else if (a->index < b->index) {
+		return -1;
+	} else if (a->index > b->index) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+DEFINE_COMPARE(distfile_schedule_compare, struct Distfile, struct ParfetchOptions)
+{
+	// Distfiles without a size in distinfo count as 0 bytes
+	curl_off_t a_size = a->distinfo ? a->distinfo->size : 0;
+	curl_off_t b_size = b->distinfo ? b->distinfo->size : 0;
+	if (this->schedule == FETCH_SCHEDULE_SMALLEST_FIRST) {
+		curl_off_t tmp = a_size;
+		a_size = b_size;
+		b_size = tmp;
+	}
+	if (this->schedule == FETCH_SCHEDULE_NONE) {
+		// keep the order
+	} else if (a_size > b_size) {
+		return -1;
+	} else if (a_size < b_size) {
+		return 1;
+	}
+	if (a->index < b->index) {
+		return -1;
+	} else if (a->index > b->index) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+DEFINE_COMPARE(run_benchmark_file_compare, struct RunBenchmarkFile, void)
+{
+	if (a->size > b->size) {
+		return -1;
+	} else if (a->size < b->size) {
+		return 1;
+	} else if (a->index < b->index) {
+		return -1;
+	} else if (a->index > b->index) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+const char *
+env_get(struct Map *env, const char *var)
+{
+	if (env) {
+		return map_get(env, var);
+	} else {
+		return getenv(var);
+	}
+}
+
 const char *
-makevar(const char *var)
+makevar(struct Map *env, const char *var)
 {
 	SCOPE_MEMPOOL(pool);
 	const char *key = str_printf(pool, "dp_%s", var);
-	const char *env = getenv(key);
-	if (env && strcmp(env, "") != 0) {
-		return env;
+	const char *value = env_get(env, key);
+	if (value && strcmp(value, "") != 0) {
+		return value;
 	} else {
 		return NULL;
 	}
 }
 
-void
-parfetch_init_options()
+bool
+mkdirpat(int dirfd, const char *path)
 {
-	opts.target = makevar("TARGET");
-	unless (opts.target) {
-		errx(1, "dp_TARGET not set in the environment");
+	if (dirfd == AT_FDCWD) {
+		return mkdirp(path);
 	}
-	unless (strcmp(opts.target, "do-fetch") == 0 || strcmp(opts.target, "checksum") == 0 || strcmp(opts.target, "makesum") == 0) {
-		errx(1, "unsupported dp_TARGET value: %s", opts.target);
+
+	SCOPE_MEMPOOL(pool);
+	char *dir = str_dup(pool, path);
+	for (char *p = dir + 1; ; p++) {
+		if (*p == '/' || *p == 0) {
+			char c = *p;
+			*p = 0;
+			if (mkdirat(dirfd, dir, 0755) == -1 && errno != EEXIST) {
+				return false;
+			}
+			*p = c;
+			if (c == 0) {
+				return true;
+			}
+		}
 	}
+}
 
-	opts.out = stdout;
-	opts.color_error = ANSI_COLOR_RED;
-	opts.color_info = ANSI_COLOR_BLUE;
-	opts.color_ok = ANSI_COLOR_GREEN;
-	opts.color_reset = ANSI_COLOR_RESET;
-	opts.color_warning = ANSI_COLOR_YELLOW;
-	opts.want_colors = true;
-	unless (can_use_colors(opts.out)) {
-		opts.want_colors = false;
-		opts.color_error = opts.color_info = opts.color_ok = opts.color_reset = opts.color_warning = "";
+bool
+parfetch_init_options(struct Mempool *pool, struct ParfetchOptions *opts, struct Map *env, FILE *out, const char **error)
+{
+	opts->target = makevar(env, "TARGET");
+	opts->distdir = makevar(env, "DISTDIR");
+	opts->distinfo_file = makevar(env, "DISTINFO_FILE");
+	opts->dist_subdir = makevar(env, "DIST_SUBDIR");
+	opts->cache_dir = makevar(env, "PARFETCH_CACHE_DIR");
+	opts->daemon_socket = makevar(env, "PARFETCH_DAEMON_SOCKET");
+	opts->store_dir = makevar(env, "PARFETCH_STORE_DIR");
+	opts->extract_dir = makevar(env, "PARFETCH_EXTRACT_DIR");
+	opts->extract_cmd = makevar(env, "PARFETCH_EXTRACT_CMD");
+	unless (opts->extract_cmd) {
+		opts->extract_cmd = "tar -xf -";
 	}
+	const char *extract_only = makevar(env, "EXTRACT_ONLY");
+	opts->extract_only = str_split(pool, extract_only ? extract_only : "", " ");
 
-	opts.distdir = makevar("DISTDIR");
-	unless (opts.distdir) {
-		errx(1, "dp_DISTDIR not set in the environment");
+	opts->out = out;
+	opts->color_error = ANSI_COLOR_RED;
+	opts->color_info = ANSI_COLOR_BLUE;
+	opts->color_ok = ANSI_COLOR_GREEN;
+	opts->color_reset = ANSI_COLOR_RESET;
+	opts->color_warning = ANSI_COLOR_YELLOW;
+	opts->want_colors = true;
+	unless (can_use_colors(opts->out)) {
+		opts->want_colors = false;
+		opts->color_error = opts->color_info = opts->color_ok = opts->color_reset = opts->color_warning = "";
+	}
+
+	opts->makesum = makevar(env, "_PARFETCH_MAKESUM");
+	opts->makesum_ephemeral = makevar(env, "PARFETCH_MAKESUM_EPHEMERAL");
+	opts->makesum_keep_timestamp = makevar(env, "PARFETCH_MAKESUM_KEEP_TIMESTAMP");
+	opts->disable_size = makevar(env, "DISABLE_SIZE");
+	opts->direct_io = makevar(env, "PARFETCH_DIRECT_IO");
+	opts->no_checksum = makevar(env, "NO_CHECKSUM");
+	opts->strict_checksum = makevar(env, "PARFETCH_STRICT_CHECKSUM");
+
+	// SHA256 is always computed and comes first. It is what
+	// libias' distinfo and the store are keyed by.
+	const char *checksum_algorithms_env = makevar(env, "CHECKSUM_ALGORITHMS");
+	opts->checksum_algorithms = checksum_algorithms_new(pool,
+		str_printf(pool, "SHA256 %s", checksum_algorithms_env ? checksum_algorithms_env : ""),
+		error);
+	opts->checksum_algorithms_order = str_split(pool, checksum_algorithms_env ? checksum_algorithms_env : "", " ");
+	unless (opts->checksum_algorithms) {
+		return false;
 	}
-	opts.distinfo_file = makevar("DISTINFO_FILE");
-	unless (opts.distinfo_file) {
-		errx(1, "dp_DISTINFO_FILE not set in the environment");
+	mempool_add(pool, opts->checksum_algorithms, checksum_algorithms_free);
+
+	opts->checksum_backend = makevar(env, "PARFETCH_CHECKSUM_BACKEND");
+	if (opts->checksum_backend) {
+		struct Checksum *checksum = checksum_new(opts->checksum_backend);
+		unless (checksum) {
+			*error = str_printf(pool, "unsupported PARFETCH_CHECKSUM_BACKEND: %s", opts->checksum_backend);
+			return false;
+		}
+		checksum_free(checksum);
 	}
-	opts.dist_subdir = makevar("DIST_SUBDIR");
 
-	opts.makesum = makevar("_PARFETCH_MAKESUM");
-	opts.makesum_ephemeral = makevar("PARFETCH_MAKESUM_EPHEMERAL");
-	opts.makesum_keep_timestamp = makevar("PARFETCH_MAKESUM_KEEP_TIMESTAMP");
-	opts.disable_size = makevar("DISABLE_SIZE");
-	opts.no_checksum = makevar("NO_CHECKSUM");
+	opts->randomize_sites = makevar(env, "RANDOMIZE_SITES");
 
-	opts.randomize_sites = makevar("RANDOMIZE_SITES");
+	const char *fetch_env = makevar(env, "FETCH_ENV");
+	if (fetch_env) {
+		ARRAY_FOREACH(str_split(pool, fetch_env, " "), const char *, value) {
+			if (strcmp(value, "") == 0) {
+				continue;
+			} else if (strcmp(value, "SSL_NO_VERIFY_PEER=1") == 0) {
+				opts->ssl_no_verify_peer = true;
+			} else if (strcmp(value, "SSL_NO_VERIFY_HOSTNAME=1") == 0) {
+				opts->ssl_no_verify_hostname = true;
+			} else {
+				warnx("unhandled value in FETCH_ENV: %s", value);
+			}
+		}
+	}
 #if !HAVE_ARC4RANDOM
-	if (opts.randomize_sites) {
+	if (opts->randomize_sites) {
 		srand((unsigned)time(NULL));
 	}
 #endif
@@ -324,36 +863,413 @@ parfetch_init_options()
 	if (n_threads < 0) {
 		err(1, "sysconf(_SC_NPROCESSORS_ONLN)");
 	}
-	opts.initial_distfile_check_threads = n_threads + 1;
-	opts.max_host_connections = 1;
-	opts.max_total_connections = 4;
-	const char *max_host_connections_env = makevar("PARFETCH_MAX_HOST_CONNECTIONS");
-	if (max_host_connections_env && strcmp(max_host_connections_env , "") != 0) {
+#ifdef CPU_COUNT
+	// Poudriere jails or cpuset(1) might only give us some of
+	// them
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 0) {
+		n_threads = MIN(n_threads, CPU_COUNT(&cpus));
+	}
+#endif
+	opts->initial_distfile_check_threads = n_threads + 1;
+	opts->max_host_connections = 1;
+	opts->max_total_connections = 4;
+	const char *max_host_connections_env = makevar(env, "PARFETCH_MAX_HOST_CONNECTIONS");
+	if (max_host_connections_env && strcmp(max_host_connections_env, "auto") == 0) {
+		opts->adaptive_host_connections = true;
+	} else if (max_host_connections_env && strcmp(max_host_connections_env , "") != 0) {
 		const char *errstr = NULL;
-		opts.max_host_connections = strtonum(max_host_connections_env , 1, LONG_MAX, &errstr);
+		opts->max_host_connections = strtonum(max_host_connections_env , 1, LONG_MAX, &errstr);
 		if (errstr) {
-			errx(1, "PARFETCH_MAX_HOST_CONNECTIONS: %s", errstr);
+			*error = str_printf(pool, "PARFETCH_MAX_HOST_CONNECTIONS: %s", errstr);
+			return false;
 		}
 	}
-	const char *max_total_connections_env = makevar("PARFETCH_MAX_TOTAL_CONNECTIONS");
+	const char *max_total_connections_env = makevar(env, "PARFETCH_MAX_TOTAL_CONNECTIONS");
 	if (max_total_connections_env && strcmp(max_total_connections_env, "") != 0) {
 		const char *errstr = NULL;
-		opts.max_total_connections = strtonum(max_total_connections_env, 1, LONG_MAX, &errstr);
+		opts->max_total_connections = strtonum(max_total_connections_env, 1, LONG_MAX, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_MAX_TOTAL_CONNECTIONS: %s", errstr);
+			return false;
+		}
+	}
+	opts->host_failure_limit = 3;
+	opts->host_retry_delay = 60;
+	const char *host_failure_limit_env = makevar(env, "PARFETCH_HOST_FAILURE_LIMIT");
+	if (host_failure_limit_env) {
+		const char *errstr = NULL;
+		opts->host_failure_limit = strtonum(host_failure_limit_env, 0, LONG_MAX, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_HOST_FAILURE_LIMIT: %s", errstr);
+			return false;
+		}
+	}
+	const char *host_retry_delay_env = makevar(env, "PARFETCH_HOST_RETRY_DELAY");
+	if (host_retry_delay_env) {
+		const char *errstr = NULL;
+		opts->host_retry_delay = strtonum(host_retry_delay_env, 0, INT_MAX, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_HOST_RETRY_DELAY: %s", errstr);
+			return false;
+		}
+	}
+	opts->segments = 1;
+	opts->segment_threshold = 64 * 1024 * 1024;
+	const char *segments_env = makevar(env, "PARFETCH_SEGMENTS");
+	if (segments_env) {
+		const char *errstr = NULL;
+		opts->segments = strtonum(segments_env, 1, 64, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_SEGMENTS: %s", errstr);
+			return false;
+		}
+	}
+	const char *segment_threshold_env = makevar(env, "PARFETCH_SEGMENT_THRESHOLD");
+	if (segment_threshold_env) {
+		const char *errstr = NULL;
+		opts->segment_threshold = strtonum(segment_threshold_env, 1, LLONG_MAX, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_SEGMENT_THRESHOLD: %s", errstr);
+			return false;
+		}
+	}
+	opts->race_mirrors = 1;
+	opts->race_window = 2000;
+	const char *race_mirrors_env = makevar(env, "PARFETCH_RACE_MIRRORS");
+	if (race_mirrors_env) {
+		const char *errstr = NULL;
+		opts->race_mirrors = strtonum(race_mirrors_env, 1, 16, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_RACE_MIRRORS: %s", errstr);
+			return false;
+		}
+	}
+	const char *race_window_env = makevar(env, "PARFETCH_RACE_WINDOW");
+	if (race_window_env) {
+		const char *errstr = NULL;
+		opts->race_window = strtonum(race_window_env, 1, LONG_MAX, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_RACE_WINDOW: %s", errstr);
+			return false;
+		}
+	}
+	const char *max_speed_env = makevar(env, "PARFETCH_MAX_SPEED");
+	if (max_speed_env) {
+		const char *errstr = NULL;
+		opts->max_speed = strtonum(max_speed_env, 0, LLONG_MAX, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_MAX_SPEED: %s", errstr);
+			return false;
+		}
+	}
+	const char *max_host_speed_env = makevar(env, "PARFETCH_MAX_HOST_SPEED");
+	if (max_host_speed_env) {
+		const char *errstr = NULL;
+		opts->max_host_speed = strtonum(max_host_speed_env, 0, LLONG_MAX, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_MAX_HOST_SPEED: %s", errstr);
+			return false;
+		}
+	}
+	opts->min_speed = 1024;
+	opts->stall_time = 30;
+	const char *min_speed_env = makevar(env, "PARFETCH_MIN_SPEED");
+	if (min_speed_env) {
+		const char *errstr = NULL;
+		opts->min_speed = strtonum(min_speed_env, 1, LONG_MAX, &errstr);
+		if (errstr) {
+			*error = str_printf(pool, "PARFETCH_MIN_SPEED: %s", errstr);
+			return false;
+		}
+	}
+	const char *stall_time_env = makevar(env, "PARFETCH_STALL_TIME");
+	if (stall_time_env) {
+		const char *errstr = NULL;
+		opts->stall_time = strtonum(stall_time_env, 0, LONG_MAX, &errstr);
 		if (errstr) {
-			errx(1, "PARFETCH_MAX_TOTAL_CONNECTIONS: %s", errstr);
+			*error = str_printf(pool, "PARFETCH_STALL_TIME: %s", errstr);
+			return false;
+		}
+	}
+	opts->priority = FETCH_PRIORITY_NONE;
+	const char *priority_env = makevar(env, "PARFETCH_PRIORITY");
+	if (priority_env) {
+		if (strcmp(priority_env, "distfiles") == 0) {
+			opts->priority = FETCH_PRIORITY_DISTFILES;
+		} else if (strcmp(priority_env, "patchfiles") == 0) {
+			opts->priority = FETCH_PRIORITY_PATCHFILES;
+		} else if (strcmp(priority_env, "none") == 0) {
+			opts->priority = FETCH_PRIORITY_NONE;
+		} else {
+			*error = str_printf(pool, "PARFETCH_PRIORITY: invalid value: %s", priority_env);
+			return false;
+		}
+	}
+	opts->schedule = FETCH_SCHEDULE_LARGEST_FIRST;
+	const char *schedule_env = makevar(env, "PARFETCH_SCHEDULE");
+	if (schedule_env) {
+		if (strcmp(schedule_env, "largest-first") == 0) {
+			opts->schedule = FETCH_SCHEDULE_LARGEST_FIRST;
+		} else if (strcmp(schedule_env, "smallest-first") == 0) {
+			opts->schedule = FETCH_SCHEDULE_SMALLEST_FIRST;
+		} else if (strcmp(schedule_env, "none") == 0) {
+			opts->schedule = FETCH_SCHEDULE_NONE;
+		} else {
+			*error = str_printf(pool, "PARFETCH_SCHEDULE: invalid value: %s", schedule_env);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+parfetch_job_error(struct ParfetchJob *job, const char *format, ...)
+{
+	// Only the first error is interesting
+	unless (job->error) {
+		char *error = NULL;
+		va_list ap;
+		va_start(ap, format);
+		panic_if(vasprintf(&error, format, ap) < 0, "vasprintf");
+		va_end(ap);
+		job->error = mempool_take(job->pool, error);
+	}
+	return false;
+}
+
+struct ParfetchJob *
+parfetch_job_new(struct Map *env, FILE *out, struct Progress *progress, int distdir_fd, int distinfo_fd, struct Array *args, struct MirrorDB *mirrordb, CURLM *cm, struct event_base *base)
+{
+	struct ParfetchJob *job = xmalloc(sizeof(struct ParfetchJob));
+	job->pool = mempool_new();
+	job->env = env;
+	job->distdir_fd = distdir_fd;
+	job->distinfo_fd = distinfo_fd;
+	job->mirrordb = mirrordb;
+	job->cm = cm;
+	job->base = base;
+	job->distfiles = mempool_array(job->pool);
+	job->finished_event = event_new(base, -1, 0, parfetch_job_finished_cb, job);
+
+	struct ParfetchOptions *opts = &job->opts;
+	unless (parfetch_init_options(job->pool, opts, env, out, &job->error)) {
+		return job;
+	}
+	unless (opts->target) {
+		parfetch_job_error(job, "dp_TARGET not set in the environment");
+		return job;
+	}
+	unless (strcmp(opts->target, "do-fetch") == 0 || strcmp(opts->target, "checksum") == 0 || strcmp(opts->target, "makesum") == 0) {
+		parfetch_job_error(job, "unsupported dp_TARGET value: %s", opts->target);
+		return job;
+	}
+	unless (opts->distdir) {
+		parfetch_job_error(job, "dp_DISTDIR not set in the environment");
+		return job;
+	}
+	unless (opts->distinfo_file) {
+		parfetch_job_error(job, "dp_DISTINFO_FILE not set in the environment");
+		return job;
+	}
+
+	job->distinfo_digests = mempool_map(job->pool, str_compare);
+	job->distinfo = load_distinfo(job);
+	if (job->error) {
+		return job;
+	}
+	for (size_t i = 0; i + 1 < array_len(args); i += 2) {
+		const char *flag = array_get(args, i);
+		const char *arg = array_get(args, i + 1);
+		enum SitesType sites_type = MASTER_SITES;
+		if (strcmp(flag, "-p") == 0) {
+			sites_type = PATCH_SITES;
+		}
+		struct Distfile *distfile = parse_distfile_arg(job, sites_type, arg);
+		unless (distfile) {
+			return job;
+		}
+		distfile->index = array_len(job->distfiles);
+		array_append(job->distfiles, distfile);
+	}
+
+	if (progress) {
+		job->progress = progress;
+	} else {
+		job->progress = progress_new(base, opts->out);
+		job->own_progress = true;
+	}
+	if (job->distinfo && !opts->makesum) {
+		ARRAY_FOREACH(distinfo_entries(job->distinfo, job->pool), struct DistinfoEntry *, entry) {
+			progress_update_total(job->progress, entry->size);
+		}
+	}
+
+	prepare_distfile_queues(job);
+
+	return job;
+}
+
+void
+parfetch_job_start(struct ParfetchJob *job, void (*finished_cb)(struct ParfetchJob *, void *), void *userdata)
+{
+	job->finished_cb = finished_cb;
+	job->finished_cb_data = userdata;
+
+	initial_distfile_check(job);
+
+	// Count them all before starting so that a distfile without
+	// mirrors does not finish the job early. Files that are still
+	// being checksummed count too and are only fetched if they
+	// turn out to be bad.
+	ARRAY_FOREACH(job->distfiles, struct Distfile *, distfile) {
+		unless (distfile->fetched) {
+			job->pending++;
+		}
+	}
+	if (job->pending == 0) {
+		event_active(job->finished_event, EV_TIMEOUT, 0);
+		return;
+	}
+
+	// Transfers are started in the order they are added to the
+	// multi handle, so start the distfile that should finish first
+	// first. With the default schedule that is the largest one
+	// since it usually dominates the total run time.
+	SCOPE_MEMPOOL(pool);
+	struct Array *schedule = mempool_array(pool);
+	ARRAY_FOREACH(job->distfiles, struct Distfile *, distfile) {
+		unless (distfile->fetched) {
+			array_append(schedule, distfile);
+		}
+	}
+	array_sort(schedule, &(struct CompareTrait){distfile_schedule_compare, &job->opts});
+	ARRAY_FOREACH(schedule, struct Distfile *, distfile) {
+		distfile->rank = distfile_index;
+		unless (distfile->checking) {
+			fetch_distfile_start(distfile);
+		}
+	}
+}
+
+void
+parfetch_job_distfile_done(struct ParfetchJob *job)
+{
+	panic_unless(job->pending > 0, "more distfiles done than started");
+	job->pending--;
+	if (job->pending == 0) {
+		// The job might be freed by the callback so leave
+		// fetch_distfile*() first
+		event_active(job->finished_event, EV_TIMEOUT, 0);
+	}
+}
+
+void
+parfetch_job_finished_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	struct ParfetchJob *job = userdata;
+	if (job->own_progress) {
+		progress_stop(job->progress);
+	}
+	if (job->finished_cb) {
+		job->finished_cb(job, job->finished_cb_data);
+	}
+}
+
+bool
+parfetch_job_finish(struct ParfetchJob *job)
+{
+	struct ParfetchOptions *opts = &job->opts;
+
+	// Close/flush all open files and check that we fetched all of them
+	bool all_fetched = true;
+	ARRAY_FOREACH(job->distfiles, struct Distfile *, distfile) {
+		fetch_distfile_close(distfile);
+		all_fetched = all_fetched && distfile->fetched;
+	}
+	fetch_distfile_trim_parts(job->distfiles);
+
+	if (all_fetched && opts->makesum) {
+		SCOPE_MEMPOOL(pool);
+		FILE *f = mempool_fopenat(pool, AT_FDCWD, opts->distinfo_file, "w", 0644);
+		unless (f) {
+			err(1, "could not open %s", opts->distinfo_file);
+		}
+		fprintf(f, "TIMESTAMP = %ju\n", (uintmax_t)distinfo_timestamp(job->distinfo));
+		ARRAY_FOREACH(job->distfiles, struct Distfile *, distfile) {
+			write_distinfo_entry(opts, distfile, f);
+		}
+		status_msg(opts, STATUS_WROTE, "%s\n", opts->distinfo_file);
+	}
+
+	return all_fetched;
+}
+
+void
+parfetch_job_free(struct ParfetchJob *job)
+{
+	if (job) {
+		initial_distfile_check_free(job->initial_check);
+		// Cancelled transfers might still be around and must
+		// not call back into us anymore
+		ARRAY_FOREACH(job->distfiles, struct Distfile *, distfile) {
+			if (distfile->entries) {
+				ARRAY_FOREACH(distfile->entries, struct DistfileQueueEntry *, queue_entry) {
+					ARRAY_FOREACH(queue_entry->segments, struct DistfileSegment *, segment) {
+						if (segment->eh) {
+							hostlimits_remove(host_limits, queue_entry->url, segment->eh, CURLE_ABORTED_BY_CALLBACK, 0);
+							curl_multi_remove_handle(job->cm, segment->eh);
+							parfetch_curl_easy_put(segment->eh);
+							segment->eh = NULL;
+						}
+						fetch_distfile_segment_close(segment);
+					}
+					if (queue_entry->race_buf) {
+						fetch_distfile_race_drop(queue_entry);
+					}
+				}
+			}
+			if (distfile->race_timer) {
+				event_free(distfile->race_timer);
+				distfile->race_timer = NULL;
+			}
+			if (distfile->lock_timer) {
+				event_free(distfile->lock_timer);
+				distfile->lock_timer = NULL;
+			}
+			fetch_distfile_extract_discard(distfile);
+			fetch_distfile_close(distfile);
+			fetch_distfile_unlock(distfile);
+		}
+		if (job->own_progress) {
+			progress_free(job->progress);
 		}
+		if (job->distinfo) {
+			distinfo_free(job->distinfo);
+		}
+		event_free(job->finished_event);
+		mempool_free(job->pool);
+		free(job);
 	}
 }
 
 struct Distfile *
-parse_distfile_arg(struct Mempool *pool, struct Distinfo *distinfo, enum SitesType sites_type, const char *arg)
+parse_distfile_arg(struct ParfetchJob *job, enum SitesType sites_type, const char *arg)
 {
+	struct Mempool *pool = job->pool;
+	struct ParfetchOptions *opts = &job->opts;
+	struct Distinfo *distinfo = job->distinfo;
 	struct Distfile *distfile = mempool_alloc(pool, sizeof(struct Distfile));
 	distfile->pool = pool;
+	distfile->job = job;
 	distfile->sites_type = sites_type;
 	distfile->queue = mempool_queue(pool);
 	distfile->name = str_dup(pool, arg);
 	distfile->fetched = false;
+	distfile->fd = -1;
+	distfile->direct_fd = -1;
+	distfile->lock_fd = -1;
 	char *groups = strrchr(distfile->name, ':');
 	if (groups) {
 		*groups = 0;
@@ -362,19 +1278,33 @@ parse_distfile_arg(struct Mempool *pool, struct Distinfo *distinfo, enum SitesTy
 		distfile->groups = mempool_array(pool);
 		array_append(distfile->groups, "DEFAULT");
 	}
+	distfile->partname = str_printf(pool, "%s.part", distfile->name);
+	distfile->validname = str_printf(pool, "%s.part.valid", distfile->name);
+	if (opts->extract_dir && !opts->makesum) {
+		ARRAY_FOREACH(opts->extract_only, const char *, name) {
+			if (strcmp(name, distfile->name) == 0) {
+				distfile->extract = true;
+				distfile->data_cb = fetch_distfile_extract_data_cb;
+			}
+		}
+	}
+	distfile->resume_mdctx = mempool_add(pool, checksum_ctx_new(opts->checksum_algorithms), checksum_ctx_free);
+	distfile->digests = mempool_alloc(pool, checksum_algorithms_len(opts->checksum_algorithms) * sizeof(struct ChecksumDigest));
 
 	{
 		SCOPE_MEMPOOL(pool);
 		const char *fullname;
-		if (opts.dist_subdir) {
-			fullname = str_printf(pool, "%s/%s", opts.dist_subdir, distfile->name);
+		if (opts->dist_subdir) {
+			fullname = str_printf(pool, "%s/%s", opts->dist_subdir, distfile->name);
 		} else {
 			fullname = distfile->name;
 		}
-		distfile->distinfo = distinfo_entry(distinfo, fullname);
-		if (!distfile->distinfo && opts.makesum) {
+		if (distinfo) {
+			distfile->distinfo = distinfo_entry(distinfo, fullname);
+		}
+		if (!distfile->distinfo && opts->makesum) {
 			// We add a new entry so update the timestamp
-			unless (opts.makesum_keep_timestamp) {
+			unless (opts->makesum_keep_timestamp) {
 				distinfo_set_timestamp(distinfo, time(NULL));
 			}
 			distinfo_add_entry(distinfo, &(struct DistinfoEntry){
@@ -383,9 +1313,19 @@ parse_distfile_arg(struct Mempool *pool, struct Distinfo *distinfo, enum SitesTy
 			});
 			distfile->distinfo = distinfo_entry(distinfo, fullname);
 		}
+		for (size_t i = 1; i < checksum_algorithms_len(opts->checksum_algorithms); i++) {
+			const char *name = checksum_algorithms_name(opts->checksum_algorithms, i);
+			struct ChecksumDigest *digest = map_get(job->distinfo_digests, str_printf(pool, "%s (%s)", name, fullname));
+			if (digest) {
+				distfile->digests[i] = *digest;
+			}
+		}
 		unless (distfile->distinfo) {
-			if (!opts.no_checksum && !opts.disable_size) {
-				errx(1, "missing distinfo entry for %s", fullname);
+			// Without NO_CHECKSUM we need the digest and
+			// without DISABLE_SIZE the size from distinfo
+			if (!opts->no_checksum || !opts->disable_size) {
+				parfetch_job_error(job, "missing distinfo entry for %s", fullname);
+				return NULL;
 			}
 		}
 	}
@@ -394,31 +1334,62 @@ parse_distfile_arg(struct Mempool *pool, struct Distinfo *distinfo, enum SitesTy
 }
 
 struct Distinfo *
-load_distinfo(struct Mempool *extpool)
+load_distinfo(struct ParfetchJob *job)
 {
 	SCOPE_MEMPOOL(pool);
+	struct ParfetchOptions *opts = &job->opts;
 
-	FILE *f = mempool_fopenat(pool, AT_FDCWD, opts.distinfo_file, "r", 0);
+	FILE *f = NULL;
+	if (job->env) {
+		// Clients send us their distinfo file if it exists
+		if (job->distinfo_fd != -1) {
+			int fd = dup(job->distinfo_fd);
+			if (fd != -1) {
+				f = fdopen(fd, "r");
+				if (f) {
+					mempool_add(pool, f, fclose);
+				} else {
+					close(fd);
+				}
+			}
+		} else {
+			errno = ENOENT;
+		}
+	} else {
+		f = mempool_fopenat(pool, AT_FDCWD, opts->distinfo_file, "r", 0);
+	}
 	unless (f) {
-		if (opts.makesum) {
+		if (opts->makesum) {
 			struct Distinfo *distinfo = distinfo_new();
 			distinfo_set_timestamp(distinfo, time(NULL));
 			return distinfo;
-		} else if (opts.no_checksum && opts.disable_size) {
+		} else if (opts->no_checksum && opts->disable_size) {
 			return NULL;
 		} else {
-			err(1, "could not open %s", opts.distinfo_file);
+			parfetch_job_error(job, "could not open %s: %s", opts->distinfo_file, strerror(errno));
+			return NULL;
 		}
 	}
 
+	struct Array *digest_errors = mempool_array(pool);
+	if (checksum_algorithms_len(opts->checksum_algorithms) > 1) {
+		f = load_distinfo_digests(job, pool, f, digest_errors);
+	}
 	struct Array *errors = NULL;
-	struct Distinfo *distinfo = distinfo_parse(f, pool, &errors);
-	unless (distinfo) {
-		warnx("could not parse %s", opts.distinfo_file);
+	struct Distinfo *distinfo = NULL;
+	if (f && array_len(digest_errors) == 0) {
+		distinfo = distinfo_parse(f, pool, &errors);
+	} else {
+		errors = digest_errors;
+	}
+	unless (distinfo) {
+		struct Array *lines = mempool_array(pool);
+		array_append(lines, str_printf(pool, "could not parse %s", opts->distinfo_file));
 		ARRAY_FOREACH(errors, const char *, line) {
-			fprintf(stderr, "%s:%s\n", opts.distinfo_file, line);
+			array_append(lines, str_printf(pool, "%s:%s", opts->distinfo_file, line));
 		}
-		exit(1);
+		parfetch_job_error(job, "%s", str_join(pool, lines, "\n"));
+		return NULL;
 	}
 	// Add a timestamp in case it is missing
 	if (distinfo_timestamp(distinfo) == 0) {
@@ -427,40 +1398,151 @@ load_distinfo(struct Mempool *extpool)
 	return distinfo;
 }
 
+// libias' distinfo only knows SHA256. The lines of the other
+// CHECKSUM_ALGORITHMS are picked out into job->distinfo_digests
+// here and the rest is returned for distinfo_parse().
+FILE *
+load_distinfo_digests(struct ParfetchJob *job, struct Mempool *pool, FILE *f, struct Array *errors)
+{
+	struct ChecksumAlgorithms *algorithms = job->opts.checksum_algorithms;
+
+	FILE *rest = tmpfile();
+	unless (rest) {
+		array_append(errors, str_printf(pool, "tmpfile: %s", strerror(errno)));
+		return NULL;
+	}
+	mempool_add(pool, rest, fclose);
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	size_t lineno = 0;
+	while ((linelen = getline(&line, &linecap, f)) > 0) {
+		lineno++;
+		const char *name = NULL;
+		size_t algorithm = 1;
+		for (; algorithm < checksum_algorithms_len(algorithms); algorithm++) {
+			name = checksum_algorithms_name(algorithms, algorithm);
+			if (strncmp(line, name, strlen(name)) == 0 && str_startswith(line + strlen(name), " (")) {
+				break;
+			}
+			name = NULL;
+		}
+		unless (name) {
+			fwrite(line, 1, linelen, rest);
+			continue;
+		}
+
+		if (line[linelen - 1] == '\n') {
+			line[--linelen] = 0;
+		}
+		// <algorithm> (<filename>) = <hex digest>
+		char *filename = line + strlen(name) + 2;
+		char *sep = NULL;
+		for (char *p = strstr(filename, ") = "); p; p = strstr(p + 1, ") = ")) {
+			sep = p;
+		}
+		size_t digest_len = checksum_algorithms_digest_len(algorithms, algorithm);
+		struct ChecksumDigest *digest = mempool_alloc(job->pool, sizeof(struct ChecksumDigest));
+		if (sep && strlen(sep + 4) == 2 * digest_len) {
+			for (; digest->len < digest_len; digest->len++) {
+				unless (isxdigit((unsigned char)sep[4 + 2 * digest->len]) &&
+					isxdigit((unsigned char)sep[5 + 2 * digest->len]) &&
+					sscanf(sep + 4 + 2 * digest->len, "%2hhx", &digest->value[digest->len]) == 1) {
+					break;
+				}
+			}
+		}
+		if (digest->len == digest_len) {
+			*sep = 0;
+			map_add(job->distinfo_digests, str_printf(job->pool, "%s (%s)", name, filename), digest);
+		} else {
+			array_append(errors, str_printf(pool, "%zu: invalid %s digest", lineno, name));
+		}
+	}
+	free(line);
+
+	if (ferror(f) || fflush(rest) != 0) {
+		array_append(errors, str_printf(pool, "%s", strerror(errno)));
+		return NULL;
+	}
+	rewind(rest);
+	return rest;
+}
+
+// Like the framework's makesum: the digests in the order of
+// CHECKSUM_ALGORITHMS followed by SIZE. SHA256 comes first if it
+// is not part of it. Algorithms without a digest are left out.
+void
+write_distinfo_entry(struct ParfetchOptions *opts, struct Distfile *distfile, FILE *f)
+{
+	struct ChecksumAlgorithms *algorithms = opts->checksum_algorithms;
+	size_t n_algorithms = checksum_algorithms_len(algorithms);
+	bool listed[CHECKSUM_MAX_ALGORITHMS] = { false };
+	size_t order[CHECKSUM_MAX_ALGORITHMS];
+	size_t order_len = 0;
+	bool sha256_listed = false;
+	ARRAY_FOREACH(opts->checksum_algorithms_order, const char *, name) {
+		for (size_t i = 0; i < n_algorithms; i++) {
+			if (!listed[i] && strcmp(checksum_algorithms_name(algorithms, i), name) == 0) {
+				listed[i] = true;
+				order[order_len++] = i;
+				sha256_listed = sha256_listed || i == 0;
+			}
+		}
+	}
+	unless (sha256_listed) {
+		memmove(order + 1, order, order_len * sizeof(order[0]));
+		order[0] = 0;
+		order_len++;
+	}
+
+	for (size_t k = 0; k < order_len; k++) {
+		size_t i = order[k];
+		const uint8_t *value = distfile->digests[i].value;
+		size_t len = distfile->digests[i].len;
+		if (i == 0) {
+			value = distfile->distinfo->digest;
+			len = distfile->distinfo->digest_len;
+		}
+		if (len == 0) {
+			continue;
+		}
+		fprintf(f, "%s (%s) = ", checksum_algorithms_name(algorithms, i), distfile->distinfo->filename);
+		for (size_t j = 0; j < len; j++) {
+			fprintf(f, "%02x", value[j]);
+		}
+		fputc('\n', f);
+	}
+	fprintf(f, "SIZE (%s) = %jd\n", distfile->distinfo->filename, (intmax_t)distfile->distinfo->size);
+}
+
 bool
-check_checksum(struct Distinfo *distinfo, pthread_mutex_t *distinfo_mtx, struct Distfile *distfile, EVP_MD_CTX *ctx)
+check_checksum(struct Distinfo *distinfo, pthread_mutex_t *distinfo_mtx, struct Distfile *distfile, struct ChecksumCtx *ctx)
 {
-	if (opts.no_checksum && !opts.makesum) {
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (opts->no_checksum && !opts->makesum) {
 		return true;
 	} else if (distfile->distinfo) {
-		uint8_t md_value[EVP_MAX_MD_SIZE];
-		unsigned int md_len;
-		unless (EVP_DigestFinal_ex(ctx, md_value, &md_len)) {
-			if (opts.makesum) {
+		size_t n_algorithms = checksum_algorithms_len(opts->checksum_algorithms);
+		struct ChecksumDigest md[CHECKSUM_MAX_ALGORITHMS];
+		unless (checksum_ctx_final(ctx, md)) {
+			if (opts->makesum) {
 				err(1, "could not checksum %s", distfile->name);
 			} else {
 				return false;
 			}
 		}
-		panic_if(md_len > DISTINFO_MAX_DIGEST_LEN, "md_len > DISTINFO_MAX_DIGEST_LEN");
-		if (opts.makesum) {
-			if (distfile->distinfo->digest_len > 0) {
-				if (distfile->distinfo->digest_len != md_len ||
-				    memcmp(distfile->distinfo->digest, md_value, md_len) != 0) {
-					unless (opts.makesum_keep_timestamp) {
-						if (distinfo_mtx) {
-							pthread_mutex_lock(distinfo_mtx);
-						}
-						distinfo_set_timestamp(distinfo, time(NULL));
-						if (distinfo_mtx) {
-							pthread_mutex_unlock(distinfo_mtx);
-						}
-					}
-					memcpy(distfile->distinfo->digest, md_value, md_len);
-					distfile->distinfo->digest_len = md_len;
-				}
-			} else {
-				unless (opts.makesum_keep_timestamp) {
+		panic_if(md[0].len > DISTINFO_MAX_DIGEST_LEN, "md_len > DISTINFO_MAX_DIGEST_LEN");
+		if (opts->makesum) {
+			bool changed = distfile->distinfo->digest_len != md[0].len ||
+				memcmp(distfile->distinfo->digest, md[0].value, md[0].len) != 0;
+			for (size_t i = 1; i < n_algorithms; i++) {
+				changed = changed || distfile->digests[i].len != md[i].len ||
+					memcmp(distfile->digests[i].value, md[i].value, md[i].len) != 0;
+			}
+			if (changed) {
+				unless (opts->makesum_keep_timestamp) {
 					if (distinfo_mtx) {
 						pthread_mutex_lock(distinfo_mtx);
 					}
@@ -469,203 +1551,326 @@ check_checksum(struct Distinfo *distinfo, pthread_mutex_t *distinfo_mtx, struct
 						pthread_mutex_unlock(distinfo_mtx);
 					}
 				}
-				memcpy(distfile->distinfo->digest, md_value, md_len);
-				distfile->distinfo->digest_len = md_len;
+				memcpy(distfile->distinfo->digest, md[0].value, md[0].len);
+				distfile->distinfo->digest_len = md[0].len;
+				for (size_t i = 1; i < n_algorithms; i++) {
+					distfile->digests[i] = md[i];
+				}
 			}
 			return true;
 		} else {
-			return distfile->distinfo->digest_len == md_len &&
-				memcmp(distfile->distinfo->digest, md_value, md_len) == 0;
+			unless (distfile->distinfo->digest_len == md[0].len &&
+				memcmp(distfile->distinfo->digest, md[0].value, md[0].len) == 0) {
+				return false;
+			}
+			// Like the framework we only check the other
+			// algorithms that distinfo has a digest for
+			for (size_t i = 1; i < n_algorithms; i++) {
+				if (distfile->digests[i].len > 0 &&
+				    (distfile->digests[i].len != md[i].len ||
+				     memcmp(distfile->digests[i].value, md[i].value, md[i].len) != 0)) {
+					return false;
+				}
+			}
+			return true;
 		}
 	} else {
 		errx(1, "NO_CHECKSUM not set but distinfo not loaded");
 	}
 }
 
-void
-prepare_distfile_queues(struct Mempool *pool, struct Distinfo *distinfo, struct Progress *progress, struct Array *distfiles)
+struct Array *
+rank_sites(struct Mempool *pool, struct MirrorDB *mirrordb, struct Array *sites, size_t start, off_t size)
+{
+	struct Array *ranks = mempool_array(pool);
+	ARRAY_FOREACH(sites, const char *, site) {
+		if (site_index >= start) {
+			struct SiteRank *rank = mempool_alloc(pool, sizeof(struct SiteRank));
+			rank->site = site;
+			rank->index = site_index;
+			rank->expected_time = mirrordb_expected_time(mirrordb, site, size);
+			array_append(ranks, rank);
+		}
+	}
+	array_sort(ranks, &(struct CompareTrait){site_rank_compare, NULL});
+
+	struct Array *ranked_sites = mempool_array(pool);
+	ARRAY_FOREACH(sites, const char *, site) {
+		if (site_index < start) {
+			array_append(ranked_sites, site);
+		}
+	}
+	ARRAY_FOREACH(ranks, struct SiteRank *, rank) {
+		array_append(ranked_sites, rank->site);
+	}
+	return ranked_sites;
+}
+
+bool
+prepare_distfile_queues(struct ParfetchJob *job)
 {
+	struct Mempool *pool = job->pool;
+	struct ParfetchOptions *opts = &job->opts;
+	struct MirrorDB *mirrordb = job->mirrordb;
+
 	// collect MASTER_SITES / PATCH_SITES per group and create mirror queues
 	struct Map *groupsites[2];
 	groupsites[MASTER_SITES] = mempool_map(pool, str_compare);
 	groupsites[PATCH_SITES] = mempool_map(pool, str_compare);
-	ARRAY_FOREACH(distfiles, struct Distfile *, distfile) {
+	ARRAY_FOREACH(job->distfiles, struct Distfile *, distfile) {
+		distfile->cm = job->cm;
+		distfile->base = job->base;
+		distfile->racers = mempool_array(pool);
+		distfile->entries = mempool_array(pool);
 		const char *env_prefix[] = { "_MASTER_SITES_" , "_PATCH_SITES_" };
 		ARRAY_FOREACH(distfile->groups, const char *, group) {
 			struct Array *sites = map_get(groupsites[distfile->sites_type], group);
 			unless (sites) {
 				sites = mempool_array(pool);
 				// Prepend MASTER_SITE_OVERRIDE if it is set
-				const char *master_site_override = makevar("MASTER_SITE_OVERRIDE");
+				const char *master_site_override = makevar(job->env, "MASTER_SITE_OVERRIDE");
 				if (master_site_override) {
 					array_append(sites, str_dup(pool, master_site_override));
 				}
-				const char *sitesenv = getenv(str_printf(pool, "%s%s", env_prefix[distfile->sites_type], group));
+				size_t n_override_sites = array_len(sites);
+				const char *sitesenv = env_get(job->env, str_printf(pool, "%s%s", env_prefix[distfile->sites_type], group));
 				if (sitesenv == NULL) {
-					errx(1, "cannot find %s%s for %s group", env_prefix[distfile->sites_type], group, group);
+					return parfetch_job_error(job, "cannot find %s%s for %s group", env_prefix[distfile->sites_type], group, group);
 				}
 				ARRAY_JOIN(sites, str_split(pool, str_dup(pool, sitesenv), " "))
-				const char *master_site_backup = makevar("MASTER_SITE_BACKUP");
+				const char *master_site_backup = makevar(job->env, "MASTER_SITE_BACKUP");
 				if (master_site_backup) {
 					ARRAY_JOIN(sites, str_split(pool, str_dup(pool, master_site_backup), " "));
 				}
-				if (opts.randomize_sites) {
+				if (opts->randomize_sites) {
 					array_sort(sites, &(struct CompareTrait){random_compare, NULL});
+				} else if (mirrordb) {
+					// Order by the expected completion time
+					// from previous runs. The size of the first
+					// distfile stands in for the whole group.
+					off_t size = 0;
+					if (distfile->distinfo) {
+						size = distfile->distinfo->size;
+					}
+					sites = rank_sites(pool, mirrordb, sites, n_override_sites, size);
 				}
 				map_add(groupsites[distfile->sites_type], group, sites);
 			}
 
 			ARRAY_FOREACH(sites, const char *, site) {
 				struct DistfileQueueEntry *e = mempool_alloc(pool, sizeof(struct DistfileQueueEntry));
-				e->distinfo = distinfo;
-				e->progress = progress;
+				e->distinfo = job->distinfo;
+				e->progress = job->progress;
+				e->mirrordb = mirrordb;
 				e->distfile = distfile;
 				e->filename = str_dup(pool, distfile->name);
+				e->site = str_dup(pool, site);
 				e->url = str_printf(pool, "%s%s", site, distfile->name);
-				e->mdctx = mempool_add(pool, EVP_MD_CTX_new(), EVP_MD_CTX_free);
-				EVP_DigestInit_ex(e->mdctx, EVP_sha256(), NULL);
+				e->mdctx = mempool_add(pool, checksum_ctx_new(job->opts.checksum_algorithms), checksum_ctx_free);
+				e->segments = mempool_array(pool);
+				array_append(distfile->entries, e);
 				queue_push(distfile->queue, e);
 			}
 		}
 	}
+
+	return true;
 }
 
 void
-initial_distfile_check_cb(evutil_socket_t fd, short what, void *userdata)
+initial_distfile_check_files(struct InitialDistfileCheckData **batch, size_t n, struct Checksum *checksum)
 {
-	struct InitialDistfileCheckData *this = userdata;
-	uint8_t buf[65536];
-	ssize_t nread = read(fd, buf, sizeof(buf));
-	if (nread < 0) {
-		unless (errno == EAGAIN) {
+	struct InitialDistfileCheckData *files[CHECKSUM_MAX_LANES];
+	struct ChecksumCtx *ctxs[CHECKSUM_MAX_LANES];
+	int fds[CHECKSUM_MAX_LANES];
+	int errors[CHECKSUM_MAX_LANES];
+	size_t n_files = 0;
+	for (size_t i = 0; i < n; i++) {
+		struct InitialDistfileCheckData *this = batch[i];
+		const char *name = this->part ? this->distfile->partname : this->distfile->name;
+		int fd = openat(this->distfile->job->distdir_fd, name, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
 			this->error = errno;
-			event_del(this->event);
-			close(this->fd);
-			this->fd = -1;
-			array_append(this->finished_files, this);
+		} else if (fstat(fd, &this->st) == -1) {
+			this->error = errno;
+			close(fd);
+		} else {
+			files[n_files] = this;
+			ctxs[n_files] = this->mdctx;
+			fds[n_files] = fd;
+			n_files++;
 		}
-		return;
-	} else if (nread != 0) {
-		EVP_DigestUpdate(this->mdctx, buf, nread);
 	}
 
-	if (nread == 0 || nread != sizeof(buf)) {
-		event_del(this->event);
-		close(this->fd);
-		this->fd = -1;
-		array_append(this->finished_files, this);
-		initial_distfile_check_queue_file(this->pool, this->distinfo, this->distinfo_mtx, this->base, this->out, this->finished_files, this->files_to_checksum, this->verified_files);
+	checksum_files(checksum, n_files, fds, ctxs, errors);
+	for (size_t i = 0; i < n_files; i++) {
+		files[i]->error = errors[i];
+		close(fds[i]);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		initial_distfile_check_notify(batch[i]);
 	}
 }
 
 void
-initial_distfile_check_final(struct InitialDistfileCheckData *this)
+initial_distfile_check_notify(struct InitialDistfileCheckData *this)
 {
-	if (this->error != 0) {
-		status_msgf(this->out, STATUS_ERROR, "%s could not checksum: %s%s%s\n", this->distfile->name,
-			opts.color_error, strerror(this->error), opts.color_reset);
-		status_msgf(this->out, STATUS_UNLINK, "%s\n", this->distfile->name);
-		unlink(this->distfile->name);
-		this->distfile->fetched = false;
-	} else if (check_checksum(this->distinfo, this->distinfo_mtx, this->distfile, this->mdctx)) {
-		*this->verified_files += 1;
-		this->distfile->fetched = true;
-	} else if (opts.makesum) {
-		panic("check_checksum() returned with failure in makesum mode");
-	} else {
-		status_msgf(this->out, STATUS_ERROR, "%s %s%s%s\n", this->distfile->name,
-			opts.color_error, "checksum mismatch", opts.color_reset);
-		status_msgf(this->out, STATUS_UNLINK, "%s\n", this->distfile->name);
-		unlink(this->distfile->name);
-		this->distfile->fetched = false;
+	// Hand the result over to the main thread. Writes of less
+	// than PIPE_BUF bytes are atomic so all workers can share
+	// the pipe.
+	if (write(this->notify_fd, &this, sizeof(this)) != sizeof(this)) {
+		err(1, "write");
 	}
 }
 
 void
-initial_distfile_check_queue_file(struct Mempool *pool, struct Distinfo *distinfo, pthread_mutex_t *distinfo_mtx, struct event_base *base, FILE *out, struct Array *finished_files, struct Queue *files_to_checksum, size_t *verified_files)
+initial_distfile_check_notify_cb(evutil_socket_t fd, short what, void *userdata)
 {
-	struct Distfile *distfile = queue_pop(files_to_checksum);
-	unless (distfile) {
-		return;
+	struct InitialDistfileCheck *check = userdata;
+	struct ParfetchJob *job = check->job;
+	struct InitialDistfileCheckData *this;
+	while (check->pending > 0) {
+		ssize_t nread = read(fd, &this, sizeof(this));
+		if (nread < 0 && errno == EAGAIN) {
+			return;
+		} else if (nread != sizeof(this)) {
+			err(1, "read");
+		}
+		check->pending--;
+		this->distfile->checking = false;
+		if (this->after_lock) {
+			fetch_distfile_verify_done(this);
+			continue;
+		} else if (this->part) {
+			fetch_distfile_load_part_done(this);
+			continue;
+		}
+		if (initial_distfile_check_final(this)) {
+			check->verified_files++;
+			parfetch_job_distfile_done(job);
+		} else {
+			// Straight to the fetch queue with it
+			fetch_distfile_start(this->distfile);
+		}
+		check->initial_pending--;
+		if (check->initial_pending == 0) {
+			initial_distfile_check_summary(job, check->verified_files);
+		}
 	}
-	struct InitialDistfileCheckData *this = mempool_alloc(pool, sizeof(struct InitialDistfileCheckData));
-	this->mdctx = mempool_add(pool, EVP_MD_CTX_new(), EVP_MD_CTX_free);
-	EVP_DigestInit_ex(this->mdctx, EVP_sha256(), NULL);
-	this->pool = pool;
-	this->base = base;
-	this->distinfo = distinfo;
-	this->distinfo_mtx = distinfo_mtx;
-	this->distfile = distfile;
-	this->finished_files = finished_files;
-	this->files_to_checksum = files_to_checksum;
-	this->verified_files = verified_files;
-	this->out = out;
-	this->fd = open(this->distfile->name, O_RDONLY | O_NONBLOCK);
-	if (this->fd == -1) {
-		this->error = errno;
-		array_append(this->finished_files, this);
+
+	initial_distfile_check_free(check);
+	job->initial_check = NULL;
+}
+
+bool
+initial_distfile_check_final(struct InitialDistfileCheckData *this)
+{
+	struct ParfetchOptions *opts = &this->distfile->job->opts;
+	int distdir_fd = this->distfile->job->distdir_fd;
+	if (this->error != 0) {
+		status_msg(opts, STATUS_ERROR, "%s could not checksum: %s%s%s\n", this->distfile->name,
+			opts->color_error, strerror(this->error), opts->color_reset);
+		status_msg(opts, STATUS_UNLINK, "%s\n", this->distfile->name);
+		unlinkat(distdir_fd, this->distfile->name, 0);
+		this->distfile->fetched = false;
+	} else if (check_checksum(this->distfile->job->distinfo, NULL, this->distfile, this->mdctx)) {
+		this->distfile->fetched = true;
+		fetch_distfile_remember(this->distfile, &this->st);
+	} else if (opts->makesum) {
+		panic("check_checksum() returned with failure in makesum mode");
 	} else {
-		this->event = event_new(base, this->fd, EV_READ | EV_PERSIST, initial_distfile_check_cb, this);
-		struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
-		event_add(this->event, &tv);
+		status_msg(opts, STATUS_ERROR, "%s %s%s%s\n", this->distfile->name,
+			opts->color_error, "checksum mismatch", opts->color_reset);
+		status_msg(opts, STATUS_UNLINK, "%s\n", this->distfile->name);
+		unlinkat(distdir_fd, this->distfile->name, 0);
+		this->distfile->fetched = false;
 	}
+	return this->distfile->fetched;
 }
 
 void
 initial_distfile_check_worker(int tid, void *userdata)
 {
-	SCOPE_MEMPOOL(pool);
-	struct InitialDistfileCheckWorkerData *this = userdata;
-
-	struct Array *finished_files = mempool_array(pool);
-	struct event_base *base = mempool_add(pool, event_base_new(), event_base_free);
-	for (size_t i = 0; i < this->queue_size && queue_len(this->files_to_checksum); i++) {
-		initial_distfile_check_queue_file(pool, this->distinfo, this->distinfo_mtx, base, this->out, finished_files, this->files_to_checksum, &this->verified_files);
-	}
-	event_base_dispatch(base);
-
-	ARRAY_FOREACH(finished_files, struct InitialDistfileCheckData *, this) {
-		initial_distfile_check_final(this);
+	struct InitialDistfileCheck *check = userdata;
+	struct Checksum *checksum = checksum_new(check->job->opts.checksum_backend);
+	size_t lanes = checksum_lanes(checksum);
+	for (;;) {
+		// Files of similar size are next to each other. Backends
+		// that hash several files at once get a batch of small
+		// ones. Large files are left to the other threads. So
+		// are .part files as the multi-buffer backends can only
+		// give us a final digest but we need to continue the hash.
+		struct InitialDistfileCheckData *batch[CHECKSUM_MAX_LANES];
+		size_t n = 0;
+		pthread_mutex_lock(&check->files_mtx);
+		while (n < lanes && check->next_file < array_len(check->files)) {
+			struct InitialDistfileCheckData *this = array_get(check->files, check->next_file);
+			if (n > 0 && (batch[0]->size > CHECKSUM_BUFFER_SIZE || this->size > CHECKSUM_BUFFER_SIZE || batch[0]->part || this->part)) {
+				break;
+			}
+			batch[n++] = this;
+			check->next_file++;
+		}
+		if (n == 0) {
+			check->workers--;
+		}
+		pthread_mutex_unlock(&check->files_mtx);
+		if (n == 0) {
+			checksum_free(checksum);
+			return;
+		}
+		initial_distfile_check_files(batch, n, checksum);
 	}
 }
 
 void
-initial_distfile_check(struct Distinfo *distinfo, struct Array *distfiles)
+initial_distfile_check(struct ParfetchJob *job)
 {
-	SCOPE_MEMPOOL(pool);
+	struct ParfetchOptions *opts = &job->opts;
+	struct Distinfo *distinfo = job->distinfo;
+	struct Array *distfiles = job->distfiles;
 
-	// Check file existence and checksums if requested
-	struct Queue *files_to_checksum = mempool_queue(pool);
+	// Check file existence first. Missing files can be fetched
+	// right away while the others are checksummed in the
+	// background.
+	struct InitialDistfileCheck *check = initial_distfile_check_new(job);
 	ARRAY_FOREACH(distfiles, struct Distfile *, distfile) {
 		struct stat st;
-		if (stat(distfile->name, &st) >= 0) {
-			if (opts.makesum) {
-				distfile->fetched = true;
+		bool checksum = false;
+		if (fstatat(job->distdir_fd, distfile->name, &st, 0) == -1) {
+			// Maybe some other port fetched it already
+			fetch_distfile_store_get(distfile);
+		}
+		// After linking it out of the store since that changes
+		// its ctime
+		if (fstatat(job->distdir_fd, distfile->name, &st, 0) >= 0) {
+			if (opts->makesum) {
 				if (distfile->distinfo->size != st.st_size) {
-					unless (opts.makesum_keep_timestamp) {
+					unless (opts->makesum_keep_timestamp) {
 						distinfo_set_timestamp(distinfo, time(NULL));
 					}
 					distfile->distinfo->size = st.st_size;
 				}
-				queue_push(files_to_checksum, distfile);
-			} else if (opts.disable_size) {
-				if (opts.no_checksum) {
+				checksum = true;
+			} else if (opts->disable_size) {
+				if (opts->no_checksum) {
 					distfile->fetched = true;
 				} else {
-					queue_push(files_to_checksum, distfile);
+					checksum = true;
 				}
 			} else if (distfile->distinfo) {
 				if (distfile->distinfo->size == st.st_size) {
-					if (opts.no_checksum) {
+					if (opts->no_checksum) {
 						distfile->fetched = true;
 					} else {
-						queue_push(files_to_checksum, distfile);
+						checksum = true;
 					}
 				} else {
-					status_msg(STATUS_ERROR, "%s %ssize mismatch (expected: %lld, actual: %lld)%s\n", distfile->name,
-						opts.color_error, (long long)distfile->distinfo->size, (long long)st.st_size, opts.color_reset);
-					status_msg(STATUS_UNLINK, "%s\n", distfile->name);
-					unlink(distfile->name);
+					status_msg(opts, STATUS_ERROR, "%s %ssize mismatch (expected: %lld, actual: %lld)%s\n", distfile->name,
+						opts->color_error, (long long)distfile->distinfo->size, (long long)st.st_size, opts->color_reset);
+					status_msg(opts, STATUS_UNLINK, "%s\n", distfile->name);
+					unlinkat(job->distdir_fd, distfile->name, 0);
 					distfile->fetched = false;
 				}
 			} else {
@@ -674,312 +1879,2448 @@ initial_distfile_check(struct Distinfo *distinfo, struct Array *distfiles)
 		} else { // missing
 			distfile->fetched = false;
 		}
+		if (checksum && !opts->makesum && !opts->strict_checksum && distfile->distinfo &&
+		    fetch_distfile_remembered(distfile, &st)) {
+			// Unchanged since we last verified it
+			checksum = false;
+			distfile->fetched = true;
+			check->verified_files++;
+		}
+		if (checksum) {
+			initial_distfile_check_add(check, distfile, st.st_size);
+		}
 	}
 
-	struct Workqueue *wqueue = mempool_workqueue(pool, opts.initial_distfile_check_threads);
-	size_t n_threads = workqueue_threads(wqueue);
-	struct InitialDistfileCheckWorkerData *data = mempool_take(pool, xrecallocarray(NULL, 0, n_threads, sizeof(struct InitialDistfileCheckWorkerData)));
-	pthread_mutex_t distinfo_mtx = PTHREAD_MUTEX_INITIALIZER;
-	for (size_t i = 0; i < n_threads; i++) {
-		data[i].queue_size = INITIAL_DISTFILE_CHECK_QUEUE_SIZE / n_threads;
-		data[i].distinfo = distinfo;
-		data[i].distinfo_mtx = &distinfo_mtx;
-		data[i].files_to_checksum = mempool_queue(pool);
-		data[i].out = open_memstream(&data[i].out_buf, &data[i].out_len);
-		unless (data[i].out) {
-			err(1, "open_memstream");
-		}
+	check->initial_pending = check->pending;
+	if (check->pending == 0) {
+		initial_distfile_check_summary(job, check->verified_files);
+		initial_distfile_check_free(check);
+		return;
 	}
-	while (queue_len(files_to_checksum) > 0) {
-		for (size_t i = 0; i < n_threads && queue_len(files_to_checksum) > 0; i++) {
-			queue_push(data[i].files_to_checksum, queue_pop(files_to_checksum));
+	job->initial_check = check;
+
+	// The largest file decides how long the check takes so start
+	// with it while the others are spread over the remaining
+	// threads
+	array_sort(check->files, &(struct CompareTrait){initial_distfile_check_compare, NULL});
+	initial_distfile_check_run(check);
+}
+
+struct InitialDistfileCheck *
+initial_distfile_check_new(struct ParfetchJob *job)
+{
+	struct InitialDistfileCheck *check = xmalloc(sizeof(struct InitialDistfileCheck));
+	check->pool = mempool_new();
+	check->job = job;
+	check->notify_fds[0] = -1;
+	check->notify_fds[1] = -1;
+	pthread_mutex_init(&check->files_mtx, NULL);
+	check->files = mempool_array(check->pool);
+	return check;
+}
+
+// Queue an existing distfile for the workers. Workers that are
+// still running might pick it up right away. Otherwise it waits
+// for initial_distfile_check_run().
+struct InitialDistfileCheckData *
+initial_distfile_check_add(struct InitialDistfileCheck *check, struct Distfile *distfile, off_t size)
+{
+	struct ParfetchJob *job = check->job;
+	struct ParfetchOptions *opts = &job->opts;
+	if (check->notify_fds[0] == -1) {
+		if (pipe(check->notify_fds) == -1) {
+			err(1, "pipe");
 		}
+		fcntl(check->notify_fds[0], F_SETFL, fcntl(check->notify_fds[0], F_GETFL) | O_NONBLOCK);
+		fcntl(check->notify_fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(check->notify_fds[1], F_SETFD, FD_CLOEXEC);
+		check->notify_event = event_new(job->base, check->notify_fds[0], EV_READ | EV_PERSIST, initial_distfile_check_notify_cb, check);
+		event_add(check->notify_event, NULL);
 	}
-	for (size_t i = 0; i < n_threads; i++) {
-		workqueue_push(wqueue, initial_distfile_check_worker, &data[i]);
+
+	distfile->checking = true;
+	struct InitialDistfileCheckData *data = mempool_alloc(check->pool, sizeof(struct InitialDistfileCheckData));
+	data->distfile = distfile;
+	data->size = size;
+	data->notify_fd = check->notify_fds[1];
+	data->mdctx = mempool_add(check->pool, checksum_ctx_new(opts->checksum_algorithms), checksum_ctx_free);
+	pthread_mutex_lock(&check->files_mtx);
+	array_append(check->files, data);
+	pthread_mutex_unlock(&check->files_mtx);
+	check->pending++;
+	return data;
+}
+
+// Start enough workers for the queued files
+void
+initial_distfile_check_run(struct InitialDistfileCheck *check)
+{
+	struct ParfetchOptions *opts = &check->job->opts;
+	unless (check->wqueue) {
+		check->wqueue = mempool_workqueue(check->pool, MIN(opts->initial_distfile_check_threads, check->pending));
 	}
-	workqueue_wait(wqueue);
 
-	size_t verified_files = 0;
-	for (size_t i = 0; i < n_threads; i++) {
-		struct InitialDistfileCheckWorkerData *this = &data[i];
-		fclose(this->out);
-		fputs(this->out_buf, opts.out);
-		free(this->out_buf);
-		verified_files += this->verified_files;
+	size_t n_workers = 0;
+	pthread_mutex_lock(&check->files_mtx);
+	size_t n_threads = MIN(workqueue_threads(check->wqueue), array_len(check->files) - check->next_file);
+	if (check->workers < n_threads) {
+		n_workers = n_threads - check->workers;
+		check->workers = n_threads;
 	}
-	panic_unless(queue_len(files_to_checksum) == 0, "unprocessed files?");
+	pthread_mutex_unlock(&check->files_mtx);
+	for (size_t i = 0; i < n_workers; i++) {
+		workqueue_push(check->wqueue, initial_distfile_check_worker, check);
+	}
+}
 
+void
+initial_distfile_check_summary(struct ParfetchJob *job, size_t verified_files)
+{
+	struct ParfetchOptions *opts = &job->opts;
+	struct Array *distfiles = job->distfiles;
 	if (array_len(distfiles) > 0) {
 		if (array_len(distfiles) == verified_files) {
 			if (verified_files == 1) {
-				status_msg(STATUS_DONE, "%zu file verified\n", array_len(distfiles));
+				status_msg(opts, STATUS_DONE, "%zu file verified\n", array_len(distfiles));
 			} else {
-				status_msg(STATUS_DONE, "all %zu files verified\n", array_len(distfiles));
+				status_msg(opts, STATUS_DONE, "all %zu files verified\n", array_len(distfiles));
 			}
 		} else if (verified_files > 0) {
-			status_msg(STATUS_FAILED, "only %zu of %zu files verified\n", verified_files, array_len(distfiles));
+			status_msg(opts, STATUS_FAILED, "only %zu of %zu files verified\n", verified_files, array_len(distfiles));
 		} else {
-			status_msg(STATUS_FAILED, "none of the %zu files verified\n", array_len(distfiles));
+			status_msg(opts, STATUS_FAILED, "none of the %zu files verified\n", array_len(distfiles));
 		}
 	}
 }
 
 void
-fetch_distfile(CURLM *cm, struct Queue *distfile_queue)
+initial_distfile_check_free(struct InitialDistfileCheck *check)
 {
-	struct DistfileQueueEntry *queue_entry = queue_pop(distfile_queue);
-	if (queue_entry) {
-		if (queue_entry->distfile->fh) {
-			fclose(queue_entry->distfile->fh);
-		}
-		if (opts.makesum && opts.makesum_ephemeral) {
-			queue_entry->distfile->fh = NULL;
-		} else {
-			SCOPE_MEMPOOL(pool);
-			char *dir = dirname(str_dup(pool, queue_entry->filename));
-			unless (mkdirp(dir)) {
-				err(1, "mkdirp: %s", dir);
-			}
-			queue_entry->distfile->fh = fopen(queue_entry->filename, "wb");
-			unless (queue_entry->distfile->fh) {
-				errx(1, "could not open: %s", queue_entry->filename);
-			}
+	if (check) {
+		if (check->notify_event) {
+			event_free(check->notify_event);
 		}
-		CURL *eh = curl_easy_init();
-		curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
-		curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, fetch_distfile_write_cb);
-		curl_easy_setopt(eh, CURLOPT_WRITEDATA, queue_entry);
-		curl_easy_setopt(eh, CURLOPT_NOPROGRESS, 0L);
-		curl_easy_setopt(eh, CURLOPT_XFERINFOFUNCTION, fetch_distfile_progress_cb);
-		curl_easy_setopt(eh, CURLOPT_XFERINFODATA, queue_entry);
-		curl_easy_setopt(eh, CURLOPT_PRIVATE, queue_entry);
-		curl_easy_setopt(eh, CURLOPT_URL, queue_entry->url);
-		if (opts.disable_size) {
-			// nothing
-		} else if (queue_entry->distfile->distinfo) {
-			curl_easy_setopt(eh, CURLOPT_MAXFILESIZE_LARGE, queue_entry->distfile->distinfo->size);
+		// Wait for the workers when the job goes away before
+		// all files were checked. They do not need to start on
+		// any more files though.
+		if (check->wqueue) {
+			pthread_mutex_lock(&check->files_mtx);
+			check->next_file = array_len(check->files);
+			pthread_mutex_unlock(&check->files_mtx);
+			workqueue_wait(check->wqueue);
 		}
-		const char *fetch_env = makevar("FETCH_ENV");
-		if (fetch_env) {
-			SCOPE_MEMPOOL(pool);
-			ARRAY_FOREACH(str_split(pool, fetch_env, ""), const char *, value) {
-				if (strcmp(value, "SSL_NO_VERIFY_PEER=1") != 0) {
-					curl_easy_setopt(eh, CURLOPT_SSL_VERIFYPEER, 0L);
-				} else if (strcmp(value, "SSL_NO_VERIFY_HOSTNAME=1") != 0) {
-					curl_easy_setopt(eh, CURLOPT_SSL_VERIFYHOST, 0L);
-				} else {
-					warnx("unhandled value in FETCH_ENV: %s", value);
-				}
-			}
+		mempool_free(check->pool);
+		pthread_mutex_destroy(&check->files_mtx);
+		if (check->notify_fds[0] != -1) {
+			close(check->notify_fds[0]);
+			close(check->notify_fds[1]);
 		}
-		curl_multi_add_handle(cm, eh);
-		status_msg(STATUS_QUEUED, "%s\n", queue_entry->url);
+		free(check);
 	}
 }
 
-size_t
-fetch_distfile_progress_cb(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+struct DistfileQueueEntry *
+fetch_distfile_pop(struct Distfile *distfile)
 {
-	struct DistfileQueueEntry *queue_entry = userdata;
-	if (opts.makesum) {
-		// In makesum mode we don't know the size upfront
-		// so once curl knows update the total number of
-		// bytes.
-		if (dltotal != queue_entry->dltotal) {
-			progress_update_total(queue_entry->progress, -queue_entry->dltotal);
-			progress_update_total(queue_entry->progress, dltotal);
-			queue_entry->dltotal = dltotal;
+	// Mirrors on hosts that are down are dropped right away
+	// instead of running into the same timeout again
+	struct DistfileQueueEntry *queue_entry;
+	while ((queue_entry = queue_pop(distfile->queue))) {
+		if (hosthealth_allow(host_health, hosthealth_get(host_health, queue_entry->url))) {
+			return queue_entry;
 		}
 	}
-	return 0;
+	return NULL;
 }
 
-size_t
-fetch_distfile_write_cb(char *data, size_t size, size_t nmemb, void *userdata)
+void
+fetch_distfile(struct Distfile *distfile)
 {
-	struct DistfileQueueEntry *queue_entry = userdata;
-	size_t written;
-	if (queue_entry->distfile->fh) {
-		written = fwrite(data, size, nmemb, queue_entry->distfile->fh);
+	struct DistfileQueueEntry *queue_entry = fetch_distfile_pop(distfile);
+	if (queue_entry) {
+		fetch_distfile_entry(distfile->cm, queue_entry);
 	} else {
-		written = size * nmemb;
+		// No more mirrors left
+		parfetch_job_distfile_done(distfile->job);
 	}
-	queue_entry->size += written;
-	progress_update(queue_entry->progress, written, queue_entry->distfile->name);
-	EVP_DigestUpdate(queue_entry->mdctx, data, written);
-	return written;
 }
 
-void
-fetch_distfile_next_mirror(struct DistfileQueueEntry *queue_entry, CURLM *cm, enum FetchDistfileNextReason reason, const char *msg)
+bool
+fetch_distfile_open(struct Distfile *distfile)
 {
-	const char *next_mirror_msg = "Trying next mirror...";
-	if (queue_len(queue_entry->distfile->queue) == 0) {
-		next_mirror_msg = "No more mirrors left!";
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (opts->makesum && opts->makesum_ephemeral) {
+		return true;
 	}
 
-	// Try to delete the file
-	unlink(queue_entry->distfile->name);
-	queue_entry->distfile->fetched = false;
-	progress_update(queue_entry->progress, -queue_entry->size, NULL);
-	queue_entry->size = 0;
-	// Reset digest context
-	EVP_DigestInit_ex(queue_entry->mdctx, EVP_sha256(), NULL);
+	SCOPE_MEMPOOL(pool);
+	char *dir = dirname(str_dup(pool, distfile->partname));
+	unless (mkdirpat(distfile->job->distdir_fd, dir)) {
+		status_msg(opts, STATUS_ERROR, "%s %scould not create %s: %s%s\n", distfile->name,
+			opts->color_error, dir, strerror(errno), opts->color_reset);
+		return false;
+	}
+	// Opened for reading too since segmented transfers
+	// read back the file to update the digest in order
+	distfile->fd = openat(distfile->job->distdir_fd, distfile->partname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (distfile->fd == -1) {
+		status_msg(opts, STATUS_ERROR, "%s %scould not open %s: %s%s\n", distfile->name,
+			opts->color_error, distfile->partname, strerror(errno), opts->color_reset);
+		return false;
+	}
+#ifdef O_DIRECT
+	if (opts->direct_io) {
+		// Not all file systems support it. We simply do without
+		// it then.
+		distfile->direct_fd = openat(distfile->job->distdir_fd, distfile->partname, O_WRONLY | O_DIRECT | O_CLOEXEC);
+	}
+#endif
+	return true;
+}
 
-	status_msg(STATUS_ERROR, "%s", queue_entry->url);
+void
+fetch_distfile_close(struct Distfile *distfile)
+{
+	if (distfile->fd != -1) {
+		close(distfile->fd);
+		distfile->fd = -1;
+	}
+	if (distfile->direct_fd != -1) {
+		close(distfile->direct_fd);
+		distfile->direct_fd = -1;
+	}
+}
 
-	switch (reason) {
-	case FETCH_DISTFILE_NEXT_MIRROR:
-		fputc('\n', opts.out);
-		break;
-	case FETCH_DISTFILE_NEXT_CHECKSUM_MISMATCH:
-		fprintf(opts.out, " %s%s%s\n", opts.color_error, "checksum mismatch", opts.color_reset);
-		break;
-	case FETCH_DISTFILE_NEXT_SIZE_MISMATCH:
-		if (queue_entry->distfile->distinfo) {
-			fprintf(opts.out, " %ssize mismatch (expected: %lld, actual: %lld)%s\n",
-				opts.color_error, (long long)queue_entry->distfile->distinfo->size, (long long)queue_entry->size, opts.color_reset);
-		} else {
-			fputc('\n', opts.out);
-		}
-		break;
-	case FETCH_DISTFILE_NEXT_HTTP_ERROR:
-		fputc('\n', opts.out);
-		break;
+void
+fetch_distfile_preallocate(struct Distfile *distfile)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (opts->makesum || opts->disable_size || !distfile->distinfo) {
+		return;
+	} else if (distfile->distinfo->size <= distfile->resume_offset) {
+		return;
 	}
-	if (msg) {
-		status_msg(STATUS_EMPTY, "%s%s%s\n", opts.color_error, msg, opts.color_reset);
+	// Reserve the space upfront so that the file system can lay
+	// the file out in one piece instead of growing it with every
+	// write. This is only a hint and some file systems like ZFS
+	// do not support it so errors are ignored.
+	posix_fallocate(distfile->fd, distfile->resume_offset, distfile->distinfo->size - distfile->resume_offset);
+}
+
+long
+fetch_distfile_min_speed(struct DistfileQueueEntry *queue_entry, size_t n_segments)
+{
+	struct Distfile *distfile = queue_entry->distfile;
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (opts->stall_time == 0 || queue_len(distfile->queue) == 0) {
+		// A slow mirror is better than none
+		return 0;
+	} else if (opts->max_speed > 0 || opts->max_host_speed > 0) {
+		// Our own limits would make it look stalled
+		return 0;
 	}
 
-	// queue next mirror for file
-	status_msg(STATUS_EMPTY, "%s\n", next_mirror_msg);
+	// A mirror that usually is fast but now only trickles along
+	// is probably overloaded. Compare with what we have seen from
+	// the host before and fall back to PARFETCH_MIN_SPEED for
+	// hosts we know nothing about.
+	double speed = 0;
+	if (queue_entry->mirrordb) {
+		speed = mirrordb_expected_speed(queue_entry->mirrordb, queue_entry->url) * FETCH_DISTFILE_STALL_FRACTION;
+	}
+	return MAX(opts->min_speed, (long)(speed / n_segments));
+}
 
-	status_msg(STATUS_UNLINK, "%s\n", queue_entry->distfile->name);
-	fetch_distfile(cm, queue_entry->distfile->queue);
+size_t
+fetch_distfile_segment_count(struct DistfileQueueEntry *queue_entry)
+{
+	struct ParfetchOptions *opts = &queue_entry->distfile->job->opts;
+	if (opts->segments <= 1 || queue_entry->ranges_unsupported || queue_entry->racing) {
+		return 1;
+	} else if (opts->makesum || opts->disable_size || queue_entry->distfile->fd == -1) {
+		// We need to know the size upfront and a file to write to
+		return 1;
+	} else if (!queue_entry->distfile->distinfo || queue_entry->distfile->distinfo->size - queue_entry->resume_offset < opts->segment_threshold) {
+		return 1;
+	} else if (!str_startswith(queue_entry->url, "http://") && !str_startswith(queue_entry->url, "https://")) {
+		return 1;
+	} else {
+		curl_off_t max_segments = (queue_entry->distfile->distinfo->size - queue_entry->resume_offset) / FETCH_DISTFILE_MIN_SEGMENT_SIZE;
+		return MAX(1, MIN(opts->segments, max_segments));
+	}
 }
 
-bool
-response_code_ok(long code, long protocol)
+void
+fetch_distfile_entry(CURLM *cm, struct DistfileQueueEntry *queue_entry)
 {
-	switch (protocol) {
-	case CURLPROTO_FTP:
-	case CURLPROTO_FTPS:
-		if (code == 226) {
-			return true;
-		}
-		break;
-	case CURLPROTO_HTTP:
-	case CURLPROTO_HTTPS:
-		if (code == 200) {
-			return true;
+	struct Distfile *distfile = queue_entry->distfile;
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (queue_entry->ranges_unsupported && distfile->resume_offset > 0) {
+		// This mirror cannot continue where the others left off
+		distfile->resume_offset = 0;
+		checksum_ctx_reset(distfile->resume_mdctx);
+	}
+	if (distfile->fd != -1) {
+		// Anything past the good prefix is thrown away
+		if (ftruncate(distfile->fd, distfile->resume_offset) == -1) {
+			err(1, "could not truncate: %s", distfile->partname);
 		}
-		break;
-	default:
-		errx(1, "unsupported protocol: %ld", protocol);
+		fetch_distfile_record_valid(distfile, distfile->resume_offset);
+		fetch_distfile_preallocate(distfile);
 	}
 
-	return false;
+	// Skip the redirect if we know where the site sends us
+	const char *target = NULL;
+	unless (queue_entry->redirect_failed) {
+		target = redirectdb_get(redirect_db, queue_entry->site);
+	}
+	if (target) {
+		queue_entry->url = str_printf(distfile->pool, "%s%s", target, distfile->name);
+		queue_entry->redirected = true;
+	} else if (queue_entry->redirected) {
+		queue_entry->url = str_printf(distfile->pool, "%s%s", queue_entry->site, distfile->name);
+		queue_entry->redirected = false;
+	}
+	queue_entry->host_state = hosthealth_get(host_health, queue_entry->url);
+
+	// Continue from the good prefix
+	fetch_distfile_reset(queue_entry);
+	checksum_ctx_copy(queue_entry->mdctx, distfile->resume_mdctx);
+	queue_entry->resume_offset = distfile->resume_offset;
+	queue_entry->write_failed = false;
+	queue_entry->hashed = distfile->resume_offset;
+	queue_entry->size = distfile->resume_offset;
+	progress_update(queue_entry->progress, queue_entry->size, distfile->name);
+	unless (queue_entry->racing) {
+		distfile->writer = queue_entry;
+	}
+
+	size_t n_segments = fetch_distfile_segment_count(queue_entry);
+	queue_entry->min_speed = fetch_distfile_min_speed(queue_entry, n_segments);
+	curl_off_t segment_size = 0;
+	if (n_segments > 1) {
+		segment_size = (distfile->distinfo->size - queue_entry->resume_offset) / n_segments;
+	}
+	array_truncate(queue_entry->segments);
+	queue_entry->active_segments = 0;
+	bool high_priority = (opts->priority == FETCH_PRIORITY_DISTFILES && distfile->sites_type == MASTER_SITES) ||
+		(opts->priority == FETCH_PRIORITY_PATCHFILES && distfile->sites_type == PATCH_SITES);
+	for (size_t i = 0; i < n_segments; i++) {
+		struct DistfileSegment *segment = mempool_alloc(queue_entry->distfile->pool, sizeof(struct DistfileSegment));
+		segment->queue_entry = queue_entry;
+		segment->length = -1;
+		CURL *eh = parfetch_curl_easy_get();
+		segment->eh = eh;
+		if (n_segments > 1) {
+			SCOPE_MEMPOOL(pool);
+			segment->offset = queue_entry->resume_offset + i * segment_size;
+			if (i == n_segments - 1) {
+				segment->length = queue_entry->distfile->distinfo->size - segment->offset;
+			} else {
+				segment->length = segment_size;
+			}
+			const char *range = str_printf(pool, "%lld-%lld",
+				(long long)segment->offset, (long long)(segment->offset + segment->length - 1));
+			curl_easy_setopt(eh, CURLOPT_RANGE, range);
+			curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, fetch_distfile_write_segment_cb);
+		} else {
+			if (queue_entry->resume_offset > 0) {
+				curl_easy_setopt(eh, CURLOPT_RESUME_FROM_LARGE, queue_entry->resume_offset);
+			}
+			curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, fetch_distfile_write_cb);
+		}
+		curl_easy_setopt(eh, CURLOPT_WRITEDATA, segment);
+		curl_easy_setopt(eh, CURLOPT_XFERINFODATA, segment);
+		curl_easy_setopt(eh, CURLOPT_PRIVATE, segment);
+		curl_easy_setopt(eh, CURLOPT_URL, queue_entry->url);
+		if (opts->disable_size) {
+			// nothing
+		} else if (queue_entry->distfile->distinfo && n_segments == 1) {
+			curl_easy_setopt(eh, CURLOPT_MAXFILESIZE_LARGE, queue_entry->distfile->distinfo->size);
+		}
+		if (opts->ssl_no_verify_peer) {
+			curl_easy_setopt(eh, CURLOPT_SSL_VERIFYPEER, 0L);
+		}
+		if (opts->ssl_no_verify_hostname) {
+			curl_easy_setopt(eh, CURLOPT_SSL_VERIFYHOST, 0L);
+		}
+		if (queue_entry->min_speed > 0) {
+			curl_easy_setopt(eh, CURLOPT_LOW_SPEED_LIMIT, queue_entry->min_speed);
+			curl_easy_setopt(eh, CURLOPT_LOW_SPEED_TIME, opts->stall_time);
+		}
+		if (opts->schedule != FETCH_SCHEDULE_NONE) {
+			// Let the HTTP/2 server prefer the streams of
+			// distfiles that are early in the schedule
+			curl_easy_setopt(eh, CURLOPT_STREAM_WEIGHT, MAX(16L, 256L / (long)(distfile->rank + 1)));
+		}
+		array_append(queue_entry->segments, segment);
+		queue_entry->active_segments++;
+		ratelimit_add(rate_limit, queue_entry->url, eh, high_priority);
+		hostlimits_add(host_limits, queue_entry->url, eh);
+	}
+	if (n_segments > 1 && queue_entry->resume_offset > 0) {
+		status_msg(opts, STATUS_QUEUED, "%s (%zu segments, resuming at %lld bytes)\n", queue_entry->url, n_segments, (long long)queue_entry->resume_offset);
+	} else if (n_segments > 1) {
+		status_msg(opts, STATUS_QUEUED, "%s (%zu segments)\n", queue_entry->url, n_segments);
+	} else if (queue_entry->resume_offset > 0) {
+		status_msg(opts, STATUS_QUEUED, "%s (resuming at %lld bytes)\n", queue_entry->url, (long long)queue_entry->resume_offset);
+	} else {
+		status_msg(opts, STATUS_QUEUED, "%s\n", queue_entry->url);
+	}
 }
 
 void
-check_multi_info(CURLM *cm)
+fetch_distfile_without_ranges(CURLM *cm, struct DistfileQueueEntry *queue_entry)
 {
-	int pending;
-	CURLMsg *message;
-	while ((message = curl_multi_info_read(cm, &pending))) {
-		switch (message->msg) {
-		case CURLMSG_DONE: {
-			struct DistfileQueueEntry *queue_entry = NULL;
-			// message becomes invalid after curl_easy_cleanup() or curl_multi_remove_handle()!
-			CURL *easy_handle = message->easy_handle;
-			curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &queue_entry);
-			if (queue_entry->distfile->fh) {
-				fclose(queue_entry->distfile->fh);
-				queue_entry->distfile->fh = NULL;
+	struct ParfetchOptions *opts = &queue_entry->distfile->job->opts;
+	queue_entry->ranges_unsupported = true;
+	fetch_distfile_reset(queue_entry);
+	if (queue_entry->distfile->resume_offset > 0 && queue_len(queue_entry->distfile->queue) > 0) {
+		// Try to continue on the other mirrors first and only
+		// start over here when they fail too
+		status_msg(opts, STATUS_CANCEL, "%s\n", queue_entry->url);
+		status_msg(opts, STATUS_EMPTY, "%s%s%s\n", opts->color_warning, "cannot resume", opts->color_reset);
+		queue_push(queue_entry->distfile->queue, queue_entry);
+		fetch_distfile(queue_entry->distfile);
+	} else {
+		fetch_distfile_entry(cm, queue_entry);
+	}
+}
+
+// Queue the .part file of an earlier run for the checksum workers
+// to recover its digest. The transfer continues in
+// fetch_distfile_load_part_done(). Returns false if there is
+// nothing to resume from.
+bool
+fetch_distfile_load_part(struct Distfile *distfile)
+{
+	struct ParfetchJob *job = distfile->job;
+	struct ParfetchOptions *opts = &job->opts;
+	if (opts->makesum && opts->makesum_ephemeral) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstatat(job->distdir_fd, distfile->partname, &st, 0) == -1) {
+		return false;
+	}
+	curl_off_t valid = fetch_distfile_valid_length(distfile);
+	if (valid >= 0 && valid < st.st_size && distfile->lock_fd != -1) {
+		// Whatever is past it is preallocated space or data
+		// of segments that did not catch up before the crash
+		if (ftruncate(distfile->lock_fd, valid) == -1) {
+			fetch_distfile_discard_part(distfile);
+			return false;
+		}
+		st.st_size = valid;
+	}
+	if (st.st_size == 0) {
+		return false;
+	} else if (opts->makesum || opts->disable_size || !distfile->distinfo || st.st_size >= distfile->distinfo->size) {
+		// We cannot tell if what we have is any good
+		fetch_distfile_discard_part(distfile);
+		return false;
+	}
+
+	unless (job->initial_check) {
+		job->initial_check = initial_distfile_check_new(job);
+	}
+	struct InitialDistfileCheckData *data = initial_distfile_check_add(job->initial_check, distfile, st.st_size);
+	data->part = true;
+	initial_distfile_check_run(job->initial_check);
+	return true;
+}
+
+void
+fetch_distfile_load_part_done(struct InitialDistfileCheckData *data)
+{
+	struct Distfile *distfile = data->distfile;
+	// The file is locked so nobody but us could have changed it
+	// since the worker looked at it
+	if (data->error == 0 && data->st.st_size < distfile->distinfo->size) {
+		checksum_ctx_copy(distfile->resume_mdctx, data->mdctx);
+		distfile->resume_offset = data->st.st_size;
+	} else {
+		fetch_distfile_discard_part(distfile);
+	}
+	fetch_distfile_race(distfile);
+}
+
+void
+fetch_distfile_discard_part(struct Distfile *distfile)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	status_msg(opts, STATUS_UNLINK, "%s\n", distfile->partname);
+	if (distfile->lock_fd != -1) {
+		// Keep the file and with it the lock
+		ftruncate(distfile->lock_fd, 0);
+	} else {
+		unlinkat(distfile->job->distdir_fd, distfile->partname, 0);
+	}
+	unlinkat(distfile->job->distdir_fd, distfile->validname, 0);
+}
+
+// Record that the first length bytes of partname are good. It is
+// only a hint for the next run so errors are ignored.
+void
+fetch_distfile_record_valid(struct Distfile *distfile, curl_off_t length)
+{
+	int fd = openat(distfile->job->distdir_fd, distfile->validname, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		return;
+	}
+	// Fixed width so that a single write replaces the old value
+	// without a window in which the file is empty
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%020jd\n", (intmax_t)length);
+	if (pwrite(fd, buf, len, 0) == len) {
+		distfile->valid = length;
+	}
+	close(fd);
+}
+
+// Returns the good prefix of partname as last recorded or -1 if
+// there is none
+curl_off_t
+fetch_distfile_valid_length(struct Distfile *distfile)
+{
+	int fd = openat(distfile->job->distdir_fd, distfile->validname, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	char buf[32];
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		return -1;
+	}
+	buf[len] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	const char *errstr = NULL;
+	curl_off_t length = strtonum(buf, 0, LLONG_MAX, &errstr);
+	if (errstr) {
+		return -1;
+	}
+	return length;
+}
+
+void
+fetch_distfile_start(struct Distfile *distfile)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	unless (fetch_distfile_lock(distfile)) {
+		// Someone else is fetching it. Check again later instead
+		// of downloading it a second time.
+		unless (distfile->lock_timer) {
+			status_msg(opts, STATUS_WAIT, "%s is being fetched by another process\n", distfile->name);
+			distfile->lock_timer = evtimer_new(distfile->base, fetch_distfile_lock_cb, distfile);
+		}
+		struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+		evtimer_add(distfile->lock_timer, &tv);
+		return;
+	}
+
+	if (distfile->lock_timer) {
+		event_free(distfile->lock_timer);
+		distfile->lock_timer = NULL;
+		// The other process is done. We only need to fetch the
+		// file ourselves if it failed. That is decided in
+		// fetch_distfile_verify_done() once it is checksummed.
+		if (!opts->makesum && fetch_distfile_verify(distfile)) {
+			return;
+		}
+	}
+
+	fetch_distfile_start_transfer(distfile);
+}
+
+void
+fetch_distfile_start_transfer(struct Distfile *distfile)
+{
+	if (distfile->extract) {
+		// Whatever was extracted before is from another version
+		// of the distfile or from an interrupted run
+		SCOPE_MEMPOOL(pool);
+		extract_remove(fetch_distfile_extract_path(pool, distfile, false));
+		extract_remove(fetch_distfile_extract_path(pool, distfile, true));
+	}
+	unless (fetch_distfile_load_part(distfile)) {
+		fetch_distfile_race(distfile);
+	}
+}
+
+bool
+fetch_distfile_lock(struct Distfile *distfile)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	int distdir_fd = distfile->job->distdir_fd;
+	if (distfile->lock_fd != -1 || (opts->makesum && opts->makesum_ephemeral)) {
+		return true;
+	}
+
+	SCOPE_MEMPOOL(pool);
+	char *dir = dirname(str_dup(pool, distfile->partname));
+	unless (mkdirpat(distdir_fd, dir)) {
+		// Left for fetch_distfile_open() to report
+		return true;
+	}
+	for (;;) {
+		int fd = openat(distdir_fd, distfile->partname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			return true;
+		}
+		if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+			if (errno == EWOULDBLOCK) {
+				close(fd);
+				return false;
+			}
+			// Not supported by the file system. We are on our
+			// own then like without locking.
+			distfile->lock_fd = fd;
+			return true;
+		}
+		// The previous owner might have renamed or removed the
+		// file between our open and flock. Whatever we locked
+		// then is not partname anymore.
+		struct stat st;
+		struct stat fd_st;
+		if (fstat(fd, &fd_st) == 0 && fstatat(distdir_fd, distfile->partname, &st, 0) == 0 &&
+		    st.st_dev == fd_st.st_dev && st.st_ino == fd_st.st_ino) {
+			distfile->lock_fd = fd;
+			return true;
+		}
+		close(fd);
+	}
+}
+
+void
+fetch_distfile_lock_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	struct Distfile *distfile = userdata;
+	fetch_distfile_start(distfile);
+}
+
+void
+fetch_distfile_unlock(struct Distfile *distfile)
+{
+	if (distfile->lock_fd != -1) {
+		close(distfile->lock_fd);
+		distfile->lock_fd = -1;
+	}
+}
+
+// Hand a distfile that another process fetched to the checksum
+// workers. Hashing a large file would block all other transfers
+// for too long otherwise. Returns false if there is nothing worth
+// checking.
+bool
+fetch_distfile_verify(struct Distfile *distfile)
+{
+	struct ParfetchJob *job = distfile->job;
+	struct ParfetchOptions *opts = &job->opts;
+	struct stat st;
+	if (fstatat(job->distdir_fd, distfile->name, &st, 0) == -1 ||
+	    (!opts->disable_size && distfile->distinfo && st.st_size != distfile->distinfo->size)) {
+		return false;
+	}
+
+	unless (job->initial_check) {
+		job->initial_check = initial_distfile_check_new(job);
+	}
+	struct InitialDistfileCheckData *data = initial_distfile_check_add(job->initial_check, distfile, st.st_size);
+	data->after_lock = true;
+	initial_distfile_check_run(job->initial_check);
+	return true;
+}
+
+void
+fetch_distfile_verify_done(struct InitialDistfileCheckData *data)
+{
+	struct Distfile *distfile = data->distfile;
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (data->error == 0 && check_checksum(distfile->job->distinfo, NULL, distfile, data->mdctx)) {
+		status_msg(opts, STATUS_DONE, "%s\n", distfile->name);
+		distfile->fetched = true;
+		fetch_distfile_remember(distfile, &data->st);
+		unlinkat(distfile->job->distdir_fd, distfile->partname, 0);
+		unlinkat(distfile->job->distdir_fd, distfile->validname, 0);
+		fetch_distfile_unlock(distfile);
+		parfetch_job_distfile_done(distfile->job);
+	} else {
+		fetch_distfile_start_transfer(distfile);
+	}
+}
+
+void
+fetch_distfile_trim_parts(struct Array *distfiles)
+{
+	ARRAY_FOREACH(distfiles, struct Distfile *, distfile) {
+		struct ParfetchOptions *opts = &distfile->job->opts;
+		int distdir_fd = distfile->job->distdir_fd;
+		if (distfile->fetched || (opts->makesum && opts->makesum_ephemeral)) {
+			continue;
+		} else if (distfile->lock_fd == -1) {
+			// Not ours to touch
+			continue;
+		} else if (distfile->checking) {
+			// The .part file is still as an earlier run left it
+			continue;
+		}
+		// Segmented transfers leave holes past the good prefix
+		// that would otherwise be mistaken for data on resume
+		curl_off_t length = distfile->resume_offset;
+		if (distfile->writer) {
+			fetch_distfile_sync(distfile);
+			unless (distfile->writer->write_failed) {
+				length = distfile->writer->hashed;
+			}
+		}
+		if (length > 0) {
+			int fd = openat(distdir_fd, distfile->partname, O_WRONLY | O_CLOEXEC);
+			if (fd != -1) {
+				ftruncate(fd, length);
+				close(fd);
+			}
+		} else {
+			unlinkat(distdir_fd, distfile->partname, 0);
+		}
+		// Its size is the good prefix now
+		unlinkat(distdir_fd, distfile->validname, 0);
+	}
+}
+
+void
+fetch_distfile_trim_parts_atexit()
+{
+	if (partial_distfiles) {
+		fetch_distfile_trim_parts(partial_distfiles);
+	}
+}
+
+void
+fetch_distfile_trim_parts_die_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	// Preallocated and segmented .part files are only good to
+	// resume from once trimmed. Then die from the signal like
+	// we would have without the handler.
+	int sig = (intptr_t)userdata;
+	fetch_distfile_trim_parts_atexit();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void
+fetch_distfile_trim_parts_signal_cb(evutil_socket_t sig, short what, void *userdata)
+{
+	// The progress bar restores the terminal and exits on SIGINT
+	// from its own handler which might only run after this one.
+	// Dying is left to the next round of the loop to not take
+	// that chance away from it. Its exit() trims the .part files
+	// in the atexit hook.
+	struct event_base *base = userdata;
+	event_base_once(base, -1, EV_TIMEOUT, fetch_distfile_trim_parts_die_cb, (void *)(intptr_t)sig, &(struct timeval){ 0, 0 });
+}
+
+void
+fetch_distfile_trim_parts_start(struct event_base *base, struct Array *distfiles)
+{
+	partial_distfiles = distfiles;
+	atexit(fetch_distfile_trim_parts_atexit);
+	partial_distfiles_sigint = evsignal_new(base, SIGINT, fetch_distfile_trim_parts_signal_cb, base);
+	partial_distfiles_sigterm = evsignal_new(base, SIGTERM, fetch_distfile_trim_parts_signal_cb, base);
+	evsignal_add(partial_distfiles_sigint, NULL);
+	evsignal_add(partial_distfiles_sigterm, NULL);
+}
+
+// Stop watching for signals once all work is done so that the
+// loop can finish
+void
+fetch_distfile_trim_parts_stop()
+{
+	event_del(partial_distfiles_sigint);
+	event_del(partial_distfiles_sigterm);
+}
+
+void
+fetch_distfile_trim_parts_end()
+{
+	event_free(partial_distfiles_sigint);
+	event_free(partial_distfiles_sigterm);
+	partial_distfiles_sigint = NULL;
+	partial_distfiles_sigterm = NULL;
+	partial_distfiles = NULL;
+}
+
+void
+fetch_distfile_cancel_segments(struct DistfileQueueEntry *queue_entry)
+{
+	// The transfers are aborted from inside their callbacks and
+	// then removed in check_multi_info(). Removing them here
+	// directly would leave curl_perform() with a stale count of
+	// running handles.
+	ARRAY_FOREACH(queue_entry->segments, struct DistfileSegment *, segment) {
+		if (segment->eh && !segment->cancelled) {
+			segment->cancelled = true;
+			queue_entry->active_segments--;
+			// What it received so far is still good and the
+			// next mirror might continue after it
+			fetch_distfile_segment_close(segment);
+			// Transfers that have not started yet will never
+			// call back so drop them right away
+			if (hostlimits_waiting(host_limits, queue_entry->url, segment->eh)) {
+				hostlimits_remove(host_limits, queue_entry->url, segment->eh, CURLE_ABORTED_BY_CALLBACK, 0);
+				parfetch_curl_easy_put(segment->eh);
+				segment->eh = NULL;
+			}
+		}
+	}
+}
+
+void
+fetch_distfile_digest_segments(struct DistfileQueueEntry *queue_entry)
+{
+	// Feed data that arrived out of order to the digest once
+	// all the preceding segments have caught up
+	for (size_t i = 0; i < array_len(queue_entry->segments); i++) {
+		struct DistfileSegment *segment = array_get(queue_entry->segments, i);
+		curl_off_t end = segment->offset + segment->written;
+		if (queue_entry->hashed < segment->offset) {
+			break;
+		} else if (queue_entry->hashed >= end) {
+			continue;
+		}
+		unless (fetch_distfile_segment_flush(segment)) {
+			return;
+		}
+		int fd = queue_entry->distfile->fd;
+		char buf[65536];
+		while (queue_entry->hashed < end) {
+			size_t len = MIN(sizeof(buf), (size_t)(end - queue_entry->hashed));
+			ssize_t nread = pread(fd, buf, len, queue_entry->hashed);
+			if (nread <= 0) {
+				// Leave it for check_checksum() to fail
+				return;
+			}
+			fetch_distfile_hash(queue_entry, buf, nread);
+		}
+	}
+}
+
+void
+fetch_distfile_hash(struct DistfileQueueEntry *queue_entry, const char *data, size_t len)
+{
+	struct Distfile *distfile = queue_entry->distfile;
+	checksum_ctx_update(queue_entry->mdctx, data, len);
+	if (distfile->data_cb) {
+		distfile->data_cb(distfile, queue_entry->hashed, data, len, distfile->data_cb_data);
+	}
+	queue_entry->hashed += len;
+	if (distfile->fd != -1 && distfile->writer == queue_entry &&
+	    queue_entry->hashed - distfile->valid >= FETCH_DISTFILE_VALID_INTERVAL) {
+		// Only what is on disk is good to resume from
+		fetch_distfile_sync(distfile);
+		unless (queue_entry->write_failed) {
+			fetch_distfile_record_valid(distfile, queue_entry->hashed);
+		}
+	}
+}
+
+size_t
+fetch_distfile_progress_cb(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+	struct DistfileSegment *segment = userdata;
+	struct DistfileQueueEntry *queue_entry = segment->queue_entry;
+	struct ParfetchOptions *opts = &queue_entry->distfile->job->opts;
+	if (segment->cancelled) {
+		return 1;
+	} else if (dlnow == 0 && hosthealth_down(queue_entry->host_state)) {
+		// Still waiting for a host that failed for the
+		// other transfers in the meantime
+		segment->host_down = true;
+		return 1;
+	} else if (opts->makesum) {
+		// In makesum mode we don't know the size upfront
+		// so once curl knows update the total number of
+		// bytes.
+		if (dltotal > 0) {
+			dltotal += queue_entry->resume_offset;
+		}
+		if (dltotal != queue_entry->dltotal) {
+			progress_update_total(queue_entry->progress, -queue_entry->dltotal);
+			progress_update_total(queue_entry->progress, dltotal);
+			queue_entry->dltotal = dltotal;
+		}
+	}
+	return 0;
+}
+
+size_t
+fetch_distfile_write_cb(char *data, size_t size, size_t nmemb, void *userdata)
+{
+	struct DistfileSegment *segment = userdata;
+	struct DistfileQueueEntry *queue_entry = segment->queue_entry;
+	size_t written = size * nmemb;
+	if (segment->cancelled) {
+		return 0;
+	} else unless (ratelimit_consume(rate_limit, segment->eh, size * nmemb)) {
+		// curl hands us the same data again once resumed
+		return CURL_WRITEFUNC_PAUSE;
+	} else if (queue_entry->racing) {
+		written = fwrite(data, 1, written, queue_entry->race_buf);
+		queue_entry->race_bytes += written;
+		if (queue_entry->race_bytes >= FETCH_DISTFILE_MAX_RACE_BUFFER) {
+			// We cannot remove handles from inside a curl
+			// callback so end the race on the next loop
+			// iteration instead
+			event_active(queue_entry->distfile->race_timer, EV_TIMEOUT, 0);
+		}
+		return written;
+	} else if (queue_entry->distfile->fd != -1) {
+		unless (fetch_distfile_segment_write(segment, queue_entry->size, data, written)) {
+			return 0;
+		}
+	}
+	queue_entry->size += written;
+	segment->written += written;
+	progress_update(queue_entry->progress, written, queue_entry->distfile->name);
+	fetch_distfile_hash(queue_entry, data, written);
+	return written;
+}
+
+size_t
+fetch_distfile_write_segment_cb(char *data, size_t size, size_t nmemb, void *userdata)
+{
+	struct DistfileSegment *segment = userdata;
+	struct DistfileQueueEntry *queue_entry = segment->queue_entry;
+	size_t len = size * nmemb;
+
+	if (segment->cancelled) {
+		return 0;
+	}
+	// A server that ignores the Range header sends us the
+	// whole file instead which we must not write at our offset
+	unless (segment->range_checked) {
+		long response_code = 0;
+		curl_easy_getinfo(segment->eh, CURLINFO_RESPONSE_CODE, &response_code);
+		if (response_code != 206) {
+			segment->range_unsupported = response_code == 200;
+			return 0;
+		}
+		segment->range_checked = true;
+	}
+	if (segment->written + (curl_off_t)len > segment->length) {
+		return 0;
+	}
+	unless (ratelimit_consume(rate_limit, segment->eh, len)) {
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	curl_off_t offset = segment->offset + segment->written;
+	unless (fetch_distfile_segment_write(segment, offset, data, len)) {
+		return 0;
+	}
+
+	if (queue_entry->hashed == offset) {
+		fetch_distfile_hash(queue_entry, data, len);
+	}
+	queue_entry->size += len;
+	segment->written += len;
+	progress_update(queue_entry->progress, len, queue_entry->distfile->name);
+	fetch_distfile_digest_segments(queue_entry);
+
+	return len;
+}
+
+bool
+fetch_distfile_segment_write(struct DistfileSegment *segment, curl_off_t offset, const char *data, size_t len)
+{
+	struct Distfile *distfile = segment->queue_entry->distfile;
+	if (segment->queue_entry->write_failed) {
+		return false;
+	}
+	unless (segment->buf) {
+		segment->buf = filebuf_new(distfile->fd, distfile->direct_fd);
+	}
+	if (filebuf_write(segment->buf, offset, data, len)) {
+		return true;
+	} else {
+		segment->queue_entry->write_failed = true;
+		return false;
+	}
+}
+
+bool
+fetch_distfile_segment_flush(struct DistfileSegment *segment)
+{
+	if (segment->buf && !filebuf_flush(segment->buf)) {
+		segment->queue_entry->write_failed = true;
+		return false;
+	} else {
+		return true;
+	}
+}
+
+void
+fetch_distfile_sync(struct Distfile *distfile)
+{
+	// Everything that was hashed must be on disk too
+	if (distfile->writer) {
+		ARRAY_FOREACH(distfile->writer->segments, struct DistfileSegment *, segment) {
+			fetch_distfile_segment_flush(segment);
+		}
+	}
+}
+
+bool
+fetch_distfile_segment_close(struct DistfileSegment *segment)
+{
+	bool ok = fetch_distfile_segment_flush(segment);
+	filebuf_free(segment->buf);
+	segment->buf = NULL;
+	return ok;
+}
+
+void
+fetch_distfile_done(struct DistfileQueueEntry *queue_entry)
+{
+	struct Distfile *distfile = queue_entry->distfile;
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	fetch_distfile_close(distfile);
+	distfile->writer = NULL;
+	unless (opts->makesum && opts->makesum_ephemeral) {
+		int distdir_fd = distfile->job->distdir_fd;
+		if (renameat(distdir_fd, distfile->partname, distdir_fd, distfile->name) == -1) {
+			status_msg(opts, STATUS_ERROR, "%s %scould not rename %s: %s%s\n", distfile->name,
+				opts->color_error, distfile->partname, strerror(errno), opts->color_reset);
+			fetch_distfile_extract_discard(distfile);
+			parfetch_job_distfile_done(distfile->job);
+			return;
+		}
+		unlinkat(distdir_fd, distfile->validname, 0);
+		// Linking it into the store changes its ctime so that has
+		// to happen before we remember it
+		fetch_distfile_store_put(distfile);
+		struct stat st;
+		if (fstatat(distdir_fd, distfile->name, &st, 0) != -1) {
+			fetch_distfile_remember(distfile, &st);
+		}
+	}
+	fetch_distfile_unlock(distfile);
+	distfile->fetched = true;
+	if (distfile->extractor) {
+		// We are done once the extractor is
+		extract_finish(distfile->extractor, fetch_distfile_extract_finished_cb, distfile);
+		return;
+	}
+	status_msg(opts, STATUS_DONE, "%s\n", distfile->name);
+	parfetch_job_distfile_done(distfile->job);
+}
+
+void
+fetch_distfile_extract_data_cb(struct Distfile *distfile, curl_off_t offset, const char *data, size_t len, void *userdata)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (distfile->extractor && extract_offset(distfile->extractor) != offset) {
+		// Started over on another mirror
+		fetch_distfile_extract_discard(distfile);
+	}
+	unless (distfile->extractor) {
+		if (offset > 0) {
+			// Resumed from an earlier .part file. The ports
+			// framework extracts it as usual.
+			return;
+		}
+		SCOPE_MEMPOOL(pool);
+		const char *dir = fetch_distfile_extract_path(pool, distfile, true);
+		if (extract_remove(dir) && mkdirp(dir)) {
+			distfile->extractor = extract_new(distfile->base, opts->extract_cmd, dir);
+		}
+		unless (distfile->extractor) {
+			status_msg(opts, STATUS_ERROR, "%s %scould not extract to %s: %s%s\n", distfile->name,
+				opts->color_warning, dir, strerror(errno), opts->color_reset);
+			extract_remove(dir);
+			return;
+		}
+	}
+	unless (extract_write(distfile->extractor, data, len)) {
+		status_msg(opts, STATUS_ERROR, "%s %scould not extract while fetching%s\n", distfile->name,
+			opts->color_warning, opts->color_reset);
+		fetch_distfile_extract_discard(distfile);
+	}
+}
+
+void
+fetch_distfile_extract_discard(struct Distfile *distfile)
+{
+	if (distfile->extractor) {
+		extract_free(distfile->extractor);
+		distfile->extractor = NULL;
+		SCOPE_MEMPOOL(pool);
+		extract_remove(fetch_distfile_extract_path(pool, distfile, true));
+	}
+}
+
+void
+fetch_distfile_extract_finished_cb(struct Extractor *extractor, bool ok, void *userdata)
+{
+	struct Distfile *distfile = userdata;
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	extract_free(extractor);
+	distfile->extractor = NULL;
+
+	// The extracted tree is only committed now that the distfile
+	// is verified
+	SCOPE_MEMPOOL(pool);
+	const char *dir = fetch_distfile_extract_path(pool, distfile, false);
+	const char *partdir = fetch_distfile_extract_path(pool, distfile, true);
+	if (ok && extract_remove(dir) && rename(partdir, dir) == 0) {
+		status_msg(opts, STATUS_DONE, "%s (extracted)\n", distfile->name);
+	} else {
+		status_msg(opts, STATUS_ERROR, "%s %scould not extract while fetching%s\n", distfile->name,
+			opts->color_warning, opts->color_reset);
+		extract_remove(partdir);
+		status_msg(opts, STATUS_DONE, "%s\n", distfile->name);
+	}
+	parfetch_job_distfile_done(distfile->job);
+}
+
+const char *
+fetch_distfile_extract_path(struct Mempool *pool, struct Distfile *distfile, bool part)
+{
+	if (part) {
+		return str_printf(pool, "%s/%s.part", distfile->job->opts.extract_dir, distfile->name);
+	} else {
+		return str_printf(pool, "%s/%s", distfile->job->opts.extract_dir, distfile->name);
+	}
+}
+
+void
+fetch_distfile_remember(struct Distfile *distfile, struct stat *st)
+{
+	// Only what was actually checked against distinfo is worth
+	// remembering
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (!verify_db || (opts->no_checksum && !opts->makesum) || !distfile->distinfo || distfile->distinfo->digest_len == 0) {
+		return;
+	}
+	struct ChecksumAlgorithms *algorithms = opts->checksum_algorithms;
+	verifydb_add(verify_db, st, checksum_algorithms_name(algorithms, 0), distfile->distinfo->digest, distfile->distinfo->digest_len);
+	for (size_t i = 1; i < checksum_algorithms_len(algorithms); i++) {
+		if (distfile->digests[i].len > 0) {
+			verifydb_add(verify_db, st, checksum_algorithms_name(algorithms, i), distfile->digests[i].value, distfile->digests[i].len);
+		}
+	}
+}
+
+bool
+fetch_distfile_remembered(struct Distfile *distfile, struct stat *st)
+{
+	// Every digest we would check has to be known good
+	struct ChecksumAlgorithms *algorithms = distfile->job->opts.checksum_algorithms;
+	unless (verifydb_check(verify_db, st, checksum_algorithms_name(algorithms, 0), distfile->distinfo->digest, distfile->distinfo->digest_len)) {
+		return false;
+	}
+	for (size_t i = 1; i < checksum_algorithms_len(algorithms); i++) {
+		if (distfile->digests[i].len > 0 &&
+		    !verifydb_check(verify_db, st, checksum_algorithms_name(algorithms, i), distfile->digests[i].value, distfile->digests[i].len)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+fetch_distfile_reset(struct DistfileQueueEntry *queue_entry)
+{
+	progress_update(queue_entry->progress, -queue_entry->size, NULL);
+	queue_entry->size = 0;
+	queue_entry->hashed = 0;
+	// Reset digest context
+	checksum_ctx_reset(queue_entry->mdctx);
+}
+
+void
+fetch_distfile_store_get(struct Distfile *distfile)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (!opts->store_dir || opts->makesum || !distfile->distinfo) {
+		// In makesum mode distinfo is what we are about to find out
+		return;
+	}
+
+	SCOPE_MEMPOOL(pool);
+	char *dir = dirname(str_dup(pool, distfile->name));
+	unless (mkdirpat(distfile->job->distdir_fd, dir)) {
+		return;
+	}
+	if (store_get(opts->store_dir, distfile->distinfo, distfile->job->distdir_fd, distfile->name)) {
+		status_msg(opts, STATUS_LINK, "%s\n", distfile->name);
+	}
+}
+
+void
+fetch_distfile_store_put(struct Distfile *distfile)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	if (!opts->store_dir || !distfile->distinfo) {
+		return;
+	} else if (opts->no_checksum && !opts->makesum) {
+		// Never verified so it might not be what the digest says
+		return;
+	}
+
+	unless (store_put(opts->store_dir, distfile->distinfo, distfile->job->distdir_fd, distfile->name)) {
+		int error = errno;
+		SCOPE_MEMPOOL(pool);
+		const char *path = store_path(pool, opts->store_dir, distfile->distinfo);
+		if (path) {
+			status_msg(opts, STATUS_ERROR, "%s %scould not add to %s: %s%s\n", distfile->name,
+				opts->color_warning, path, strerror(error), opts->color_reset);
+		}
+	}
+}
+
+void
+fetch_distfile_next_mirror(struct DistfileQueueEntry *queue_entry, CURLM *cm, enum FetchDistfileNextReason reason, const char *msg)
+{
+	struct Distfile *distfile = queue_entry->distfile;
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	const char *next_mirror_msg = "Trying next mirror...";
+	bool retry_site = false;
+	if (queue_entry->redirected) {
+		// The site might send us elsewhere by now
+		redirectdb_forget(redirect_db, queue_entry->site);
+		queue_entry->redirect_failed = true;
+		retry_site = true;
+		next_mirror_msg = "Trying without the cached redirect...";
+	} else if (queue_len(distfile->queue) == 0) {
+		next_mirror_msg = "No more mirrors left!";
+	}
+
+	bool discard = false;
+	switch (reason) {
+	case FETCH_DISTFILE_NEXT_MIRROR:
+		// The transfer broke off so the next mirror can continue
+		// where this one left off
+		if (opts->makesum && opts->makesum_ephemeral) {
+			// nothing
+		} else if (!queue_entry->write_failed && queue_entry->hashed > distfile->resume_offset) {
+			distfile->resume_offset = queue_entry->hashed;
+			checksum_ctx_copy(distfile->resume_mdctx, queue_entry->mdctx);
+		}
+		break;
+	case FETCH_DISTFILE_NEXT_CHECKSUM_MISMATCH:
+	case FETCH_DISTFILE_NEXT_SIZE_MISMATCH:
+		// We cannot tell which part of it is bad so start over
+		discard = true;
+		if (distfile->fd != -1) {
+			ftruncate(distfile->fd, 0);
+		}
+		fetch_distfile_extract_discard(distfile);
+		distfile->resume_offset = 0;
+		checksum_ctx_reset(distfile->resume_mdctx);
+		break;
+	case FETCH_DISTFILE_NEXT_HTTP_ERROR:
+		// Whatever we got was an error page and not the distfile
+		break;
+	}
+	distfile->fetched = false;
+	distfile->writer = NULL;
+
+	status_msg(opts, STATUS_ERROR, "%s", queue_entry->url);
+
+	switch (reason) {
+	case FETCH_DISTFILE_NEXT_MIRROR:
+		fputc('\n', opts->out);
+		break;
+	case FETCH_DISTFILE_NEXT_CHECKSUM_MISMATCH:
+		fprintf(opts->out, " %s%s%s\n", opts->color_error, "checksum mismatch", opts->color_reset);
+		break;
+	case FETCH_DISTFILE_NEXT_SIZE_MISMATCH:
+		if (queue_entry->distfile->distinfo) {
+			fprintf(opts->out, " %ssize mismatch (expected: %lld, actual: %lld)%s\n",
+				opts->color_error, (long long)queue_entry->distfile->distinfo->size, (long long)queue_entry->size, opts->color_reset);
+		} else {
+			fputc('\n', opts->out);
+		}
+		break;
+	case FETCH_DISTFILE_NEXT_HTTP_ERROR:
+		fputc('\n', opts->out);
+		break;
+	}
+	if (msg) {
+		status_msg(opts, STATUS_EMPTY, "%s%s%s\n", opts->color_error, msg, opts->color_reset);
+	}
+
+	// queue next mirror for file
+	status_msg(opts, STATUS_EMPTY, "%s\n", next_mirror_msg);
+
+	if (discard) {
+		status_msg(opts, STATUS_UNLINK, "%s\n", distfile->partname);
+	}
+	fetch_distfile_reset(queue_entry);
+	if (retry_site) {
+		fetch_distfile_entry(cm, queue_entry);
+	} else {
+		fetch_distfile(distfile);
+	}
+}
+
+void
+fetch_distfile_race(struct Distfile *distfile)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	unless (fetch_distfile_open(distfile)) {
+		parfetch_job_distfile_done(distfile->job);
+		return;
+	}
+	if (opts->race_mirrors <= 1 || queue_len(distfile->queue) < 2) {
+		fetch_distfile(distfile);
+		return;
+	}
+
+	distfile->race_timer = evtimer_new(distfile->base, fetch_distfile_race_cb, distfile);
+	for (long i = 0; i < opts->race_mirrors; i++) {
+		struct DistfileQueueEntry *queue_entry = fetch_distfile_pop(distfile);
+		unless (queue_entry) {
+			break;
+		}
+		queue_entry->racing = true;
+		queue_entry->race_bytes = 0;
+		queue_entry->race_buf = open_memstream(&queue_entry->race_buf_data, &queue_entry->race_buf_len);
+		unless (queue_entry->race_buf) {
+			err(1, "open_memstream");
+		}
+		array_append(distfile->racers, queue_entry);
+		fetch_distfile_entry(distfile->cm, queue_entry);
+	}
+	if (array_len(distfile->racers) == 0) {
+		// All mirrors are on hosts that are down
+		parfetch_job_distfile_done(distfile->job);
+		return;
+	}
+	struct timeval tv = { .tv_sec = opts->race_window / 1000, .tv_usec = (opts->race_window % 1000) * 1000 };
+	evtimer_add(distfile->race_timer, &tv);
+}
+
+void
+fetch_distfile_race_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	struct Distfile *distfile = userdata;
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	struct DistfileQueueEntry *winner = NULL;
+	ARRAY_FOREACH(distfile->racers, struct DistfileQueueEntry *, racer) {
+		if (racer->race_bytes > 0 && (!winner || racer->race_bytes > winner->race_bytes)) {
+			winner = racer;
+		}
+	}
+	if (winner) {
+		fetch_distfile_race_finish(distfile, winner);
+	} else {
+		// Nobody sent us anything yet so keep waiting
+		struct timeval tv = { .tv_sec = opts->race_window / 1000, .tv_usec = (opts->race_window % 1000) * 1000 };
+		evtimer_add(distfile->race_timer, &tv);
+	}
+}
+
+void
+fetch_distfile_race_drop(struct DistfileQueueEntry *queue_entry)
+{
+	fclose(queue_entry->race_buf);
+	free(queue_entry->race_buf_data);
+	queue_entry->race_buf = NULL;
+	queue_entry->race_buf_data = NULL;
+	queue_entry->race_buf_len = 0;
+	queue_entry->race_bytes = 0;
+	queue_entry->racing = false;
+}
+
+void
+fetch_distfile_race_finish(struct Distfile *distfile, struct DistfileQueueEntry *winner)
+{
+	struct ParfetchOptions *opts = &distfile->job->opts;
+	event_free(distfile->race_timer);
+	distfile->race_timer = NULL;
+
+	ARRAY_FOREACH(distfile->racers, struct DistfileQueueEntry *, racer) {
+		if (racer == winner) {
+			continue;
+		}
+		fetch_distfile_cancel_segments(racer);
+		fetch_distfile_race_drop(racer);
+		fetch_distfile_reset(racer);
+		status_msg(opts, STATUS_CANCEL, "%s\n", racer->url);
+		// Keep the slower mirror around in case the winner
+		// fails later
+		queue_push(distfile->queue, racer);
+	}
+	array_truncate(distfile->racers);
+
+	if (winner) {
+		// Only now do the winner's bytes reach the file and
+		// the digest
+		fflush(winner->race_buf);
+		size_t written = winner->race_buf_len;
+		if (distfile->fd != -1) {
+			// A failed write ends the transfer on its next
+			// write callback
+			struct DistfileSegment *segment = array_get(winner->segments, 0);
+			unless (fetch_distfile_segment_write(segment, winner->size, winner->race_buf_data, written)) {
+				written = 0;
+			}
+		}
+		winner->size += written;
+		progress_update(winner->progress, written, distfile->name);
+		fetch_distfile_hash(winner, winner->race_buf_data, written);
+		fetch_distfile_race_drop(winner);
+		distfile->writer = winner;
+	}
+}
+
+bool
+response_code_ok(long code, long protocol, bool partial)
+{
+	switch (protocol) {
+	case CURLPROTO_FTP:
+	case CURLPROTO_FTPS:
+		if (code == 226) {
+			return true;
+		}
+		break;
+	case CURLPROTO_HTTP:
+	case CURLPROTO_HTTPS:
+		if (partial && code == 206) {
+			return true;
+		} else if (!partial && code == 200) {
+			return true;
+		}
+		break;
+	default:
+		errx(1, "unsupported protocol: %ld", protocol);
+	}
+
+	return false;
+}
+
+void
+check_multi_info(CURLM *cm)
+{
+	int pending;
+	CURLMsg *message;
+	while ((message = curl_multi_info_read(cm, &pending))) {
+		switch (message->msg) {
+		case CURLMSG_DONE: {
+			struct DistfileSegment *segment = NULL;
+			// message becomes invalid after parfetch_curl_easy_put() or curl_multi_remove_handle()!
+			CURL *easy_handle = message->easy_handle;
+			CURLcode result = message->data.result;
+			curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &segment);
+			if (segment->cancelled) {
+				hosthealth_record(host_health, segment->queue_entry->host_state, easy_handle, result);
+				hostlimits_remove(host_limits, segment->queue_entry->url, easy_handle, result, 0);
+				curl_multi_remove_handle(cm, easy_handle);
+				parfetch_curl_easy_put(easy_handle);
+				segment->eh = NULL;
+				break;
+			}
+			struct DistfileQueueEntry *queue_entry = segment->queue_entry;
+			struct ParfetchOptions *opts = &queue_entry->distfile->job->opts;
+			bool segmented = array_len(queue_entry->segments) > 1;
+			bool partial = segmented || queue_entry->resume_offset > 0;
+			long response_code = 0;
+			curl_easy_getinfo(easy_handle, CURLINFO_RESPONSE_CODE, &response_code);
+			long protocol = 0;
+			curl_easy_getinfo(easy_handle, CURLINFO_PROTOCOL, &protocol);
+			if (queue_entry->mirrordb && !segment->range_unsupported) {
+				curl_off_t connect_time = 0;
+				curl_off_t starttransfer_time = 0;
+				curl_off_t total_time = 0;
+				curl_off_t size_download = 0;
+				curl_easy_getinfo(easy_handle, CURLINFO_CONNECT_TIME_T, &connect_time);
+				curl_easy_getinfo(easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer_time);
+				curl_easy_getinfo(easy_handle, CURLINFO_TOTAL_TIME_T, &total_time);
+				curl_easy_getinfo(easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &size_download);
+				bool ok = result == CURLE_OK && response_code > 0 && protocol > 0 && response_code_ok(response_code, protocol, partial);
+				mirrordb_record(queue_entry->mirrordb, queue_entry->url, ok, connect_time, starttransfer_time, total_time, size_download);
+			}
+			if (result == CURLE_OK && response_code > 0 && protocol > 0 && response_code_ok(response_code, protocol, partial)) {
+				char *effective_url = NULL;
+				curl_easy_getinfo(easy_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+				if (effective_url) {
+					redirectdb_learn(redirect_db, queue_entry->site, queue_entry->distfile->name, effective_url);
+				}
+			}
+			if (hosthealth_record(host_health, queue_entry->host_state, easy_handle, result)) {
+				SCOPE_MEMPOOL(pool);
+				status_msg(opts, STATUS_ERROR, "%s%s is down, skipping it for %lld seconds%s\n", opts->color_error,
+					mirrordb_host(pool, queue_entry->url), (long long)opts->host_retry_delay, opts->color_reset);
+			}
+			hostlimits_remove(host_limits, queue_entry->url, easy_handle, result, response_code);
+			curl_multi_remove_handle(cm, easy_handle);
+			parfetch_curl_easy_put(easy_handle);
+			segment->eh = NULL;
+			queue_entry->active_segments--;
+			unless (fetch_distfile_segment_close(segment)) {
+				result = CURLE_WRITE_ERROR;
+			}
+
+			if (queue_entry->racing) {
+				struct Distfile *distfile = queue_entry->distfile;
+				if (result == CURLE_OK && response_code > 0 && protocol > 0 && response_code_ok(response_code, protocol, partial)) {
+					// A mirror that finishes inside the probe
+					// window wins the race
+					fetch_distfile_race_finish(distfile, queue_entry);
+					unless (fetch_distfile_segment_close(segment)) {
+						result = CURLE_WRITE_ERROR;
+					}
+				} else {
+					for (size_t i = 0; i < array_len(distfile->racers); i++) {
+						if (array_get(distfile->racers, i) == queue_entry) {
+							array_remove(distfile->racers, i);
+							break;
+						}
+					}
+					fetch_distfile_race_drop(queue_entry);
+					if (array_len(distfile->racers) > 0) {
+						fetch_distfile_reset(queue_entry);
+						// The other mirrors are still racing
+						status_msg(opts, STATUS_ERROR, "%s\n", queue_entry->url);
+						if (result != CURLE_OK) {
+							status_msg(opts, STATUS_EMPTY, "%s%s%s\n", opts->color_error, curl_easy_strerror(result), opts->color_reset);
+						} else {
+							status_msg(opts, STATUS_EMPTY, "%sstatus %ld%s\n", opts->color_error, response_code, opts->color_reset);
+						}
+						break;
+					}
+					fetch_distfile_race_finish(distfile, NULL);
+				}
+			}
+
+			if (result == CURLE_RANGE_ERROR && queue_entry->resume_offset > 0) {
+				fetch_distfile_without_ranges(cm, queue_entry);
+				break;
+			}
+
+			if (segmented) {
+				if (segment->range_unsupported) {
+					// Try again without segments
+					fetch_distfile_cancel_segments(queue_entry);
+					fetch_distfile_without_ranges(cm, queue_entry);
+					break;
+				} else if (result == CURLE_OK && response_code == 206 && segment->written != segment->length) {
+					fetch_distfile_cancel_segments(queue_entry);
+					fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_SIZE_MISMATCH, NULL);
+					break;
+				} else if (result != CURLE_OK || response_code != 206) {
+					fetch_distfile_cancel_segments(queue_entry);
+				} else if (queue_entry->active_segments > 0) {
+					// wait for the remaining segments
+					break;
+				}
+			}
+
+			if (response_code == 0 || protocol == 0) {
+				goto general_curl_error;
+			}
+			if (response_code_ok(response_code, protocol, partial) && result == CURLE_OK) { // no error
+				if (opts->disable_size) {
+					if (opts->makesum && queue_entry->distfile->distinfo->size != queue_entry->size) {
+						unless (opts->makesum_keep_timestamp) {
+							distinfo_set_timestamp(queue_entry->distinfo, time(NULL));
+						}
+						queue_entry->distfile->distinfo->size = queue_entry->size;
+					}
+					if (check_checksum(queue_entry->distinfo, NULL, queue_entry->distfile, queue_entry->mdctx)) {
+						fetch_distfile_done(queue_entry);
+					} else {
+						fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_CHECKSUM_MISMATCH, NULL);
+					}
+				} else if (queue_entry->distfile->distinfo) {
+					if (queue_entry->size == queue_entry->distfile->distinfo->size) {
+						if (check_checksum(queue_entry->distinfo, NULL, queue_entry->distfile, queue_entry->mdctx)) {
+							fetch_distfile_done(queue_entry);
+						} else {
+							fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_CHECKSUM_MISMATCH, NULL);
+						}
+					} else {
+						fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_SIZE_MISMATCH, NULL);
+					}
+				} else {
+					errx(1, "DISABLE_SIZE not set but distinfo not loaded");
+				}
+			} else if (response_code_ok(response_code, protocol, partial) && result == CURLE_OPERATION_TIMEDOUT && queue_entry->min_speed > 0) {
+				// The next mirror continues where this one
+				// stalled
+				SCOPE_MEMPOOL(pool);
+				const char *msg = str_printf(pool, "slower than %ld bytes/s for %ld seconds", queue_entry->min_speed, opts->stall_time);
+				fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_MIRROR, msg);
+			} else if (response_code_ok(response_code, protocol, partial)) { // curl error but ok response
+				fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_MIRROR, curl_easy_strerror(result));
+			} else if (response_code > 0) { // bad response code
+				SCOPE_MEMPOOL(pool);
+				const char *msg = str_printf(pool, "status %ld", response_code);
+				fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_HTTP_ERROR, msg);
+			} else { // general curl error
+general_curl_error:
+				if (segment->host_down) {
+					fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_MIRROR, "host is down");
+				} else {
+					fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_MIRROR, curl_easy_strerror(result));
+				}
+			}
+			break;
+		} default:
+			warnx("unexpected curl message: %d", message->msg);
+			break;
+		}
+	}
+}
+
+CURLM *
+parfetch_curl_multi_new(struct ParfetchOptions *opts, struct event_base *base)
+{
+	if (curl_global_init(CURL_GLOBAL_ALL)) {
+		errx(1, "could not init curl");
+	}
+
+	CURLM *cm = curl_multi_init();
+	curl_multi_setopt(cm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	if (opts->adaptive_host_connections) {
+		// We limit the hosts ourselves
+		curl_multi_setopt(cm, CURLMOPT_MAX_HOST_CONNECTIONS, 0L);
+	} else {
+		curl_multi_setopt(cm, CURLMOPT_MAX_HOST_CONNECTIONS, opts->max_host_connections);
+	}
+	curl_multi_setopt(cm, CURLMOPT_MAX_TOTAL_CONNECTIONS, opts->max_total_connections);
+	host_limits = hostlimits_new(cm, opts->max_total_connections, opts->adaptive_host_connections);
+	host_health = hosthealth_new(opts->host_failure_limit, opts->host_retry_delay);
+	rate_limit = ratelimit_new(base, opts->max_speed, opts->max_host_speed);
+	if (opts->cache_dir) {
+		SCOPE_MEMPOOL(pool);
+		redirect_db = redirectdb_new(str_printf(pool, "%s/redirects", opts->cache_dir));
+		verify_db = verifydb_new(str_printf(pool, "%s/verified", opts->cache_dir));
+	} else {
+		redirect_db = redirectdb_new(NULL);
+		verify_db = verifydb_new(NULL);
+	}
+
+	// Connections and DNS entries are already shared by the
+	// multi handle but TLS sessions are kept per easy handle
+	// unless they share them explicitly
+	curl_share = curl_share_init();
+	unless (curl_share) {
+		errx(1, "could not init curl");
+	}
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x075800
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_HSTS);
+#endif
+
+	// curl replaces these files atomically so concurrent
+	// processes do not step on each other
+	if (opts->cache_dir) {
+		curl_altsvc_file = str_printf(NULL, "%s/altsvc", opts->cache_dir);
+		curl_hsts_file = str_printf(NULL, "%s/hsts", opts->cache_dir);
+	}
+
+	// There are rarely more transfers at a time than connections
+	curl_handles = array_new();
+	curl_handles_max = opts->max_total_connections;
+
+	return cm;
+}
+
+void
+parfetch_curl_multi_free(CURLM *cm)
+{
+	curl_multi_cleanup(cm);
+	ARRAY_FOREACH(curl_handles, CURL *, eh) {
+		curl_easy_cleanup(eh);
+	}
+	array_free(curl_handles);
+	curl_handles = NULL;
+	hostlimits_free(host_limits);
+	host_limits = NULL;
+	hosthealth_free(host_health);
+	host_health = NULL;
+	ratelimit_free(rate_limit);
+	rate_limit = NULL;
+	redirectdb_save(redirect_db);
+	redirectdb_free(redirect_db);
+	redirect_db = NULL;
+	verifydb_save(verify_db);
+	verifydb_free(verify_db);
+	verify_db = NULL;
+	curl_share_cleanup(curl_share);
+	curl_share = NULL;
+	free(curl_altsvc_file);
+	free(curl_hsts_file);
+	curl_altsvc_file = NULL;
+	curl_hsts_file = NULL;
+	curl_global_cleanup();
+}
+
+CURL *
+parfetch_curl_easy_get()
+{
+	CURL *eh = array_pop(curl_handles);
+	unless (eh) {
+		eh = curl_easy_init();
+		unless (eh) {
+			errx(1, "could not init curl");
+		}
+		parfetch_curl_easy_setup(eh);
+	}
+	return eh;
+}
+
+void
+parfetch_curl_easy_put(CURL *eh)
+{
+	ratelimit_remove(rate_limit, eh);
+	if (array_len(curl_handles) < curl_handles_max) {
+		// curl_easy_reset() keeps the connections and caches of
+		// the handle but resets all options so apply the common
+		// ones right away
+		curl_easy_reset(eh);
+		parfetch_curl_easy_setup(eh);
+		array_append(curl_handles, eh);
+	} else {
+		curl_easy_cleanup(eh);
+	}
+}
+
+void
+parfetch_curl_easy_setup(CURL *eh)
+{
+	curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(eh, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(eh, CURLOPT_XFERINFOFUNCTION, fetch_distfile_progress_cb);
+	curl_easy_setopt(eh, CURLOPT_SHARE, curl_share);
+	hostlimits_setup(host_limits, eh);
+	if (curl_altsvc_file) {
+		curl_easy_setopt(eh, CURLOPT_ALTSVC, curl_altsvc_file);
+	}
+	if (curl_hsts_file) {
+		curl_easy_setopt(eh, CURLOPT_HSTS, curl_hsts_file);
+	}
+}
+
+struct Array *
+parfetch_env(struct Mempool *pool)
+{
+	// Everything we might look at in the environment
+	struct Array *env = mempool_array(pool);
+	for (char **var = environ; *var; var++) {
+		if (str_startswith(*var, "dp_") || str_startswith(*var, "_MASTER_SITES_") || str_startswith(*var, "_PATCH_SITES_")) {
+			array_append(env, *var);
+		}
+	}
+	return env;
+}
+
+bool
+run_batch(struct ParfetchOptions *opts, const char *path, struct MirrorDB *mirrordb)
+{
+	SCOPE_MEMPOOL(pool);
+
+	FILE *f = stdin;
+	if (strcmp(path, "-") != 0) {
+		f = mempool_fopenat(pool, AT_FDCWD, path, "r", 0);
+		unless (f) {
+			err(1, "could not open %s", path);
+		}
+	}
+	struct Map *defaults = mempool_map(pool, str_compare);
+	ARRAY_FOREACH(parfetch_env(pool), const char *, var) {
+		const char *eq = strchr(var, '=');
+		map_add(defaults, str_ndup(pool, var, eq - var), eq + 1);
+	}
+	unless (map_contains(defaults, "dp_TARGET")) {
+		map_add(defaults, "dp_TARGET", "do-fetch");
+	}
+	struct Array *errors = NULL;
+	struct Array *ports = manifest_load(pool, f, defaults, &errors);
+	unless (ports) {
+		ARRAY_FOREACH(errors, const char *, error) {
+			warnx("%s: %s", path, error);
+		}
+		exit(1);
+	}
+
+	struct event_base *base = event_base_new();
+	// All ports share the connections and the limits
+	CURLM *cm = parfetch_curl_multi_new(opts, base);
+	struct ParfetchCurl *loop = parfetch_curl_new(cm, base, check_multi_info, NULL, NULL);
+	struct RunBatch this = {
+		.opts = opts,
+		.progress = progress_new(base, opts->out),
+	};
+
+	// Jobs are only freed at the end so that we can trim all
+	// their .part files if we are interrupted
+	fetch_distfile_trim_parts_start(base, mempool_array(pool));
+	struct Array *batch_ports = mempool_array(pool);
+	ARRAY_FOREACH(ports, struct ManifestPort *, port) {
+		struct RunBatchPort *batch_port = mempool_alloc(pool, sizeof(struct RunBatchPort));
+		batch_port->batch = &this;
+		batch_port->port = port;
+		batch_port->distdir_fd = -1;
+		batch_port->distinfo_fd = -1;
+		batch_port->out = open_memstream(&batch_port->out_buf, &batch_port->out_len);
+		unless (batch_port->out) {
+			err(1, "open_memstream");
+		}
+		array_append(batch_ports, batch_port);
+		this.pending++;
+
+		const char *distdir = makevar(port->env, "DISTDIR");
+		if (distdir) {
+			unless (mkdirp(distdir)) {
+				fprintf(batch_port->out, "parfetch: mkdirp: %s: %s\n", distdir, strerror(errno));
+				run_batch_port_finish(batch_port, false);
+				continue;
+			}
+			batch_port->distdir_fd = open(distdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (batch_port->distdir_fd == -1) {
+				fprintf(batch_port->out, "parfetch: open: %s: %s\n", distdir, strerror(errno));
+				run_batch_port_finish(batch_port, false);
+				continue;
+			}
+		}
+		const char *distinfo_file = makevar(port->env, "DISTINFO_FILE");
+		if (distinfo_file) {
+			batch_port->distinfo_fd = open(distinfo_file, O_RDONLY | O_CLOEXEC);
+		}
+
+		batch_port->job = parfetch_job_new(port->env, batch_port->out, this.progress, batch_port->distdir_fd, batch_port->distinfo_fd, port->args, mirrordb, cm, base);
+		if (batch_port->job->error) {
+			fprintf(batch_port->out, "parfetch: %s\n", batch_port->job->error);
+			run_batch_port_finish(batch_port, false);
+			continue;
+		}
+		ARRAY_JOIN(partial_distfiles, batch_port->job->distfiles);
+		parfetch_job_start(batch_port->job, run_batch_job_finished_cb, batch_port);
+	}
+	if (this.pending > 0) {
+		event_base_dispatch(base);
+	}
+	fetch_distfile_trim_parts_end();
+
+	// cleanup
+	ARRAY_FOREACH(batch_ports, struct RunBatchPort *, batch_port) {
+		parfetch_job_free(batch_port->job);
+		if (batch_port->distdir_fd != -1) {
+			close(batch_port->distdir_fd);
+		}
+		if (batch_port->distinfo_fd != -1) {
+			close(batch_port->distinfo_fd);
+		}
+	}
+	progress_free(this.progress);
+	parfetch_curl_free(loop);
+	parfetch_curl_multi_free(cm);
+	event_base_free(base);
+	libevent_global_shutdown();
+
+	if (this.failed == 0) {
+		status_msg(opts, STATUS_DONE, "all %zu ports fetched\n", array_len(batch_ports));
+		return true;
+	} else {
+		status_msg(opts, STATUS_FAILED, "%zu of %zu ports failed\n", this.failed, array_len(batch_ports));
+		return false;
+	}
+}
+
+// Hash the files with every checksum backend that the CPU supports
+// in the same batches as the initial check and print how fast each
+// one is. The files should be in the page cache so that the disk
+// does not decide the result. Each backend gets a few rounds and
+// the fastest one counts.
+void
+run_benchmark(struct ParfetchOptions *opts, int argc, char *argv[])
+{
+	SCOPE_MEMPOOL(pool);
+
+	size_t n_algorithms = checksum_algorithms_len(opts->checksum_algorithms);
+	struct Array *files = mempool_array(pool);
+	off_t total_size = 0;
+	for (int i = 0; i < argc; i++) {
+		struct stat st;
+		if (stat(argv[i], &st) == -1) {
+			err(1, "stat: %s", argv[i]);
+		}
+		struct RunBenchmarkFile *file = mempool_alloc(pool, sizeof(struct RunBenchmarkFile));
+		file->path = argv[i];
+		file->size = st.st_size;
+		file->index = i;
+		file->digests = mempool_alloc(pool, n_algorithms * sizeof(struct ChecksumDigest));
+		array_append(files, file);
+		total_size += st.st_size;
+	}
+	array_sort(files, &(struct CompareTrait){run_benchmark_file_compare, NULL});
+
+	printf("%zu files, %.1f MiB, %s\n", array_len(files), total_size / (1024.0 * 1024.0),
+		sha256mb_sha_ni() ? "SHA extensions" : "no SHA extensions");
+	struct Checksum *selected = checksum_new(opts->checksum_backend);
+	const char *selected_backend = checksum_backend(selected);
+	checksum_free(selected);
+	const char *name;
+	for (size_t i = 0; (name = checksum_backend_name(i)); i++) {
+		struct Checksum *checksum = checksum_new(name);
+		unless (checksum) {
+			printf("%-8s unsupported\n", name);
+			continue;
+		}
+		double best = 0;
+		for (size_t round = 0; round < 5; round++) {
+			double elapsed = run_benchmark_backend(opts, checksum, files, i == 0 && round == 0);
+			if (round == 0 || elapsed < best) {
+				best = elapsed;
 			}
-			long response_code = 0;
-			if (CURLE_OK != curl_easy_getinfo(easy_handle, CURLINFO_RESPONSE_CODE, &response_code) || response_code == 0) {
-				goto general_curl_error;
+		}
+		printf("%-8s %8.1f MiB/s %10.0f files/s%s\n", name,
+			total_size / (1024.0 * 1024.0) / best, array_len(files) / best,
+			strcmp(name, selected_backend) == 0 ? " (selected)" : "");
+		checksum_free(checksum);
+	}
+}
+
+// One pass over files. The digests of the first one are kept and
+// the others are compared with them. Returns the elapsed time in
+// seconds.
+double
+run_benchmark_backend(struct ParfetchOptions *opts, struct Checksum *checksum, struct Array *files, bool first)
+{
+	SCOPE_MEMPOOL(pool);
+
+	size_t n_algorithms = checksum_algorithms_len(opts->checksum_algorithms);
+	struct ChecksumDigest *digests = mempool_alloc(pool, n_algorithms * sizeof(struct ChecksumDigest));
+	struct ChecksumCtx *ctxs[CHECKSUM_MAX_LANES];
+	for (size_t i = 0; i < checksum_lanes(checksum); i++) {
+		ctxs[i] = mempool_add(pool, checksum_ctx_new(opts->checksum_algorithms), checksum_ctx_free);
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t next_file = 0; next_file < array_len(files);) {
+		// Batches as in initial_distfile_check_worker()
+		struct RunBenchmarkFile *batch[CHECKSUM_MAX_LANES];
+		int fds[CHECKSUM_MAX_LANES];
+		int errors[CHECKSUM_MAX_LANES];
+		size_t n = 0;
+		while (n < checksum_lanes(checksum) && next_file < array_len(files)) {
+			struct RunBenchmarkFile *file = array_get(files, next_file);
+			if (n > 0 && (batch[0]->size > CHECKSUM_BUFFER_SIZE || file->size > CHECKSUM_BUFFER_SIZE)) {
+				break;
 			}
-			long protocol = 0;
-			if (CURLE_OK != curl_easy_getinfo(easy_handle, CURLINFO_PROTOCOL, &protocol) || protocol == 0) {
-				goto general_curl_error;
+			fds[n] = open(file->path, O_RDONLY | O_CLOEXEC);
+			if (fds[n] == -1) {
+				err(1, "open: %s", file->path);
 			}
-			if (response_code_ok(response_code, protocol) && message->data.result == CURLE_OK) { // no error
-				if (opts.disable_size) {
-					if (opts.makesum && queue_entry->distfile->distinfo->size != queue_entry->size) {
-						unless (opts.makesum_keep_timestamp) {
-							distinfo_set_timestamp(queue_entry->distinfo, time(NULL));
-						}
-						queue_entry->distfile->distinfo->size = queue_entry->size;
-					}
-					if (check_checksum(queue_entry->distinfo, NULL, queue_entry->distfile, queue_entry->mdctx)) {
-						queue_entry->distfile->fetched = true;
-						status_msg(STATUS_DONE, "%s\n", queue_entry->distfile->name);
-					} else {
-						fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_CHECKSUM_MISMATCH, NULL);
-					}
-				} else if (queue_entry->distfile->distinfo) {
-					if (queue_entry->size == queue_entry->distfile->distinfo->size) {
-						if (check_checksum(queue_entry->distinfo, NULL, queue_entry->distfile, queue_entry->mdctx)) {
-							queue_entry->distfile->fetched = true;
-							status_msg(STATUS_DONE, "%s\n", queue_entry->distfile->name);
-						} else {
-							fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_CHECKSUM_MISMATCH, NULL);
-						}
-					} else {
-						fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_SIZE_MISMATCH, NULL);
-					}
-				} else {
-					errx(1, "DISABLE_SIZE not set but distinfo not loaded");
+			panic_unless(checksum_ctx_reset(ctxs[n]), "EVP_DigestInit_ex");
+			batch[n++] = file;
+			next_file++;
+		}
+		unless (checksum_files(checksum, n, fds, ctxs, errors)) {
+			for (size_t i = 0; i < n; i++) {
+				if (errors[i] != 0) {
+					errno = errors[i];
+					err(1, "checksum: %s", batch[i]->path);
 				}
-			} else if (response_code_ok(response_code, protocol)) { // curl error but ok response
-				fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_MIRROR, curl_easy_strerror(message->data.result));
-			} else if (response_code > 0) { // bad response code
-				SCOPE_MEMPOOL(pool);
-				const char *msg = str_printf(pool, "status %ld", response_code);
-				fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_HTTP_ERROR, msg);
-			} else { // general curl error
-general_curl_error:
-				fetch_distfile_next_mirror(queue_entry, cm, FETCH_DISTFILE_NEXT_MIRROR, curl_easy_strerror(message->data.result));
 			}
-			curl_multi_remove_handle(cm, easy_handle);
-			curl_easy_cleanup(easy_handle);
-			break;
-		} default:
-			status_msg(STATUS_ERROR, "%d\n", message->msg);
+		}
+		for (size_t i = 0; i < n; i++) {
+			close(fds[i]);
+			panic_unless(checksum_ctx_final(ctxs[i], first ? batch[i]->digests : digests), "EVP_DigestFinal_ex");
+			if (first) {
+				continue;
+			}
+			for (size_t j = 0; j < n_algorithms; j++) {
+				if (digests[j].len != batch[i]->digests[j].len ||
+				    memcmp(digests[j].value, batch[i]->digests[j].value, digests[j].len) != 0) {
+					errx(1, "%s: %s digest mismatch with %s", batch[i]->path,
+						checksum_algorithms_name(opts->checksum_algorithms, j), checksum_backend(checksum));
+				}
+			}
+		}
+	}
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void
+run_batch_job_finished_cb(struct ParfetchJob *job, void *userdata)
+{
+	struct RunBatchPort *batch_port = userdata;
+	bool all_fetched = parfetch_job_finish(job);
+	unless (all_fetched) {
+		fprintf(batch_port->out, "parfetch: could not fetch all distfiles\n");
+	}
+	run_batch_port_finish(batch_port, all_fetched);
+}
+
+void
+run_batch_port_finish(struct RunBatchPort *batch_port, bool ok)
+{
+	struct RunBatch *this = batch_port->batch;
+	struct ParfetchOptions *opts = this->opts;
+
+	// Print the output of the port in one piece so that it does
+	// not get mixed up with the others
+	fclose(batch_port->out);
+	fwrite(batch_port->out_buf, 1, batch_port->out_len, opts->out);
+	free(batch_port->out_buf);
+	batch_port->out = NULL;
+	batch_port->out_buf = NULL;
+	if (ok) {
+		status_msg(opts, STATUS_DONE, "%s\n", batch_port->port->name);
+	} else {
+		status_msg(opts, STATUS_FAILED, "%s\n", batch_port->port->name);
+		this->failed++;
+	}
+
+	panic_unless(this->pending > 0, "more ports done than started");
+	this->pending--;
+	if (this->pending == 0) {
+		progress_stop(this->progress);
+		fetch_distfile_trim_parts_stop();
+	}
+}
+
+void
+print_manifest_port(const char *name, struct Array *args)
+{
+	SCOPE_MEMPOOL(pool);
+	// dp_TARGET is the target that asked for the manifest and not
+	// the one to run later
+	struct Array *env = mempool_array(pool);
+	ARRAY_FOREACH(parfetch_env(pool), const char *, var) {
+		unless (str_startswith(var, "dp_TARGET=")) {
+			array_append(env, var);
+		}
+	}
+	array_sort(env, &(struct CompareTrait){str_compare, NULL});
+	manifest_write_port(stdout, name, env, args);
+}
+
+void
+run_daemon(struct ParfetchOptions *opts, const char *socket, struct MirrorDB *mirrordb)
+{
+	SCOPE_MEMPOOL(pool);
+
+	struct event_base *base = event_base_new();
+	// All jobs share the connections and the limits of the daemon
+	CURLM *cm = parfetch_curl_multi_new(opts, base);
+	struct ParfetchCurl *loop = parfetch_curl_new(cm, base, check_multi_info, NULL, NULL);
+	struct RunDaemon this = {
+		.mirrordb = mirrordb,
+		.cm = cm,
+		.base = base,
+		.jobs = mempool_array(pool),
+		.settings = mempool_map(pool, str_compare),
+	};
+	ARRAY_FOREACH(parfetch_env(pool), const char *, var) {
+		const char *eq = strchr(var, '=');
+		const char *key = str_ndup(pool, var, eq - var);
+		if (run_daemon_setting(key)) {
+			map_add(this.settings, key, eq + 1);
+		}
+	}
+	struct ParfetchDaemon *daemon = parfetch_daemon_new(base, socket, run_daemon_request_cb, &this);
+	struct event *sigint = evsignal_new(base, SIGINT, run_daemon_signal_cb, base);
+	struct event *sigterm = evsignal_new(base, SIGTERM, run_daemon_signal_cb, base);
+	evsignal_add(sigint, NULL);
+	evsignal_add(sigterm, NULL);
+
+	event_base_dispatch(base);
+
+	// Tell the clients that are still waiting that we are gone
+	while (array_len(this.jobs) > 0) {
+		struct RunDaemonJob *daemon_job = array_get(this.jobs, 0);
+		parfetch_job_finish(daemon_job->job);
+		fprintf(daemon_job->request->out, "parfetch: daemon is shutting down\n");
+		run_daemon_job_finish(daemon_job, false);
+	}
+
+	// cleanup
+	parfetch_daemon_free(daemon);
+	event_free(sigint);
+	event_free(sigterm);
+	parfetch_curl_free(loop);
+	parfetch_curl_multi_free(cm);
+	event_base_free(base);
+	libevent_global_shutdown();
+
+	if (mirrordb) {
+		mirrordb_save(mirrordb);
+	}
+}
+
+void
+run_daemon_signal_cb(evutil_socket_t fd, short what, void *userdata)
+{
+	struct event_base *base = userdata;
+	event_base_loopbreak(base);
+}
+
+void
+run_daemon_request_cb(struct ParfetchDaemonRequest *request, void *userdata)
+{
+	struct RunDaemon *this = userdata;
+
+	// Clients only describe their port. Where we cache things,
+	// what we run and how fast we go is up to us.
+	SCOPE_MEMPOOL(pool);
+	struct Array *client_settings = mempool_array(pool);
+	for (size_t i = 0; i < map_len(request->env); i++) {
+		const char *key = map_key_at(request->env, i);
+		if (run_daemon_setting(key)) {
+			array_append(client_settings, key);
+		}
+	}
+	ARRAY_FOREACH(client_settings, const char *, key) {
+		map_remove(request->env, key);
+	}
+	MAP_FOREACH(this->settings, const char *, key, const char *, value) {
+		map_add(request->env, key, value);
+	}
+
+	struct RunDaemonJob *daemon_job = xmalloc(sizeof(struct RunDaemonJob));
+	daemon_job->daemon = this;
+	daemon_job->request = request;
+	daemon_job->job = parfetch_job_new(request->env, request->out, NULL, request->distdir_fd, request->distinfo_fd, request->args, this->mirrordb, this->cm, this->base);
+	array_append(this->jobs, daemon_job);
+	if (daemon_job->job->error) {
+		fprintf(request->out, "parfetch: %s\n", daemon_job->job->error);
+		run_daemon_job_finish(daemon_job, false);
+		return;
+	}
+	parfetch_job_start(daemon_job->job, run_daemon_job_finished_cb, daemon_job);
+}
+
+// Whether a variable is a setting of the daemon rather than of the
+// port a client fetches for
+bool
+run_daemon_setting(const char *var)
+{
+	static const char *port_settings[] = {
+		"dp_PARFETCH_EXTRACT_DIR",
+		"dp_PARFETCH_STRICT_CHECKSUM",
+	};
+	unless (str_startswith(var, "dp_PARFETCH_")) {
+		return false;
+	}
+	for (size_t i = 0; i < sizeof(port_settings) / sizeof(port_settings[0]); i++) {
+		if (strcmp(var, port_settings[i]) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+run_daemon_job_finished_cb(struct ParfetchJob *job, void *userdata)
+{
+	struct RunDaemonJob *daemon_job = userdata;
+	bool all_fetched = parfetch_job_finish(job);
+	unless (all_fetched) {
+		fprintf(daemon_job->request->out, "parfetch: could not fetch all distfiles\n");
+	}
+	struct MirrorDB *mirrordb = daemon_job->daemon->mirrordb;
+	run_daemon_job_finish(daemon_job, all_fetched);
+	if (mirrordb) {
+		mirrordb_save(mirrordb);
+	}
+	redirectdb_save(redirect_db);
+	verifydb_save(verify_db);
+}
+
+void
+run_daemon_job_finish(struct RunDaemonJob *daemon_job, bool ok)
+{
+	struct Array *jobs = daemon_job->daemon->jobs;
+	for (size_t i = 0; i < array_len(jobs); i++) {
+		if (array_get(jobs, i) == daemon_job) {
+			array_remove(jobs, i);
 			break;
 		}
 	}
+	parfetch_job_free(daemon_job->job);
+	parfetch_daemon_request_finish(daemon_job->request, ok);
+	free(daemon_job);
 }
 
-int
-main(int argc, char *argv[])
+bool
+submit_to_daemon(struct ParfetchOptions *opts, struct Array *args, int *status)
+{
+	SCOPE_MEMPOOL(pool);
+
+	unless (opts->distdir) {
+		// Let the local run complain about it
+		return false;
+	}
+	unless (mkdirp(opts->distdir)) {
+		err(1, "mkdirp: %s", opts->distdir);
+	}
+	int distdir_fd = open(opts->distdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (distdir_fd == -1) {
+		err(1, "open: %s", opts->distdir);
+	}
+	int distinfo_fd = -1;
+	if (opts->distinfo_file) {
+		distinfo_fd = open(opts->distinfo_file, O_RDONLY | O_CLOEXEC);
+	}
+
+	// The daemon does not share our environment
+	struct Array *env = parfetch_env(pool);
+	*status = parfetch_daemon_submit(opts->daemon_socket, env, args, distdir_fd, distinfo_fd);
+	close(distdir_fd);
+	if (distinfo_fd != -1) {
+		close(distinfo_fd);
+	}
+	return *status != -1;
+}
+
+void
+run_serve(struct ParfetchOptions *opts, const char *address, struct MirrorDB *mirrordb)
 {
 	SCOPE_MEMPOOL(pool);
 
-	parfetch_init_options();
+	unless (opts->distdir) {
+		errx(1, "dp_DISTDIR not set in the environment");
+	}
+	unless (mkdirp(opts->distdir)) {
+		err(1, "mkdirp: %s", opts->distdir);
+	}
+	int distdir_fd = open(opts->distdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (distdir_fd == -1) {
+		err(1, "open: %s", opts->distdir);
+	}
+
+	// Missing distfiles are fetched from upstream by jobs like
+	// any other but without distinfo to check them against. That
+	// is left to the clients. So what upstream sends us is never
+	// put into DISTDIR but into a directory of our own where it
+	// only stays until the clients that asked for it have it.
+	struct Map *env = NULL;
+	char *upstream_dir = NULL;
+	int upstream_fd = -1;
+	const char *upstream = makevar(NULL, "PARFETCH_SERVE_UPSTREAM");
+	if (upstream) {
+		const char *tmpdir = getenv("TMPDIR");
+		upstream_dir = str_printf(pool, "%s/parfetch-serve.XXXXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+		unless (mkdtemp(upstream_dir)) {
+			err(1, "mkdtemp: %s", upstream_dir);
+		}
+		upstream_fd = open(upstream_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (upstream_fd == -1) {
+			err(1, "open: %s", upstream_dir);
+		}
+		env = mempool_map(pool, str_compare);
+		ARRAY_FOREACH(parfetch_env(pool), const char *, var) {
+			const char *eq = strchr(var, '=');
+			map_add(env, str_ndup(pool, var, eq - var), eq + 1);
+		}
+		const char *overrides[][2] = {
+			{ "dp_TARGET", "do-fetch" },
+			{ "dp_DISTDIR", upstream_dir },
+			{ "dp_DISTINFO_FILE", "/dev/null" },
+			{ "dp_DISABLE_SIZE", "yes" },
+			{ "dp_NO_CHECKSUM", "yes" },
+			{ "_MASTER_SITES_DEFAULT", upstream },
+			// Never fetch from ourselves
+			{ "dp_MASTER_SITE_OVERRIDE", NULL },
+			{ "dp_DIST_SUBDIR", NULL },
+			{ "dp__PARFETCH_MAKESUM", NULL },
+		};
+		for (size_t i = 0; i < sizeof(overrides) / sizeof(overrides[0]); i++) {
+			map_remove(env, overrides[i][0]);
+			if (overrides[i][1]) {
+				map_add(env, overrides[i][0], overrides[i][1]);
+			}
+		}
+	}
+
+	struct event_base *base = event_base_new();
+	CURLM *cm = parfetch_curl_multi_new(opts, base);
+	struct ParfetchCurl *loop = parfetch_curl_new(cm, base, check_multi_info, NULL, NULL);
+	struct RunServe this = {
+		.env = env,
+		.mirrordb = mirrordb,
+		.cm = cm,
+		.base = base,
+		.distdir_fd = distdir_fd,
+		.upstream_fd = upstream_fd,
+		.jobs = mempool_map(pool, str_compare),
+	};
+	struct ParfetchServe *serve = parfetch_serve_new(base, address, distdir_fd, env ? run_serve_request_cb : NULL, &this);
+	struct event *sigint = evsignal_new(base, SIGINT, run_daemon_signal_cb, base);
+	struct event *sigterm = evsignal_new(base, SIGTERM, run_daemon_signal_cb, base);
+	evsignal_add(sigint, NULL);
+	evsignal_add(sigterm, NULL);
+
+	event_base_dispatch(base);
+
+	// Tell the clients that are still waiting that we are gone
+	while (map_len(this.jobs) > 0) {
+		struct RunServeJob *serve_job = map_value_at(this.jobs, 0);
+		parfetch_job_finish(serve_job->job);
+		run_serve_job_finish(serve_job, false);
+	}
 
-	unless (opts.makesum && opts.makesum_ephemeral) {
-		unless (mkdirp(opts.distdir)) {
-			err(1, "mkdirp: %s", opts.distdir);
+	// cleanup
+	parfetch_serve_free(serve);
+	event_free(sigint);
+	event_free(sigterm);
+	parfetch_curl_free(loop);
+	parfetch_curl_multi_free(cm);
+	event_base_free(base);
+	libevent_global_shutdown();
+	close(distdir_fd);
+	if (upstream_dir) {
+		close(upstream_fd);
+		unless (extract_remove(upstream_dir)) {
+			warn("could not remove %s", upstream_dir);
 		}
-		if (chdir(opts.distdir) == -1) {
-			err(1, "chdir: %s", opts.distdir);
+	}
+
+	if (mirrordb) {
+		mirrordb_save(mirrordb);
+	}
+}
+
+void
+run_serve_request_cb(struct ParfetchServeRequest *request, void *userdata)
+{
+	struct RunServe *this = userdata;
+
+	// Clients that want the same distfile share the transfer
+	struct RunServeJob *serve_job = map_get(this->jobs, request->path);
+	if (serve_job) {
+		array_append(serve_job->requests, request);
+		return;
+	}
+
+	SCOPE_MEMPOOL(pool);
+	struct Array *args = mempool_array(pool);
+	array_append(args, "-d");
+	// Otherwise a : in the path would be taken for the groups
+	array_append(args, str_printf(pool, "%s:DEFAULT", request->path));
+
+	serve_job = xmalloc(sizeof(struct RunServeJob));
+	serve_job->serve = this;
+	serve_job->job = parfetch_job_new(this->env, stdout, NULL, this->upstream_fd, -1, args, this->mirrordb, this->cm, this->base);
+	serve_job->path = str_dup(serve_job->job->pool, request->path);
+	serve_job->requests = mempool_array(serve_job->job->pool);
+	array_append(serve_job->requests, request);
+	map_add(this->jobs, serve_job->path, serve_job);
+	if (serve_job->job->error) {
+		warnx("%s", serve_job->job->error);
+		run_serve_job_finish(serve_job, false);
+		return;
+	}
+
+	struct Distfile *distfile = array_get(serve_job->job->distfiles, 0);
+	distfile->data_cb = run_serve_job_data_cb;
+	distfile->data_cb_data = serve_job;
+	parfetch_job_start(serve_job->job, run_serve_job_finished_cb, serve_job);
+}
+
+void
+run_serve_job_data_cb(struct Distfile *distfile, curl_off_t offset, const char *data, size_t len, void *userdata)
+{
+	struct RunServeJob *serve_job = userdata;
+	ARRAY_FOREACH(serve_job->requests, struct ParfetchServeRequest *, request) {
+		off_t next = parfetch_serve_request_offset(request);
+		if (next != -1 && next < offset) {
+			// The client joined late or we resumed an earlier
+			// .part file. It gets the data up to here from disk.
+			fetch_distfile_sync(distfile);
 		}
+		parfetch_serve_request_write(request, distfile->fd, offset, data, len);
+	}
+}
+
+void
+run_serve_job_finished_cb(struct ParfetchJob *job, void *userdata)
+{
+	struct RunServeJob *serve_job = userdata;
+	bool all_fetched = parfetch_job_finish(job);
+	struct MirrorDB *mirrordb = serve_job->serve->mirrordb;
+	run_serve_job_finish(serve_job, all_fetched);
+	if (mirrordb) {
+		mirrordb_save(mirrordb);
+	}
+	redirectdb_save(redirect_db);
+	verifydb_save(verify_db);
+}
+
+void
+run_serve_job_finish(struct RunServeJob *serve_job, bool ok)
+{
+	int upstream_fd = serve_job->serve->upstream_fd;
+	map_remove(serve_job->serve->jobs, serve_job->path);
+	ARRAY_FOREACH(serve_job->requests, struct ParfetchServeRequest *, request) {
+		parfetch_serve_request_finish(request, upstream_fd, ok);
+	}
+	// The clients are sent the file from their own descriptors
+	// of it. It is not verified so it is not kept for the next
+	// client.
+	unlinkat(upstream_fd, serve_job->path, 0);
+	parfetch_job_free(serve_job->job);
+	free(serve_job);
+}
+
+void
+run_job_finished_cb(struct ParfetchJob *job, void *userdata)
+{
+	fetch_distfile_trim_parts_stop();
+}
+
+int
+main(int argc, char *argv[])
+{
+	SCOPE_MEMPOOL(pool);
+
+	struct ParfetchOptions *opts = mempool_alloc(pool, sizeof(struct ParfetchOptions));
+	const char *error = NULL;
+	unless (parfetch_init_options(pool, opts, NULL, stdout, &error)) {
+		errx(1, "%s", error);
 	}
 
-	struct Distinfo *distinfo = load_distinfo(pool);
-	struct Array *distfiles = mempool_array(pool);
+	bool benchmark = false;
+	const char *listen_socket = NULL;
+	const char *manifest = NULL;
+	const char *manifest_port = NULL;
+	const char *serve_address = NULL;
+	struct Array *args = mempool_array(pool);
 	int ch;
-	while ((ch = getopt(argc, argv, "d:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "Bd:l:m:M:p:s:")) != -1) {
 		switch (ch) {
+		case 'B':
+			benchmark = true;
+			break;
 		case 'd':
-			array_append(distfiles, parse_distfile_arg(pool, distinfo, MASTER_SITES, optarg));
+			array_append(args, "-d");
+			array_append(args, optarg);
+			break;
+		case 'l':
+			listen_socket = optarg;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'M':
+			manifest_port = optarg;
 			break;
 		case 'p':
-			array_append(distfiles, parse_distfile_arg(pool, distinfo, PATCH_SITES, optarg));
+			array_append(args, "-p");
+			array_append(args, optarg);
+			break;
+		case 's':
+			serve_address = optarg;
 			break;
 		case '?':
 		default:
@@ -989,68 +4330,93 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (curl_global_init(CURL_GLOBAL_ALL)) {
-		errx(1, "could not init curl");
+	// Writes to daemon clients, serve clients, or extractors that
+	// went away should fail with EPIPE and not kill us. extract.c
+	// restores the default for its children.
+	signal(SIGPIPE, SIG_IGN);
+
+	if (benchmark) {
+		run_benchmark(opts, argc, argv);
+		return 0;
+	} else if (manifest_port) {
+		print_manifest_port(manifest_port, args);
+		return 0;
 	}
 
-	CURLM *cm = curl_multi_init();
-	curl_multi_setopt(cm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
-	curl_multi_setopt(cm, CURLMOPT_MAX_HOST_CONNECTIONS, opts.max_host_connections);
-	curl_multi_setopt(cm, CURLMOPT_MAX_TOTAL_CONNECTIONS, opts.max_total_connections);
+	// makesum needs to write the distinfo file so we always do
+	// it ourselves
+	if (!listen_socket && !manifest && !serve_address && opts->daemon_socket && !opts->makesum) {
+		int status;
+		if (submit_to_daemon(opts, args, &status)) {
+			return status;
+		}
+	}
 
-	struct event_base *base = event_base_new();
-	struct Progress *progress = progress_new(base, opts.out);
-	struct ParfetchCurl *loop = parfetch_curl_new(cm, base, check_multi_info, progress_stop, progress);
-	unless (opts.makesum) {
-		ARRAY_FOREACH(distinfo_entries(distinfo, pool), struct DistinfoEntry *, entry) {
-			progress_update_total(progress, entry->size);
+	struct MirrorDB *mirrordb = NULL;
+	if (opts->cache_dir) {
+		unless (mkdirp(opts->cache_dir)) {
+			err(1, "mkdirp: %s", opts->cache_dir);
 		}
+		// We chdir to DISTDIR below
+		char *cache_dir = realpath(opts->cache_dir, NULL);
+		unless (cache_dir) {
+			err(1, "realpath: %s", opts->cache_dir);
+		}
+		opts->cache_dir = mempool_take(pool, cache_dir);
+		mirrordb = mempool_add(pool, mirrordb_new(str_printf(pool, "%s/mirrors", opts->cache_dir)), mirrordb_free);
 	}
 
-	prepare_distfile_queues(pool, distinfo, progress, distfiles);
-	initial_distfile_check(distinfo, distfiles);
+	if (listen_socket) {
+		run_daemon(opts, listen_socket, mirrordb);
+		return 0;
+	} else if (serve_address) {
+		run_serve(opts, serve_address, mirrordb);
+		return 0;
+	} else if (manifest) {
+		bool ok = run_batch(opts, manifest, mirrordb);
+		if (mirrordb) {
+			mirrordb_save(mirrordb);
+		}
+		return ok ? 0 : 1;
+	}
 
-	// do the work if needed
-	bool fetch = false;
-	ARRAY_FOREACH(distfiles, struct Distfile *, distfile) {
-		unless (distfile->fetched) {
-			fetch = true;
-			fetch_distfile(cm, distfile->queue);
+	if (opts->distdir && !(opts->makesum && opts->makesum_ephemeral)) {
+		unless (mkdirp(opts->distdir)) {
+			err(1, "mkdirp: %s", opts->distdir);
+		}
+		if (chdir(opts->distdir) == -1) {
+			err(1, "chdir: %s", opts->distdir);
 		}
 	}
-	if (fetch) {
-		event_base_dispatch(base);
+
+	struct event_base *base = event_base_new();
+	CURLM *cm = parfetch_curl_multi_new(opts, base);
+	struct ParfetchJob *job = parfetch_job_new(NULL, stdout, NULL, AT_FDCWD, -1, args, mirrordb, cm, base);
+	if (job->error) {
+		errx(1, "%s", job->error);
 	}
+	struct ParfetchCurl *loop = parfetch_curl_new(cm, base, check_multi_info, progress_stop, job->progress);
+
+	// do the work if needed
+	fetch_distfile_trim_parts_start(base, job->distfiles);
+	parfetch_job_start(job, run_job_finished_cb, NULL);
+	event_base_dispatch(base);
+
+	bool all_fetched = parfetch_job_finish(job);
+	fetch_distfile_trim_parts_end();
 
 	// cleanup
+	parfetch_job_free(job);
 	parfetch_curl_free(loop);
-	progress_free(progress);
+	parfetch_curl_multi_free(cm);
 	event_base_free(base);
-	curl_multi_cleanup(cm);
-	curl_global_cleanup();
 	libevent_global_shutdown();
 
-	// Close/flush all open files and check that we fetched all of them
-	bool all_fetched = true;
-	ARRAY_FOREACH(distfiles, struct Distfile *, distfile) {
-		if (distfile->fh) {
-			fclose(distfile->fh);
-		}
-		all_fetched = all_fetched && distfile->fetched;
+	if (mirrordb) {
+		mirrordb_save(mirrordb);
 	}
+
 	if (all_fetched) {
-		if (opts.makesum) {
-			SCOPE_MEMPOOL(pool);
-			FILE *f = mempool_fopenat(pool, AT_FDCWD, opts.distinfo_file, "w", 0644);
-			unless (f) {
-				err(1, "could not open %s", opts.distinfo_file);
-			}
-			fprintf(f, "TIMESTAMP = %ju\n", (uintmax_t)distinfo_timestamp(distinfo));
-			ARRAY_FOREACH(distfiles, struct Distfile *, distfile) {
-				distinfo_entry_serialize(distfile->distinfo, f);
-			}
-			status_msg(STATUS_WROTE, "%s\n", opts.distinfo_file);
-		}
 		return 0;
 	} else {
 		errx(1, "could not fetch all distfiles");
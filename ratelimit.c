@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <curl/curl.h>
+#include <event2/event.h>
+
+#include <libias/array.h>
+#include <libias/flow.h>
+#include <libias/map.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "mirrordb.h"
+#include "ratelimit.h"
+
+// Token buckets for the total and the per host bandwidth. A
+// transfer takes tokens for everything it receives and is paused
+// from its write callback once a bucket runs dry. A timer resumes
+// the paused transfers when the buckets have refilled. curl then
+// stops reading from their sockets in the meantime so the limit
+// is enforced by TCP flow control and not just by us buffering.
+//
+// Low priority transfers also pause while high priority ones are
+// waiting for tokens so that they only get what is left over.
+
+struct RateBucket {
+	// bytes per second or 0 for no limit
+	curl_off_t rate;
+	double tokens;
+	struct timespec refilled;
+};
+
+struct RateLimitHost {
+	const char *host;
+	struct RateBucket bucket;
+};
+
+struct RateLimitTransfer {
+	CURL *eh;
+	struct RateLimitHost *host;
+	bool high_priority;
+	bool paused;
+};
+
+struct RateLimit {
+	struct Mempool *pool;
+	struct event *timer;
+	struct RateBucket bucket;
+	curl_off_t host_rate;
+	struct Map *hosts;
+	struct Array *transfers;
+	size_t high_priority_paused;
+};
+
+// Prototypes
+static void ratelimit_bucket_init(struct RateBucket *, curl_off_t);
+static void ratelimit_bucket_refill(struct RateBucket *);
+static double ratelimit_bucket_wait(struct RateBucket *);
+static struct RateLimitTransfer *ratelimit_get(struct RateLimit *, CURL *);
+static void ratelimit_pause(struct RateLimit *, struct RateLimitTransfer *);
+static void ratelimit_resume(evutil_socket_t, short, void *);
+
+// tokens a bucket can save up as a fraction of its rate
+static const double RATELIMIT_BURST = 0.1;
+// do not wake up more often than this (in seconds)
+static const double RATELIMIT_MIN_WAIT = 0.01;
+
+struct RateLimit *
+ratelimit_new(struct event_base *base, curl_off_t rate, curl_off_t host_rate)
+{
+	struct RateLimit *this = xmalloc(sizeof(struct RateLimit));
+	this->pool = mempool_new();
+	this->timer = mempool_add(this->pool, evtimer_new(base, ratelimit_resume, this), event_free);
+	ratelimit_bucket_init(&this->bucket, rate);
+	this->host_rate = host_rate;
+	this->hosts = mempool_map(this->pool, str_compare);
+	this->transfers = mempool_array(this->pool);
+	return this;
+}
+
+void
+ratelimit_free(struct RateLimit *this)
+{
+	if (this) {
+		ARRAY_FOREACH(this->transfers, struct RateLimitTransfer *, t) {
+			free(t);
+		}
+		mempool_free(this->pool);
+		free(this);
+	}
+}
+
+void
+ratelimit_bucket_init(struct RateBucket *bucket, curl_off_t rate)
+{
+	bucket->rate = rate;
+	bucket->tokens = MAX(rate * RATELIMIT_BURST, CURL_MAX_WRITE_SIZE);
+	clock_gettime(CLOCK_MONOTONIC, &bucket->refilled);
+}
+
+void
+ratelimit_bucket_refill(struct RateBucket *bucket)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - bucket->refilled.tv_sec) + (now.tv_nsec - bucket->refilled.tv_nsec) / 1e9;
+	bucket->refilled = now;
+	// Buckets can go into debt since curl hands us the data in
+	// chunks of up to CURL_MAX_WRITE_SIZE
+	double capacity = MAX(bucket->rate * RATELIMIT_BURST, CURL_MAX_WRITE_SIZE);
+	bucket->tokens = MIN(capacity, bucket->tokens + bucket->rate * elapsed);
+}
+
+double
+ratelimit_bucket_wait(struct RateBucket *bucket)
+{
+	if (bucket->rate > 0 && bucket->tokens <= 0) {
+		return -bucket->tokens / bucket->rate;
+	} else {
+		return 0;
+	}
+}
+
+void
+ratelimit_add(struct RateLimit *this, const char *url, CURL *eh, bool high_priority)
+{
+	if (this->bucket.rate == 0 && this->host_rate == 0) {
+		return;
+	}
+
+	struct RateLimitTransfer *t = xmalloc(sizeof(struct RateLimitTransfer));
+	t->eh = eh;
+	t->high_priority = high_priority;
+
+	if (this->host_rate > 0) {
+		SCOPE_MEMPOOL(pool);
+		const char *host = mirrordb_host(pool, url);
+		if (host) {
+			t->host = map_get(this->hosts, host);
+			unless (t->host) {
+				t->host = mempool_alloc(this->pool, sizeof(struct RateLimitHost));
+				t->host->host = str_dup(this->pool, host);
+				ratelimit_bucket_init(&t->host->bucket, this->host_rate);
+				map_add(this->hosts, t->host->host, t->host);
+			}
+		}
+	}
+
+	array_append(this->transfers, t);
+}
+
+struct RateLimitTransfer *
+ratelimit_get(struct RateLimit *this, CURL *eh)
+{
+	// There are never more transfers than connections
+	ARRAY_FOREACH(this->transfers, struct RateLimitTransfer *, t) {
+		if (t->eh == eh) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+bool
+ratelimit_consume(struct RateLimit *this, CURL *eh, size_t len)
+{
+	struct RateLimitTransfer *t = ratelimit_get(this, eh);
+	unless (t) {
+		return true;
+	}
+
+	ratelimit_bucket_refill(&this->bucket);
+	if (t->host) {
+		ratelimit_bucket_refill(&t->host->bucket);
+	}
+	if (!t->high_priority && this->high_priority_paused > 0) {
+		ratelimit_pause(this, t);
+		return false;
+	} else if (ratelimit_bucket_wait(&this->bucket) > 0) {
+		ratelimit_pause(this, t);
+		return false;
+	} else if (t->host && ratelimit_bucket_wait(&t->host->bucket) > 0) {
+		ratelimit_pause(this, t);
+		return false;
+	}
+
+	if (this->bucket.rate > 0) {
+		this->bucket.tokens -= len;
+	}
+	if (t->host) {
+		t->host->bucket.tokens -= len;
+	}
+	return true;
+}
+
+void
+ratelimit_pause(struct RateLimit *this, struct RateLimitTransfer *t)
+{
+	unless (t->paused) {
+		t->paused = true;
+		if (t->high_priority) {
+			this->high_priority_paused++;
+		}
+	}
+
+	unless (evtimer_pending(this->timer, NULL)) {
+		double wait = ratelimit_bucket_wait(&this->bucket);
+		if (t->host) {
+			wait = MAX(wait, ratelimit_bucket_wait(&t->host->bucket));
+		}
+		wait = MAX(wait, RATELIMIT_MIN_WAIT);
+		struct timeval tv = { .tv_sec = (time_t)wait, .tv_usec = (suseconds_t)((wait - (time_t)wait) * 1000000) };
+		evtimer_add(this->timer, &tv);
+	}
+}
+
+void
+ratelimit_resume(evutil_socket_t fd, short what, void *userdata)
+{
+	struct RateLimit *this = userdata;
+
+	// Resuming a transfer might call its write callback right
+	// away, which might pause it again. Give the high priority
+	// transfers the first go at the new tokens.
+	for (int high_priority = 1; high_priority >= 0; high_priority--) {
+		for (size_t i = 0; i < array_len(this->transfers); i++) {
+			struct RateLimitTransfer *t = array_get(this->transfers, i);
+			if (t->paused && t->high_priority == high_priority) {
+				t->paused = false;
+				if (t->high_priority) {
+					this->high_priority_paused--;
+				}
+				curl_easy_pause(t->eh, CURLPAUSE_CONT);
+			}
+		}
+	}
+}
+
+void
+ratelimit_remove(struct RateLimit *this, CURL *eh)
+{
+	for (size_t i = 0; i < array_len(this->transfers); i++) {
+		struct RateLimitTransfer *t = array_get(this->transfers, i);
+		if (t->eh == eh) {
+			if (t->paused && t->high_priority) {
+				this->high_priority_paused--;
+			}
+			array_remove(this->transfers, i);
+			free(t);
+			return;
+		}
+	}
+}
@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/file.h>
+#include <sys/types.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libias/flow.h>
+#include <libias/map.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "redirectdb.h"
+
+// Many sites redirect every request to another host. When the
+// redirect keeps the distfile name at the end of the URL we learn
+// the site the request really ended up on and go there directly
+// for the following distfiles of the same site.
+
+struct RedirectDBEntry {
+	const char *site;
+	// NULL if the redirect stopped working
+	const char *target;
+	time_t last_seen;
+	bool dirty;
+};
+
+struct RedirectDB {
+	struct Mempool *pool;
+	// NULL if the redirects are only remembered for this run
+	const char *path;
+	struct Map *entries;
+};
+
+// Prototypes
+static void redirectdb_load(struct RedirectDB *, struct Map *, FILE *);
+static void redirectdb_set(struct RedirectDB *, const char *, const char *);
+
+// forget about redirects we have not seen in a while
+static const time_t REDIRECTDB_EXPIRE = 7 * 24 * 60 * 60;
+
+struct RedirectDB *
+redirectdb_new(const char *path)
+{
+	struct RedirectDB *this = xmalloc(sizeof(struct RedirectDB));
+	this->pool = mempool_new();
+	this->entries = mempool_map(this->pool, str_compare);
+	unless (path) {
+		return this;
+	}
+	this->path = str_dup(this->pool, path);
+
+	int fd = open(this->path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		if (flock(fd, LOCK_SH) == -1) {
+			warn("flock: %s", this->path);
+		}
+		FILE *f = fdopen(fd, "r");
+		unless (f) {
+			err(1, "fdopen: %s", this->path);
+		}
+		redirectdb_load(this, this->entries, f);
+		fclose(f);
+	}
+
+	return this;
+}
+
+void
+redirectdb_free(struct RedirectDB *this)
+{
+	if (this) {
+		mempool_free(this->pool);
+		free(this);
+	}
+}
+
+void
+redirectdb_load(struct RedirectDB *this, struct Map *entries, FILE *f)
+{
+	time_t now = time(NULL);
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	while ((linelen = getline(&line, &linecap, f)) > 0) {
+		char *site = xmalloc(linelen);
+		char *target = xmalloc(linelen);
+		intmax_t last_seen;
+		if (sscanf(line, "%s %s %jd", site, target, &last_seen) == 3 &&
+		    now - last_seen < REDIRECTDB_EXPIRE &&
+		    !map_contains(entries, site)) {
+			struct RedirectDBEntry *e = mempool_alloc(this->pool, sizeof(struct RedirectDBEntry));
+			e->site = str_dup(this->pool, site);
+			e->target = str_dup(this->pool, target);
+			e->last_seen = last_seen;
+			map_add(entries, e->site, e);
+		}
+		free(site);
+		free(target);
+	}
+	free(line);
+}
+
+const char *
+redirectdb_get(struct RedirectDB *this, const char *site)
+{
+	struct RedirectDBEntry *entry = map_get(this->entries, site);
+	if (entry) {
+		return entry->target;
+	} else {
+		return NULL;
+	}
+}
+
+void
+redirectdb_learn(struct RedirectDB *this, const char *site, const char *name, const char *effective_url)
+{
+	// Only redirects that keep the distfile name at the end tell
+	// us where the other distfiles of the site are
+	size_t name_len = strlen(name);
+	size_t effective_url_len = strlen(effective_url);
+	if (effective_url_len <= name_len || strcmp(effective_url + effective_url_len - name_len, name) != 0) {
+		return;
+	}
+
+	SCOPE_MEMPOOL(pool);
+	const char *target = str_ndup(pool, effective_url, effective_url_len - name_len);
+	if (strcmp(target, site) != 0) {
+		redirectdb_set(this, site, target);
+	}
+}
+
+void
+redirectdb_forget(struct RedirectDB *this, const char *site)
+{
+	if (redirectdb_get(this, site)) {
+		redirectdb_set(this, site, NULL);
+	}
+}
+
+void
+redirectdb_set(struct RedirectDB *this, const char *site, const char *target)
+{
+	struct RedirectDBEntry *entry = map_get(this->entries, site);
+	unless (entry) {
+		entry = mempool_alloc(this->pool, sizeof(struct RedirectDBEntry));
+		entry->site = str_dup(this->pool, site);
+		map_add(this->entries, entry->site, entry);
+	}
+	if (target) {
+		entry->target = str_dup(this->pool, target);
+	} else {
+		entry->target = NULL;
+	}
+	entry->last_seen = time(NULL);
+	entry->dirty = true;
+}
+
+void
+redirectdb_save(struct RedirectDB *this)
+{
+	SCOPE_MEMPOOL(pool);
+
+	unless (this->path) {
+		return;
+	}
+
+	// Merge our entries into what other parfetch processes
+	// might have written in the meantime
+	int fd = open(this->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		warn("open: %s", this->path);
+		return;
+	}
+	if (flock(fd, LOCK_EX) == -1) {
+		warn("flock: %s", this->path);
+		close(fd);
+		return;
+	}
+	FILE *f = fdopen(fd, "r+");
+	unless (f) {
+		err(1, "fdopen: %s", this->path);
+	}
+
+	struct Map *entries = mempool_map(pool, str_compare);
+	MAP_FOREACH(this->entries, const char *, site, struct RedirectDBEntry *, entry) {
+		if (entry->dirty) {
+			map_add(entries, site, entry);
+		}
+	}
+	redirectdb_load(this, entries, f);
+
+	if (fseeko(f, 0, SEEK_SET) == -1 || ftruncate(fd, 0) == -1) {
+		warn("could not truncate %s", this->path);
+		fclose(f);
+		return;
+	}
+	// Forgotten redirects are left out so that they override
+	// what the others still remember
+	MAP_FOREACH(entries, const char *, site, struct RedirectDBEntry *, entry) {
+		if (entry->target) {
+			fprintf(f, "%s %s %jd\n", site, entry->target, (intmax_t)entry->last_seen);
+		}
+	}
+	if (fclose(f) != 0) {
+		warn("could not write %s", this->path);
+	}
+}
@@ -0,0 +1,458 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include <libias/array.h>
+#include <libias/flow.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "serve.h"
+
+// A plain HTTP/1.1 server for DISTDIR so that other machines can
+// use us as MASTER_SITE_OVERRIDE. Existing files are sent with
+// evbuffer_add_file() which uses sendfile(2) where available.
+// Requests for missing files are handed to the request callback
+// which fetches them upstream. GET requests without a Range
+// header get the data streamed to them while it comes in. All
+// others wait until the file is complete and are then answered
+// from disk like any other request.
+//
+// A streaming client that reads slower than upstream sends is not
+// given more data while too much of it is queued. Once it read
+// that it catches up from the file on disk with the next data.
+
+struct ParfetchServeConnection {
+	// Must be first so that we can get back to the connection
+	// from the request
+	struct ParfetchServeRequest request;
+	struct Mempool *pool;
+	struct ParfetchServe *serve;
+	// NULL once the client went away
+	struct evhttp_request *req;
+	bool stream;
+	bool started;
+	off_t sent;
+};
+
+struct ParfetchServe {
+	struct Mempool *pool;
+	struct evhttp *http;
+	int distdir_fd;
+	struct Array *connections;
+	void (*request_cb)(struct ParfetchServeRequest *, void *);
+	void *request_cb_data;
+};
+
+// Prototypes
+static void parfetch_serve_close_cb(struct evhttp_connection *, void *);
+static void parfetch_serve_connection_free(struct ParfetchServeConnection *);
+static bool parfetch_serve_connection_ready(struct ParfetchServeConnection *);
+static void parfetch_serve_file(int, struct evhttp_request *, const char *);
+static void parfetch_serve_http_cb(struct evhttp_request *, void *);
+static const char *parfetch_serve_path(struct Mempool *, struct evhttp_request *);
+static bool parfetch_serve_range(const char *, off_t, off_t *, off_t *);
+static bool parfetch_serve_send_file(struct evhttp_request *, int, off_t, off_t);
+
+// Queued output of a streaming client above which it gets no more
+// data until it read some of it
+static const size_t PARFETCH_SERVE_MAX_OUTPUT = 4 * 1024 * 1024;
+
+struct ParfetchServe *
+parfetch_serve_new(struct event_base *base, const char *address, int distdir_fd, void (*request_cb)(struct ParfetchServeRequest *, void *), void *request_cb_data)
+{
+	struct ParfetchServe *this = xmalloc(sizeof(struct ParfetchServe));
+	this->pool = mempool_new();
+	this->distdir_fd = distdir_fd;
+	this->connections = mempool_array(this->pool);
+	this->request_cb = request_cb;
+	this->request_cb_data = request_cb_data;
+
+	// [host]:port, host:port or just the port
+	SCOPE_MEMPOOL(pool);
+	char *host = str_dup(pool, "0.0.0.0");
+	const char *port = address;
+	const char *colon = strrchr(address, ':');
+	if (colon) {
+		host = str_ndup(pool, address, colon - address);
+		port = colon + 1;
+		if (*host == '[' && host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = 0;
+			host++;
+		}
+	}
+	const char *errstr = NULL;
+	uint16_t portnum = strtonum(port, 1, UINT16_MAX, &errstr);
+	if (errstr) {
+		errx(1, "invalid port: %s: %s", port, errstr);
+	}
+
+	this->http = evhttp_new(base);
+	unless (this->http) {
+		errx(1, "evhttp_new");
+	}
+	evhttp_set_allowed_methods(this->http, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD);
+	evhttp_set_gencb(this->http, parfetch_serve_http_cb, this);
+	unless (evhttp_bind_socket_with_handle(this->http, host, portnum)) {
+		err(1, "could not listen on %s", address);
+	}
+
+	return this;
+}
+
+void
+parfetch_serve_free(struct ParfetchServe *this)
+{
+	if (this) {
+		// Tell the clients that are still waiting that we are gone
+		while (array_len(this->connections) > 0) {
+			parfetch_serve_request_finish(array_get(this->connections, 0), -1, false);
+		}
+		evhttp_free(this->http);
+		mempool_free(this->pool);
+		free(this);
+	}
+}
+
+void
+parfetch_serve_connection_free(struct ParfetchServeConnection *conn)
+{
+	if (conn) {
+		for (size_t i = 0; i < array_len(conn->serve->connections); i++) {
+			if (array_get(conn->serve->connections, i) == conn) {
+				array_remove(conn->serve->connections, i);
+				break;
+			}
+		}
+		if (conn->req) {
+			evhttp_connection_set_closecb(evhttp_request_get_connection(conn->req), NULL, NULL);
+		}
+		mempool_free(conn->pool);
+		free(conn);
+	}
+}
+
+const char *
+parfetch_serve_path(struct Mempool *pool, struct evhttp_request *req)
+{
+	const struct evhttp_uri *uri = evhttp_request_get_evhttp_uri(req);
+	const char *encoded_path = evhttp_uri_get_path(uri);
+	unless (encoded_path && *encoded_path == '/') {
+		return NULL;
+	}
+	size_t len = 0;
+	char *path = evhttp_uridecode(encoded_path + 1, 0, &len);
+	unless (path) {
+		return NULL;
+	}
+	mempool_take(pool, path);
+	if (len != strlen(path) || len == 0) {
+		return NULL;
+	}
+
+	// Only files below DISTDIR that are not hidden or partial
+	ARRAY_FOREACH(str_split(pool, path, "/"), const char *, component) {
+		if (*component == 0 || *component == '.') {
+			return NULL;
+		}
+	}
+	if (str_endswith(path, ".part") || str_endswith(path, ".part.valid")) {
+		return NULL;
+	}
+
+	return path;
+}
+
+void
+parfetch_serve_http_cb(struct evhttp_request *req, void *userdata)
+{
+	struct ParfetchServe *this = userdata;
+
+	SCOPE_MEMPOOL(pool);
+	const char *path = parfetch_serve_path(pool, req);
+	unless (path) {
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return;
+	}
+
+	struct stat st;
+	if (fstatat(this->distdir_fd, path, &st, 0) == 0 || errno != ENOENT || !this->request_cb) {
+		parfetch_serve_file(this->distdir_fd, req, path);
+		return;
+	}
+
+	struct ParfetchServeConnection *conn = xmalloc(sizeof(struct ParfetchServeConnection));
+	conn->pool = mempool_new();
+	conn->serve = this;
+	conn->req = req;
+	conn->request.path = str_dup(conn->pool, path);
+	conn->stream = evhttp_request_get_command(req) == EVHTTP_REQ_GET &&
+		!evhttp_find_header(evhttp_request_get_input_headers(req), "Range");
+	evhttp_connection_set_closecb(evhttp_request_get_connection(req), parfetch_serve_close_cb, conn);
+	array_append(this->connections, conn);
+	this->request_cb(&conn->request, this->request_cb_data);
+}
+
+void
+parfetch_serve_close_cb(struct evhttp_connection *evcon, void *userdata)
+{
+	// The request is gone with the connection. Keep the rest
+	// around until the owner is done with it.
+	struct ParfetchServeConnection *conn = userdata;
+	conn->req = NULL;
+}
+
+bool
+parfetch_serve_connection_ready(struct ParfetchServeConnection *conn)
+{
+	unless (conn->stream && conn->req) {
+		return false;
+	}
+	struct bufferevent *bev = evhttp_connection_get_bufferevent(evhttp_request_get_connection(conn->req));
+	return evbuffer_get_length(bufferevent_get_output(bev)) <= PARFETCH_SERVE_MAX_OUTPUT;
+}
+
+void
+parfetch_serve_file(int dirfd, struct evhttp_request *req, const char *path)
+{
+	int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		if (fd != -1) {
+			close(fd);
+		}
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return;
+	}
+
+	struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(headers, "Content-Type", "application/octet-stream");
+	evhttp_add_header(headers, "Accept-Ranges", "bytes");
+
+	SCOPE_MEMPOOL(pool);
+	int code = HTTP_OK;
+	const char *reason = "OK";
+	off_t offset = 0;
+	off_t length = st.st_size;
+	const char *range = evhttp_find_header(evhttp_request_get_input_headers(req), "Range");
+	if (range && parfetch_serve_range(range, st.st_size, &offset, &length)) {
+		if (length == 0) {
+			close(fd);
+			evhttp_add_header(headers, "Content-Range", str_printf(pool, "bytes */%jd", (intmax_t)st.st_size));
+			evhttp_send_error(req, 416, "Range Not Satisfiable");
+			return;
+		}
+		code = 206;
+		reason = "Partial Content";
+		evhttp_add_header(headers, "Content-Range", str_printf(pool, "bytes %jd-%jd/%jd",
+			(intmax_t)offset, (intmax_t)(offset + length - 1), (intmax_t)st.st_size));
+	}
+
+	if (evhttp_request_get_command(req) == EVHTTP_REQ_HEAD) {
+		close(fd);
+		evhttp_add_header(headers, "Content-Length", str_printf(pool, "%jd", (intmax_t)length));
+		evhttp_send_reply(req, code, reason, NULL);
+		return;
+	}
+
+	struct evbuffer *buf = evbuffer_new();
+	// evbuffer_add_file() takes over the descriptor
+	if (length > 0 && evbuffer_add_file(buf, fd, offset, length) == -1) {
+		evbuffer_free(buf);
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	} else if (length == 0) {
+		close(fd);
+	}
+	evhttp_send_reply(req, code, reason, buf);
+	evbuffer_free(buf);
+}
+
+bool
+parfetch_serve_range(const char *range, off_t size, off_t *offset, off_t *length)
+{
+	// Only a single range is supported. We ignore the header
+	// otherwise and send the whole file.
+	unless (str_startswith(range, "bytes=") && !strchr(range, ',')) {
+		return false;
+	}
+	range += strlen("bytes=");
+	char *end = NULL;
+	if (*range == '-') {
+		// The last n bytes
+		errno = 0;
+		intmax_t n = strtoimax(range + 1, &end, 10);
+		if (errno != 0 || *end != 0 || end == range + 1 || n < 0) {
+			return false;
+		}
+		*length = MIN(n, size);
+		*offset = size - *length;
+		return true;
+	}
+
+	errno = 0;
+	intmax_t first = strtoimax(range, &end, 10);
+	if (errno != 0 || end == range || *end != '-' || first < 0) {
+		return false;
+	}
+	intmax_t last = size - 1;
+	if (*(end + 1) != 0) {
+		const char *s = end + 1;
+		last = strtoimax(s, &end, 10);
+		if (errno != 0 || *end != 0 || last < first) {
+			return false;
+		}
+	}
+	if (first >= size) {
+		*offset = 0;
+		*length = 0;
+	} else {
+		*offset = first;
+		*length = MIN(last, size - 1) - first + 1;
+	}
+	return true;
+}
+
+bool
+parfetch_serve_send_file(struct evhttp_request *req, int fd, off_t offset, off_t length)
+{
+	int dupfd = dup(fd);
+	if (dupfd == -1) {
+		return false;
+	}
+	struct evbuffer *buf = evbuffer_new();
+	if (evbuffer_add_file(buf, dupfd, offset, length) == -1) {
+		evbuffer_free(buf);
+		return false;
+	}
+	evhttp_send_reply_chunk(req, buf);
+	evbuffer_free(buf);
+	return true;
+}
+
+off_t
+parfetch_serve_request_offset(struct ParfetchServeRequest *request)
+{
+	struct ParfetchServeConnection *conn = (struct ParfetchServeConnection *)request;
+	if (parfetch_serve_connection_ready(conn)) {
+		return conn->sent;
+	} else {
+		return -1;
+	}
+}
+
+void
+parfetch_serve_request_write(struct ParfetchServeRequest *request, int fd, off_t offset, const char *data, size_t len)
+{
+	// The data must arrive in order. What the client is missing
+	// before offset is read from fd.
+	struct ParfetchServeConnection *conn = (struct ParfetchServeConnection *)request;
+	unless (parfetch_serve_connection_ready(conn)) {
+		return;
+	} else if (offset + (off_t)len <= conn->sent) {
+		// Transfer started over and has not caught up yet
+		return;
+	}
+
+	unless (conn->started) {
+		struct evkeyvalq *headers = evhttp_request_get_output_headers(conn->req);
+		evhttp_add_header(headers, "Content-Type", "application/octet-stream");
+		evhttp_send_reply_start(conn->req, HTTP_OK, "OK");
+		conn->started = true;
+	}
+	if (offset > conn->sent) {
+		unless (parfetch_serve_send_file(conn->req, fd, conn->sent, offset - conn->sent)) {
+			conn->stream = false;
+			return;
+		}
+		conn->sent = offset;
+	}
+
+	struct evbuffer *buf = evbuffer_new();
+	evbuffer_add(buf, data + (conn->sent - offset), offset + len - conn->sent);
+	evhttp_send_reply_chunk(conn->req, buf);
+	evbuffer_free(buf);
+	conn->sent = offset + len;
+}
+
+// The file is in dirfd if ok
+void
+parfetch_serve_request_finish(struct ParfetchServeRequest *request, int dirfd, bool ok)
+{
+	struct ParfetchServeConnection *conn = (struct ParfetchServeConnection *)request;
+	struct evhttp_request *req = conn->req;
+	if (req) {
+		evhttp_connection_set_closecb(evhttp_request_get_connection(req), NULL, NULL);
+		conn->req = NULL;
+	}
+
+	unless (req) {
+		// nothing
+	} else if (conn->started && conn->stream && ok) {
+		// Send whatever the client has not seen yet
+		int fd = openat(dirfd, request->path, O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > conn->sent) {
+			parfetch_serve_send_file(req, fd, conn->sent, st.st_size - conn->sent);
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+		evhttp_send_reply_end(req);
+	} else if (conn->started) {
+		// Too late for an error status. Make sure the client
+		// notices that it did not get everything.
+		evhttp_connection_free(evhttp_request_get_connection(req));
+	} else if (ok) {
+		parfetch_serve_file(dirfd, req, request->path);
+	} else {
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+	}
+
+	parfetch_serve_connection_free(conn);
+}
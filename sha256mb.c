@@ -0,0 +1,383 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256MB_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include <libias/flow.h>
+
+#include "sha256mb.h"
+
+// Multi-buffer SHA-256 hashes several independent messages at once,
+// one per 32-bit lane of a vector register. Every lane runs the
+// same rounds on a different message so a batch of files costs
+// about as much as the largest file of it does on its own. It only
+// pays off for many files of similar size, like the hundreds of
+// crates of Cargo ports that are checked largest first.
+//
+// The single-stream SHA-NI instructions of newer CPUs are faster
+// than this. The caller is expected to prefer OpenSSL there.
+//
+// The messages are fed in chunks of whole blocks. The last chunk
+// of a lane is padded separately. Lanes with fewer blocks than the
+// others in an update keep hashing a block of zeroes but their
+// state is not updated anymore.
+
+// The blocks of one sha256mb_update()
+struct SHA256MBLanes {
+	size_t max_blocks;
+	const unsigned char *data[SHA256MB_MAX_LANES];
+	size_t full_blocks[SHA256MB_MAX_LANES];
+	size_t blocks[SHA256MB_MAX_LANES];
+	// The last partial block, the 0x80 byte and the length of
+	// the message span one or two blocks
+	unsigned char pad[SHA256MB_MAX_LANES][128];
+};
+
+static const uint32_t sha256mb_h0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#if SHA256MB_X86
+// Prototypes
+static void sha256mb_prepare(struct SHA256MB *, struct SHA256MBLanes *, const unsigned char **, const size_t *, const bool *);
+static void sha256mb_load(struct SHA256MBLanes *, size_t, size_t, uint32_t [16][SHA256MB_MAX_LANES], uint32_t *);
+static void sha256mb_avx2(struct SHA256MB *, struct SHA256MBLanes *);
+static void sha256mb_avx512(struct SHA256MB *, struct SHA256MBLanes *);
+
+static const uint32_t sha256mb_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const unsigned char sha256mb_zero_block[64];
+
+// One round on all lanes. The caller rotates the names of the
+// working variables instead of moving them around.
+#define SHA256MB_ROUND(a, b, c, d, e, f, g, h, i, w) do { \
+	t1 = V_ADD(V_ADD(V_ADD(h, V_S1(e)), V_ADD(V_CH(e, f, g), V_SET1(sha256mb_k[i]))), w); \
+	d = V_ADD(d, t1); \
+	h = V_ADD(t1, V_ADD(V_S0(a), V_MAJ(a, b, c))); \
+} while (0)
+
+#define SHA256MB_ROUNDS16(i) do { \
+	SHA256MB_ROUND(a, b, c, d, e, f, g, h, (i) + 0, x[0]); \
+	SHA256MB_ROUND(h, a, b, c, d, e, f, g, (i) + 1, x[1]); \
+	SHA256MB_ROUND(g, h, a, b, c, d, e, f, (i) + 2, x[2]); \
+	SHA256MB_ROUND(f, g, h, a, b, c, d, e, (i) + 3, x[3]); \
+	SHA256MB_ROUND(e, f, g, h, a, b, c, d, (i) + 4, x[4]); \
+	SHA256MB_ROUND(d, e, f, g, h, a, b, c, (i) + 5, x[5]); \
+	SHA256MB_ROUND(c, d, e, f, g, h, a, b, (i) + 6, x[6]); \
+	SHA256MB_ROUND(b, c, d, e, f, g, h, a, (i) + 7, x[7]); \
+	SHA256MB_ROUND(a, b, c, d, e, f, g, h, (i) + 8, x[8]); \
+	SHA256MB_ROUND(h, a, b, c, d, e, f, g, (i) + 9, x[9]); \
+	SHA256MB_ROUND(g, h, a, b, c, d, e, f, (i) + 10, x[10]); \
+	SHA256MB_ROUND(f, g, h, a, b, c, d, e, (i) + 11, x[11]); \
+	SHA256MB_ROUND(e, f, g, h, a, b, c, d, (i) + 12, x[12]); \
+	SHA256MB_ROUND(d, e, f, g, h, a, b, c, (i) + 13, x[13]); \
+	SHA256MB_ROUND(c, d, e, f, g, h, a, b, (i) + 14, x[14]); \
+	SHA256MB_ROUND(b, c, d, e, f, g, h, a, (i) + 15, x[15]); \
+} while (0)
+
+// Extend the message schedule by the next 16 words in place
+#define SHA256MB_SCHEDULE16() do { \
+	for (size_t j = 0; j < 16; j++) { \
+		x[j] = V_ADD(V_ADD(x[j], V_s0(x[(j + 1) & 15])), V_ADD(x[(j + 9) & 15], V_s1(x[(j + 14) & 15]))); \
+	} \
+} while (0)
+
+// The whole compression function for one block of every lane
+#define SHA256MB_COMPRESS(s, mask) do { \
+	a = s[0]; b = s[1]; c = s[2]; d = s[3]; \
+	e = s[4]; f = s[5]; g = s[6]; h = s[7]; \
+	SHA256MB_ROUNDS16(0); \
+	SHA256MB_SCHEDULE16(); \
+	SHA256MB_ROUNDS16(16); \
+	SHA256MB_SCHEDULE16(); \
+	SHA256MB_ROUNDS16(32); \
+	SHA256MB_SCHEDULE16(); \
+	SHA256MB_ROUNDS16(48); \
+	s[0] = V_ADD(s[0], V_AND(a, mask)); \
+	s[1] = V_ADD(s[1], V_AND(b, mask)); \
+	s[2] = V_ADD(s[2], V_AND(c, mask)); \
+	s[3] = V_ADD(s[3], V_AND(d, mask)); \
+	s[4] = V_ADD(s[4], V_AND(e, mask)); \
+	s[5] = V_ADD(s[5], V_AND(f, mask)); \
+	s[6] = V_ADD(s[6], V_AND(g, mask)); \
+	s[7] = V_ADD(s[7], V_AND(h, mask)); \
+} while (0)
+#endif
+
+bool
+sha256mb_supported(enum SHA256MBBackend backend)
+{
+#if SHA256MB_X86
+	switch (backend) {
+	case SHA256MB_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case SHA256MB_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	}
+#endif
+	return false;
+}
+
+// Whether the CPU has the SHA extensions that OpenSSL uses for
+// single-stream SHA-256
+bool
+sha256mb_sha_ni(void)
+{
+#if SHA256MB_X86
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return (ebx & (1U << 29)) != 0;
+	}
+#endif
+	return false;
+}
+
+size_t
+sha256mb_lanes(enum SHA256MBBackend backend)
+{
+	switch (backend) {
+	case SHA256MB_AVX2:
+		return 8;
+	case SHA256MB_AVX512:
+		return 16;
+	}
+	panic("unknown multi-buffer SHA-256 backend");
+}
+
+void
+sha256mb_init(struct SHA256MB *this, enum SHA256MBBackend backend)
+{
+	panic_unless(sha256mb_supported(backend), "unsupported multi-buffer SHA-256 backend");
+	this->backend = backend;
+	for (size_t i = 0; i < SHA256MB_MAX_LANES; i++) {
+		for (size_t j = 0; j < 8; j++) {
+			this->h[j][i] = sha256mb_h0[j];
+		}
+		this->len[i] = 0;
+	}
+}
+
+// Feed len[i] bytes at data[i] to lane i for every lane. len[i]
+// must be a multiple of the block size of 64 unless last[i] is
+// set, which ends the message of the lane. Lanes with a len of 0
+// that are not ending are left alone.
+void
+sha256mb_update(struct SHA256MB *this, const unsigned char **data, const size_t *len, const bool *last)
+{
+#if SHA256MB_X86
+	struct SHA256MBLanes lanes;
+	sha256mb_prepare(this, &lanes, data, len, last);
+	switch (this->backend) {
+	case SHA256MB_AVX2:
+		sha256mb_avx2(this, &lanes);
+		break;
+	case SHA256MB_AVX512:
+		sha256mb_avx512(this, &lanes);
+		break;
+	}
+#endif
+}
+
+// Get the digest of a lane after its last update and make it
+// ready for the next message
+void
+sha256mb_digest(struct SHA256MB *this, size_t lane, unsigned char *digest)
+{
+	panic_unless(lane < SHA256MB_MAX_LANES, "invalid multi-buffer SHA-256 lane");
+	for (size_t j = 0; j < 8; j++) {
+		digest[4 * j] = this->h[j][lane] >> 24;
+		digest[4 * j + 1] = this->h[j][lane] >> 16;
+		digest[4 * j + 2] = this->h[j][lane] >> 8;
+		digest[4 * j + 3] = this->h[j][lane];
+		this->h[j][lane] = sha256mb_h0[j];
+	}
+	this->len[lane] = 0;
+}
+
+#if SHA256MB_X86
+void
+sha256mb_prepare(struct SHA256MB *this, struct SHA256MBLanes *lanes, const unsigned char **data, const size_t *len, const bool *last)
+{
+	lanes->max_blocks = 0;
+	for (size_t i = 0; i < sha256mb_lanes(this->backend); i++) {
+		lanes->data[i] = data[i];
+		lanes->full_blocks[i] = len[i] / 64;
+		lanes->blocks[i] = lanes->full_blocks[i];
+		this->len[i] += len[i];
+		if (last[i]) {
+			size_t tail = len[i] % 64;
+			memset(lanes->pad[i], 0, sizeof(lanes->pad[i]));
+			if (tail > 0) {
+				memcpy(lanes->pad[i], data[i] + lanes->full_blocks[i] * 64, tail);
+			}
+			lanes->pad[i][tail] = 0x80;
+			size_t pad_blocks = tail + 9 <= 64 ? 1 : 2;
+			uint64_t bits = this->len[i] * 8;
+			for (size_t j = 0; j < 8; j++) {
+				lanes->pad[i][pad_blocks * 64 - 1 - j] = bits >> (8 * j);
+			}
+			lanes->blocks[i] += pad_blocks;
+		} else {
+			panic_unless(len[i] % 64 == 0, "multi-buffer SHA-256 update with a partial block");
+		}
+		lanes->max_blocks = MAX(lanes->max_blocks, lanes->blocks[i]);
+	}
+}
+
+// Gather the big endian message words of block b of the first
+// width lanes. Lanes without a block b get zeroes and a mask that
+// keeps their state as it is.
+void
+sha256mb_load(struct SHA256MBLanes *lanes, size_t b, size_t width, uint32_t w[16][SHA256MB_MAX_LANES], uint32_t *mask)
+{
+	for (size_t i = 0; i < width; i++) {
+		const unsigned char *p;
+		if (b >= lanes->blocks[i]) {
+			p = sha256mb_zero_block;
+			mask[i] = 0;
+		} else if (b < lanes->full_blocks[i]) {
+			p = lanes->data[i] + b * 64;
+			mask[i] = UINT32_MAX;
+		} else {
+			p = lanes->pad[i] + (b - lanes->full_blocks[i]) * 64;
+			mask[i] = UINT32_MAX;
+		}
+		for (size_t t = 0; t < 16; t++) {
+			w[t][i] = (uint32_t)p[4 * t] << 24 | (uint32_t)p[4 * t + 1] << 16 |
+				(uint32_t)p[4 * t + 2] << 8 | (uint32_t)p[4 * t + 3];
+		}
+	}
+}
+
+#define V_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define V_ADD(x, y) _mm256_add_epi32(x, y)
+#define V_AND(x, y) _mm256_and_si256(x, y)
+#define V_SET1(x) _mm256_set1_epi32(x)
+#define V_XOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define V_CH(e, f, g) _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g))
+#define V_MAJ(a, b, c) _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)))
+#define V_S0(x) V_XOR3(V_ROTR(x, 2), V_ROTR(x, 13), V_ROTR(x, 22))
+#define V_S1(x) V_XOR3(V_ROTR(x, 6), V_ROTR(x, 11), V_ROTR(x, 25))
+#define V_s0(x) V_XOR3(V_ROTR(x, 7), V_ROTR(x, 18), _mm256_srli_epi32(x, 3))
+#define V_s1(x) V_XOR3(V_ROTR(x, 17), V_ROTR(x, 19), _mm256_srli_epi32(x, 10))
+
+__attribute__((target("avx2")))
+void
+sha256mb_avx2(struct SHA256MB *this, struct SHA256MBLanes *lanes)
+{
+	uint32_t w[16][SHA256MB_MAX_LANES];
+	uint32_t mask[SHA256MB_MAX_LANES];
+	__m256i s[8];
+	for (size_t i = 0; i < 8; i++) {
+		s[i] = _mm256_loadu_si256((const __m256i *)this->h[i]);
+	}
+	for (size_t block = 0; block < lanes->max_blocks; block++) {
+		sha256mb_load(lanes, block, 8, w, mask);
+		__m256i x[16];
+		for (size_t t = 0; t < 16; t++) {
+			x[t] = _mm256_loadu_si256((const __m256i *)w[t]);
+		}
+		__m256i m = _mm256_loadu_si256((const __m256i *)mask);
+		__m256i a, b, c, d, e, f, g, h, t1;
+		SHA256MB_COMPRESS(s, m);
+	}
+	for (size_t i = 0; i < 8; i++) {
+		_mm256_storeu_si256((__m256i *)this->h[i], s[i]);
+	}
+}
+
+#undef V_ROTR
+#undef V_ADD
+#undef V_AND
+#undef V_SET1
+#undef V_XOR3
+#undef V_CH
+#undef V_MAJ
+#undef V_S0
+#undef V_S1
+#undef V_s0
+#undef V_s1
+
+// AVX-512 has rotates and three operand logic so Ch, Maj and the
+// sigma functions are one or two instructions each
+#define V_ROTR(x, n) _mm512_ror_epi32(x, n)
+#define V_ADD(x, y) _mm512_add_epi32(x, y)
+#define V_AND(x, y) _mm512_and_si512(x, y)
+#define V_SET1(x) _mm512_set1_epi32(x)
+#define V_XOR3(x, y, z) _mm512_ternarylogic_epi32(x, y, z, 0x96)
+#define V_CH(e, f, g) _mm512_ternarylogic_epi32(e, f, g, 0xca)
+#define V_MAJ(a, b, c) _mm512_ternarylogic_epi32(a, b, c, 0xe8)
+#define V_S0(x) V_XOR3(V_ROTR(x, 2), V_ROTR(x, 13), V_ROTR(x, 22))
+#define V_S1(x) V_XOR3(V_ROTR(x, 6), V_ROTR(x, 11), V_ROTR(x, 25))
+#define V_s0(x) V_XOR3(V_ROTR(x, 7), V_ROTR(x, 18), _mm512_srli_epi32(x, 3))
+#define V_s1(x) V_XOR3(V_ROTR(x, 17), V_ROTR(x, 19), _mm512_srli_epi32(x, 10))
+
+__attribute__((target("avx512f")))
+void
+sha256mb_avx512(struct SHA256MB *this, struct SHA256MBLanes *lanes)
+{
+	uint32_t w[16][SHA256MB_MAX_LANES];
+	uint32_t mask[SHA256MB_MAX_LANES];
+	__m512i s[8];
+	for (size_t i = 0; i < 8; i++) {
+		s[i] = _mm512_loadu_si512(this->h[i]);
+	}
+	for (size_t block = 0; block < lanes->max_blocks; block++) {
+		sha256mb_load(lanes, block, 16, w, mask);
+		__m512i x[16];
+		for (size_t t = 0; t < 16; t++) {
+			x[t] = _mm512_loadu_si512(w[t]);
+		}
+		__m512i m = _mm512_loadu_si512(mask);
+		__m512i a, b, c, d, e, f, g, h, t1;
+		SHA256MB_COMPRESS(s, m);
+	}
+	for (size_t i = 0; i < 8; i++) {
+		_mm512_storeu_si512(this->h[i], s[i]);
+	}
+}
+#endif
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#pragma once
+
+enum {
+	SHA256MB_DIGEST_LENGTH = 32,
+	SHA256MB_MAX_LANES = 16,
+};
+
+enum SHA256MBBackend {
+	SHA256MB_AVX2,
+	SHA256MB_AVX512,
+};
+
+struct SHA256MB {
+	enum SHA256MBBackend backend;
+	uint32_t h[8][SHA256MB_MAX_LANES];
+	uint64_t len[SHA256MB_MAX_LANES];
+};
+
+bool sha256mb_supported(enum SHA256MBBackend);
+bool sha256mb_sha_ni(void);
+size_t sha256mb_lanes(enum SHA256MBBackend);
+void sha256mb_init(struct SHA256MB *, enum SHA256MBBackend);
+void sha256mb_update(struct SHA256MB *, const unsigned char **, const size_t *, const bool *);
+void sha256mb_digest(struct SHA256MB *, size_t, unsigned char *);
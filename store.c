@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libias/distinfo.h>
+#include <libias/flow.h>
+#include <libias/io.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "store.h"
+
+// A content-addressed store of distfiles shared by all ports and
+// DISTDIRs. Files are kept as <dir>/sha256/<xx>/<digest> and
+// hardlinked into DISTDIR. When the store is on another file
+// system they are copied with copy_file_range(2) instead which
+// clones the blocks where the file system supports it.
+//
+// Nothing in the store is trusted. Linked files are checksummed
+// like any other existing distfile and a bad file in the store is
+// replaced by the next verified download.
+
+// Prototypes
+static bool store_copy(int, const char *, int, const char *);
+static bool store_link(int, const char *, int, const char *);
+
+const char *
+store_path(struct Mempool *pool, const char *dir, struct DistinfoEntry *entry)
+{
+	if (entry->digest_len != 32) {
+		return NULL;
+	}
+
+	char hex[2 * DISTINFO_MAX_DIGEST_LEN + 1];
+	for (size_t i = 0; i < entry->digest_len; i++) {
+		snprintf(hex + 2 * i, 3, "%02x", entry->digest[i]);
+	}
+	return str_printf(pool, "%s/sha256/%.2s/%s", dir, hex, hex);
+}
+
+bool
+store_get(const char *dir, struct DistinfoEntry *entry, int dirfd, const char *name)
+{
+	SCOPE_MEMPOOL(pool);
+	const char *path = store_path(pool, dir, entry);
+	unless (path) {
+		return false;
+	}
+
+	struct stat st;
+	if (stat(path, &st) == -1 || st.st_size != entry->size) {
+		return false;
+	}
+	return store_link(AT_FDCWD, path, dirfd, name);
+}
+
+bool
+store_put(const char *dir, struct DistinfoEntry *entry, int dirfd, const char *name)
+{
+	SCOPE_MEMPOOL(pool);
+	const char *path = store_path(pool, dir, entry);
+	unless (path) {
+		return false;
+	}
+	unless (mkdirp(dirname(str_dup(pool, path)))) {
+		return false;
+	}
+	return store_link(dirfd, name, AT_FDCWD, path);
+}
+
+bool
+store_link(int src_dirfd, const char *src, int dst_dirfd, const char *dst)
+{
+	// Always replace dst so that the store heals itself and we
+	// never see a half copied file
+	SCOPE_MEMPOOL(pool);
+	const char *tmp = str_printf(pool, "%s.%ld.tmp", dst, (long)getpid());
+	unlinkat(dst_dirfd, tmp, 0);
+	if (linkat(src_dirfd, src, dst_dirfd, tmp, 0) == -1) {
+		if (errno != EXDEV || !store_copy(src_dirfd, src, dst_dirfd, tmp)) {
+			unlinkat(dst_dirfd, tmp, 0);
+			return false;
+		}
+	}
+	if (renameat(dst_dirfd, tmp, dst_dirfd, dst) == -1) {
+		unlinkat(dst_dirfd, tmp, 0);
+		return false;
+	}
+	return true;
+}
+
+bool
+store_copy(int src_dirfd, const char *src, int dst_dirfd, const char *dst)
+{
+	int in = openat(src_dirfd, src, O_RDONLY | O_CLOEXEC);
+	if (in == -1) {
+		return false;
+	}
+	int out = openat(dst_dirfd, dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out == -1) {
+		close(in);
+		return false;
+	}
+
+	ssize_t n;
+	while ((n = copy_file_range(in, NULL, out, NULL, SSIZE_MAX, 0)) > 0);
+	if (n == -1 && lseek(out, 0, SEEK_CUR) == 0) {
+		// Not supported between these file systems by older
+		// kernels so copy it ourselves
+		char buf[65536];
+		while ((n = read(in, buf, sizeof(buf))) > 0) {
+			if (write(out, buf, n) != n) {
+				n = -1;
+				break;
+			}
+		}
+	}
+
+	close(in);
+	if (close(out) == -1) {
+		return false;
+	}
+	return n == 0;
+}
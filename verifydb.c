@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+//
+// Copyright (c) 2021 Tobias Kortkamp <tobik@FreeBSD.org>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+#include "config.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libias/flow.h>
+#include <libias/map.h>
+#include <libias/mem.h>
+#include <libias/mempool.h>
+#include <libias/str.h>
+
+#include "verifydb.h"
+
+// Remembers the digests of distfiles that were verified before.
+// A file whose device, inode, size, mtime and ctime are still the
+// same as when it was hashed has not changed since, so it need not
+// be hashed again to check it against distinfo. Renames, links,
+// and chmod change the ctime and are enough to hash the file again.
+
+struct VerifyDBEntry {
+	uintmax_t size;
+	// in nanoseconds
+	intmax_t mtime;
+	intmax_t ctime;
+	const char *digest;
+	time_t last_seen;
+	bool dirty;
+};
+
+struct VerifyDB {
+	struct Mempool *pool;
+	// NULL if the digests are only remembered for this run
+	const char *path;
+	// "<dev> <ino> <algorithm>" -> struct VerifyDBEntry *
+	struct Map *entries;
+	bool dirty;
+};
+
+// Prototypes
+static const char *verifydb_digest(struct Mempool *, const uint8_t *, size_t);
+static const char *verifydb_key(struct Mempool *, struct stat *, const char *);
+static void verifydb_load(struct Mempool *, struct Map *, FILE *);
+static intmax_t verifydb_nsec(struct timespec *);
+
+// forget about files we have not seen in a while
+static const time_t VERIFYDB_EXPIRE = 30 * 24 * 60 * 60;
+// only refresh last_seen of entries that are older than this so
+// that the database is not rewritten on every run
+static const time_t VERIFYDB_REFRESH = 24 * 60 * 60;
+
+struct VerifyDB *
+verifydb_new(const char *path)
+{
+	struct VerifyDB *this = xmalloc(sizeof(struct VerifyDB));
+	this->pool = mempool_new();
+	this->entries = mempool_map(this->pool, str_compare);
+	unless (path) {
+		return this;
+	}
+	this->path = str_dup(this->pool, path);
+
+	int fd = open(this->path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		if (flock(fd, LOCK_SH) == -1) {
+			warn("flock: %s", this->path);
+		}
+		FILE *f = fdopen(fd, "r");
+		unless (f) {
+			err(1, "fdopen: %s", this->path);
+		}
+		verifydb_load(this->pool, this->entries, f);
+		fclose(f);
+	}
+
+	return this;
+}
+
+void
+verifydb_free(struct VerifyDB *this)
+{
+	if (this) {
+		mempool_free(this->pool);
+		free(this);
+	}
+}
+
+void
+verifydb_load(struct Mempool *pool, struct Map *entries, FILE *f)
+{
+	time_t now = time(NULL);
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	while ((linelen = getline(&line, &linecap, f)) > 0) {
+		char *algorithm = xmalloc(linelen);
+		char *digest = xmalloc(linelen);
+		uintmax_t dev;
+		uintmax_t ino;
+		uintmax_t size;
+		intmax_t mtime_ns;
+		intmax_t ctime_ns;
+		intmax_t last_seen;
+		if (sscanf(line, "%ju %ju %s %ju %jd %jd %s %jd", &dev, &ino, algorithm, &size, &mtime_ns, &ctime_ns, digest, &last_seen) == 8 &&
+		    now - last_seen < VERIFYDB_EXPIRE) {
+			SCOPE_MEMPOOL(key_pool);
+			const char *key = str_printf(key_pool, "%ju %ju %s", dev, ino, algorithm);
+			unless (map_contains(entries, key)) {
+				struct VerifyDBEntry *e = mempool_alloc(pool, sizeof(struct VerifyDBEntry));
+				e->size = size;
+				e->mtime = mtime_ns;
+				e->ctime = ctime_ns;
+				e->digest = str_dup(pool, digest);
+				e->last_seen = last_seen;
+				map_add(entries, str_dup(pool, key), e);
+			}
+		}
+		free(algorithm);
+		free(digest);
+	}
+	free(line);
+}
+
+bool
+verifydb_check(struct VerifyDB *this, struct stat *st, const char *algorithm, const uint8_t *digest, size_t digest_len)
+{
+	SCOPE_MEMPOOL(pool);
+
+	struct VerifyDBEntry *entry = map_get(this->entries, verifydb_key(pool, st, algorithm));
+	unless (entry) {
+		return false;
+	}
+	if (entry->size != (uintmax_t)st->st_size ||
+	    entry->mtime != verifydb_nsec(&st->st_mtim) ||
+	    entry->ctime != verifydb_nsec(&st->st_ctim) ||
+	    strcmp(entry->digest, verifydb_digest(pool, digest, digest_len)) != 0) {
+		return false;
+	}
+
+	time_t now = time(NULL);
+	if (now - entry->last_seen >= VERIFYDB_REFRESH) {
+		entry->last_seen = now;
+		entry->dirty = true;
+		this->dirty = true;
+	}
+	return true;
+}
+
+void
+verifydb_add(struct VerifyDB *this, struct stat *st, const char *algorithm, const uint8_t *digest, size_t digest_len)
+{
+	SCOPE_MEMPOOL(pool);
+
+	const char *key = verifydb_key(pool, st, algorithm);
+	struct VerifyDBEntry *entry = map_get(this->entries, key);
+	unless (entry) {
+		entry = mempool_alloc(this->pool, sizeof(struct VerifyDBEntry));
+		map_add(this->entries, str_dup(this->pool, key), entry);
+	}
+	entry->size = st->st_size;
+	entry->mtime = verifydb_nsec(&st->st_mtim);
+	entry->ctime = verifydb_nsec(&st->st_ctim);
+	entry->digest = str_dup(this->pool, verifydb_digest(pool, digest, digest_len));
+	entry->last_seen = time(NULL);
+	entry->dirty = true;
+	this->dirty = true;
+}
+
+void
+verifydb_save(struct VerifyDB *this)
+{
+	SCOPE_MEMPOOL(pool);
+
+	unless (this->path) {
+		return;
+	}
+
+	// Nothing new means nothing to merge
+	unless (this->dirty) {
+		return;
+	}
+	this->dirty = false;
+
+	// Merge our entries into what other parfetch processes
+	// might have written in the meantime
+	int fd = open(this->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		warn("open: %s", this->path);
+		return;
+	}
+	if (flock(fd, LOCK_EX) == -1) {
+		warn("flock: %s", this->path);
+		close(fd);
+		return;
+	}
+	FILE *f = fdopen(fd, "r+");
+	unless (f) {
+		err(1, "fdopen: %s", this->path);
+	}
+
+	struct Map *entries = mempool_map(pool, str_compare);
+	MAP_FOREACH(this->entries, const char *, key, struct VerifyDBEntry *, entry) {
+		if (entry->dirty) {
+			map_add(entries, key, entry);
+			entry->dirty = false;
+		}
+	}
+	// What the others wrote is only needed until it is written
+	// back out
+	verifydb_load(pool, entries, f);
+
+	if (fseeko(f, 0, SEEK_SET) == -1 || ftruncate(fd, 0) == -1) {
+		warn("could not truncate %s", this->path);
+		fclose(f);
+		return;
+	}
+	MAP_FOREACH(entries, const char *, key, struct VerifyDBEntry *, entry) {
+		fprintf(f, "%s %ju %jd %jd %s %jd\n", key, entry->size, entry->mtime, entry->ctime,
+			entry->digest, (intmax_t)entry->last_seen);
+	}
+	if (fclose(f) != 0) {
+		warn("could not write %s", this->path);
+	}
+}
+
+const char *
+verifydb_digest(struct Mempool *pool, const uint8_t *digest, size_t digest_len)
+{
+	char *hex = mempool_alloc(pool, 2 * digest_len + 1);
+	for (size_t i = 0; i < digest_len; i++) {
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+	}
+	return hex;
+}
+
+const char *
+verifydb_key(struct Mempool *pool, struct stat *st, const char *algorithm)
+{
+	return str_printf(pool, "%ju %ju %s", (uintmax_t)st->st_dev, (uintmax_t)st->st_ino, algorithm);
+}
+
+intmax_t
+verifydb_nsec(struct timespec *ts)
+{
+	return (intmax_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}